@@ -34,7 +34,10 @@
  *      (The file's name, however, is stored elsewhere.)
  *      Each file and directory on the disk corresponds to an inode.
  *      All inodes are stored in the inode blocks.
- *   4. The rest of the disk consists of DATA BLOCKS.
+ *   4. JOURNAL BLOCKS (optional).  If the superblock's 'os_journalnb' is
+ *      nonzero, that many blocks starting at 'os_journalb' hold the
+ *      metadata journal (see JOURNAL below).  Journal blocks are never free.
+ *   5. The rest of the disk consists of DATA BLOCKS.
  *      Each data block belongs to a normal file or to a directory.
  *      Directory data blocks consist of sequences of directory entry
  *      structures, which refer to inodes.
@@ -51,7 +54,8 @@
  *                    (enough to    (enough to
  *                   hold N bits)  hold M inodes)
  *
- *   where X equals the superblock's "s_firstinob" member.
+ *   where X equals the superblock's "s_firstinob" member.  A journal, if
+ *   any, takes the first blocks after the inode blocks.
  *
  *****************************************************************************/
 
@@ -66,9 +70,51 @@ typedef struct ospfs_super {
 	uint32_t os_nblocks;   // Number of blocks on disk
 	uint32_t os_ninodes;   // Number of inodes on disk
 	uint32_t os_firstinob; // First inode block
+	uint32_t os_journalb;  // First journal block
+	uint32_t os_journalnb; // Number of journal blocks (0 means none)
 } ospfs_super_t;
 
 
+/*****************************************************************************
+ * JOURNAL
+ *
+ *   Changes to metadata blocks -- the free block bitmap, inode blocks,
+ *   directory blocks and indirect blocks -- are grouped into transactions.
+ *   A transaction is written to the journal as a descriptor block, listing
+ *   the "home" block number of each changed block; a copy of each changed
+ *   block; and a commit block, whose checksum covers the descriptor's list
+ *   and the copies.  Only once the whole transaction is on disk are the
+ *   changed blocks written to their homes.
+ *
+ *   The journal holds at most one transaction, always starting at the
+ *   journal's first block.  At mount time, a transaction whose descriptor
+ *   and commit blocks agree and whose checksum matches is copied to its
+ *   homes again ("replayed"); anything else is an incomplete transaction
+ *   and is ignored.  Replaying a transaction that already reached its
+ *   homes is harmless.
+ *
+ *   File data is not journaled, but it is written before the transaction
+ *   that allocated its blocks commits.
+ *
+ *****************************************************************************/
+#define OSPFS_JOURNAL_MAGIC	0x013101AF  // Descriptor block
+#define OSPFS_COMMIT_MAGIC	0x013101B0  // Commit block
+
+// Maximum number of blocks in one transaction (limited by the number of
+// home block numbers that fit in a descriptor block).
+#define OSPFS_JOURNAL_NTAGS	(OSPFS_BLKSIZE / 4 - 4)
+
+// A journal descriptor or commit block.
+typedef struct ospfs_journal_block {
+	uint32_t oj_magic;     // OSPFS_JOURNAL_MAGIC or OSPFS_COMMIT_MAGIC
+	uint32_t oj_seq;       // Transaction sequence number
+	uint32_t oj_nblocks;   // Number of blocks in the transaction
+	uint32_t oj_checksum;  // Commit block: CRC-32 of the transaction
+
+	uint32_t oj_blockno[OSPFS_JOURNAL_NTAGS]; // Descriptor block: homes
+} ospfs_journal_block_t;
+
+
 /*****************************************************************************
  * INODES
  *
@@ -179,18 +225,203 @@ typedef struct ospfs_symlink_inode {
  *   If the inode number is 0, then the directory entry is EMPTY; it should
  *   be ignored on reads, and may be used to hold new files.
  *
+ *   The last byte, 'od_type', records the file's type, so that readdir need
+ *   not read the file's inode: it is the file's OSPFS_FTYPE_* plus 1, or 0
+ *   if the type is not recorded (as in images made before the field was
+ *   added, where the byte may hold the end of a 123-byte name).
+ *
  *   The whole structure is 128 bytes long, so the longest filename that can be
- *   stored is 123 bytes (128 bytes - 4 bytes for the inode - 1 byte for the
- *   terminating null character).
+ *   stored is 122 bytes (128 bytes - 4 bytes for the inode - 1 byte for the
+ *   terminating null character - 1 byte for the type).
  *
  *****************************************************************************/
 
 #define OSPFS_DIRENTRY_SIZE	128
-#define OSPFS_MAXNAMELEN	(OSPFS_DIRENTRY_SIZE - 5)
+#define OSPFS_MAXNAMELEN	(OSPFS_DIRENTRY_SIZE - 6)
 
 typedef struct ospfs_direntry {
 	uint32_t od_ino;			// Inode number
 	char od_name[OSPFS_MAXNAMELEN + 1];	// File name
+	uint8_t od_type;			// OSPFS_FTYPE_* + 1, or 0
 } ospfs_direntry_t;
 
+
+/*****************************************************************************
+ * DIRECTORY INDEXES
+ *
+ *   A large directory can carry a hash index, so that finding a name
+ *   touches a couple of blocks rather than the whole directory.  Such a
+ *   directory has OSPFS_MODE_DX set in its inode's 'oi_mode'.  Directories
+ *   without the flag are "linear": just a sequence of directory entries,
+ *   as described above.
+ *
+ *   In an indexed directory, the directory's first block is the ROOT
+ *   index block.  It holds a sorted array of (hash, block) pairs: block
+ *   'dx_block' of the directory holds the names whose hashes are at least
+ *   'dx_hash', and less than the next pair's 'dx_hash'.  The first pair's
+ *   hash is always 0.  If the root's 'dh_levels' is 0, those blocks are
+ *   LEAF blocks, which hold directory entries (or packed records; see
+ *   below).  If 'dh_levels' is 1, they are INTERIOR index blocks with the
+ *   same layout (minus 'dh_levels'), whose pairs in turn name leaf blocks.  'dx_block' is a
+ *   block index within the directory file, not a disk block number.
+ *
+ *   All names with the same hash live in the same leaf.
+ *
+ *****************************************************************************/
+
+// Flags stored in the high bits of 'oi_mode', above the permission bits.
+#define OSPFS_MODE_FLAGS	0xFFFF0000
+#define OSPFS_MODE_DX		0x00010000  // Directory has a hash index
+
+#define OSPFS_DX_MAGIC		0xD1C7DA7A  // First word of an index block
+
+typedef struct ospfs_dx_entry {
+	uint32_t dx_hash;			// Lowest hash in 'dx_block'
+	uint32_t dx_block;			// Directory block index
+} ospfs_dx_entry_t;
+
+typedef struct ospfs_dx_block {
+	uint32_t dh_magic;			// == OSPFS_DX_MAGIC
+	uint16_t dh_count;			// Number of entries in use
+	uint8_t dh_levels;			// Root only: 0 or 1
+	uint8_t dh_reserved;
+	ospfs_dx_entry_t dh_entries[0];
+} ospfs_dx_block_t;
+
+// Number of (hash, block) pairs that fit in an index block.
+#define OSPFS_DX_LIMIT \
+	((OSPFS_BLKSIZE - sizeof(ospfs_dx_block_t)) / sizeof(ospfs_dx_entry_t))
+
+// ospfs_name_hash(name, namelen)
+//	The hash function for directory indexes: 32-bit FNV-1a.
+static inline uint32_t
+ospfs_name_hash(const char *name, int namelen)
+{
+	uint32_t hash = 2166136261U;
+	while (namelen-- > 0)
+		hash = (hash ^ (unsigned char) *name++) * 16777619U;
+	return hash;
+}
+
+
+/*****************************************************************************
+ * PACKED DIRECTORIES
+ *
+ *   A directory with OSPFS_MODE_PACKED set in 'oi_mode' holds variable-length
+ *   RECORDS instead of 128-byte directory entries.  A record is a header,
+ *   'struct ospfs_dirrec', followed by the name (not null-terminated),
+ *   padded to a multiple of 4 bytes.  'dr_reclen' is the distance to the
+ *   next record.  Records never cross a block boundary, so the records in
+ *   each block add up to exactly OSPFS_BLKSIZE bytes.  A record may be
+ *   longer than its name needs; the extra space can hold new records.
+ *
+ *   If the inode number is 0, the record is EMPTY and its whole length is
+ *   free.  Otherwise 'dr_hash' is ospfs_name_hash of the name, so a search
+ *   can skip most records by comparing 'dr_namelen' and 'dr_hash' alone,
+ *   and 'dr_type' is the file's OSPFS_FTYPE_*.
+ *
+ *   Both linear and indexed directories may be packed.  In a packed
+ *   indexed directory, the leaf blocks hold records.  A linear directory
+ *   is packed when it is converted to an indexed one.
+ *
+ *****************************************************************************/
+
+#define OSPFS_MODE_PACKED	0x00020000  // Directory holds packed records
+
+typedef struct ospfs_dirrec {
+	uint32_t dr_ino;			// Inode number, or 0 if empty
+	uint16_t dr_reclen;			// Bytes from here to next record
+	uint8_t dr_namelen;			// Length of 'dr_name'
+	uint8_t dr_type;			// OSPFS_FTYPE_* of the file
+	uint32_t dr_hash;			// ospfs_name_hash(name)
+	char dr_name[0];			// File name, not null-terminated
+} ospfs_dirrec_t;
+
+// Number of bytes a record for a 'namelen'-character name needs.
+#define OSPFS_DIRREC_SIZE(namelen) \
+	((sizeof(ospfs_dirrec_t) + (namelen) + 3) & ~3U)
+
+
+/*****************************************************************************
+ * IOCTLS
+ *
+ *   OSPFS_IOC_READDIRPLUS, on an open directory, reads up to 'rp_count'
+ *   entries starting at the directory's current position, and advances
+ *   the position past them, as getdents does.  For each entry it stores
+ *   the name, inode number, type, size and mode in the 'rp_ents' array,
+ *   so that listing a directory's metadata does not need a stat per name.
+ *   It returns the number of entries stored, which is 0 at the end of the
+ *   directory.  The "." and ".." entries are included.
+ *
+ *   OSPFS_IOC_COMPACT, on an open directory, packs the directory's live
+ *   entries into as few blocks as it can without changing any readdir
+ *   position, and releases the blocks it frees.  It returns the number of
+ *   blocks released.  Like creating a file, it needs write and search
+ *   permission on the directory.
+ *
+ *   OSPFS_IOC_CREATE, on an open directory, creates empty regular files
+ *   named by the 'cb_count' entries of the 'cb_ents' array, in order, with
+ *   the given permissions (less the umask), and stores each new file's
+ *   inode number in its entry.  It stops at the first name that cannot be
+ *   created.  It returns the number of files created, or, if the first
+ *   name fails, its error (-EEXIST if it already exists).  It needs write
+ *   and search permission on the directory.
+ *
+ *   OSPFS_IOC_CHECKPOINT, on an open directory, writes a consistent image
+ *   of the whole file system, as it was just before the call returns, to
+ *   the file open for writing on 'ck_fd', while the file system stays in
+ *   use.  The result can be
+ *   mounted with "-o image=".  With OSPFS_CKPT_INCREMENTAL set in
+ *   'ck_flags', it writes only the blocks changed since the last
+ *   checkpoint, each at its offset, so 'ck_fd' must hold that checkpoint;
+ *   the first checkpoint after mounting is always complete.  Only
+ *   in-memory images support checkpoints, and only one runs at a time
+ *   (-EBUSY).  It needs CAP_SYS_ADMIN, and returns the number of blocks
+ *   written, counting blocks rewritten because they changed meanwhile.
+ *
+ *****************************************************************************/
+
+#include <linux/ioctl.h>
+
+#define OSPFS_IOC_MAGIC		'o'
+
+typedef struct ospfs_statent {
+	uint32_t se_ino;			// Inode number
+	uint32_t se_size;			// File size in bytes
+	uint32_t se_mode;			// Type and permissions, as st_mode
+	uint8_t se_type;			// DT_* type, as in getdents
+	uint8_t se_namelen;			// Length of 'se_name'
+	char se_name[OSPFS_MAXNAMELEN + 1];	// File name, null-terminated
+} ospfs_statent_t;
+
+typedef struct ospfs_readdirplus {
+	uint64_t rp_ents;			// User address of the array
+	uint32_t rp_count;			// Number of entries in the array
+	uint32_t rp_reserved;			// Must be 0
+} ospfs_readdirplus_t;
+
+#define OSPFS_IOC_READDIRPLUS	_IOW(OSPFS_IOC_MAGIC, 1, ospfs_readdirplus_t)
+typedef struct ospfs_createent {
+	uint32_t ce_mode;			// Permissions of the new file
+	uint32_t ce_ino;			// Set to its inode number
+	char ce_name[OSPFS_MAXNAMELEN + 1];	// File name, null-terminated
+} ospfs_createent_t;
+
+typedef struct ospfs_createbatch {
+	uint64_t cb_ents;			// User address of the array
+	uint32_t cb_count;			// Number of entries in the array
+	uint32_t cb_reserved;			// Must be 0
+} ospfs_createbatch_t;
+
+typedef struct ospfs_checkpoint {
+	int32_t ck_fd;				// File to write the image to
+	uint32_t ck_flags;			// OSPFS_CKPT_* flags
+} ospfs_checkpoint_t;
+
+#define OSPFS_CKPT_INCREMENTAL	1		// Only changed blocks
+
+#define OSPFS_IOC_COMPACT	_IO(OSPFS_IOC_MAGIC, 2)
+#define OSPFS_IOC_CREATE	_IOW(OSPFS_IOC_MAGIC, 3, ospfs_createbatch_t)
+#define OSPFS_IOC_CHECKPOINT	_IOW(OSPFS_IOC_MAGIC, 4, ospfs_checkpoint_t)
+
 #endif
@@ -28,6 +28,7 @@ int diskfd;
 uint32_t nblocks;
 uint32_t ninodes;
 uint32_t nbitblock;
+uint32_t njournal = 0;
 uint32_t nextb;
 uint32_t nextinode;
 int verbose = 0;
@@ -173,6 +174,8 @@ swizzleblock(struct Block *b)
 		swizzle(&s->os_nblocks);
 		swizzle(&s->os_ninodes);
 		swizzle(&s->os_firstinob);
+		swizzle(&s->os_journalb);
+		swizzle(&s->os_journalnb);
 		break;
 	case BLOCK_DIR:
 		for (i = 0; i < OSPFS_BLKSIZE; i += OSPFS_DIRENTRY_SIZE) {
@@ -304,15 +307,24 @@ opendisk(const char *name)
 		putblk(b);
 	}
 
-	nextb = OSPFS_FREEMAP_BLK + nbitblock + ninodeblock;
+	// The journal blocks start out zero, meaning an empty journal.
+	nextb = OSPFS_FREEMAP_BLK + nbitblock + ninodeblock + njournal;
 	nextinode = 0;
+	if (nextb >= nblocks) {
+		fprintf(stderr, "No room for the journal!\n");
+		abort();
+	}
 
 	super.os_magic = OSPFS_MAGIC;
 	super.os_nblocks = nblocks;
 	super.os_ninodes = ninodes;
 	super.os_firstinob = OSPFS_FREEMAP_BLK + nbitblock;
+	super.os_journalb = (njournal ? nextb - njournal : 0);
+	super.os_journalnb = njournal;
 	if (verbose)
 		fprintf(stderr, "superblock, free block bitmap %d, first inode block %d, first data block %d\n", OSPFS_FREEMAP_BLK, super.os_firstinob, nextb);
+	if (verbose && njournal)
+		fprintf(stderr, "journal blocks %d to %d\n", super.os_journalb, nextb - 1);
 }
 
 void
@@ -373,7 +385,7 @@ allocinode(uint32_t *ino, struct Block **ib)
 }
 
 struct ospfs_direntry *
-allocdirentry(struct ospfs_inode *dirino, const char *name, struct Block **dirb, int indent)
+allocdirentry(struct ospfs_inode *dirino, const char *name, int ftype, struct Block **dirb, int indent)
 {
 	struct ospfs_inode *ino;
 	struct ospfs_direntry *od;
@@ -422,6 +434,7 @@ new_dirb:
 	
 gotit:
 	strcpy(od->od_name, name);
+	od->od_type = ftype + 1;
 	return od;
 }
 
@@ -448,7 +461,7 @@ writefile(struct ospfs_inode *dirino, const char *name, unsigned long host_ino,
 	else
 		last = name;
 
-	de = allocdirentry(dirino, last, &dirb, indent);
+	de = allocdirentry(dirino, last, OSPFS_FTYPE_REG, &dirb, indent);
 
 	if (link_contents) {
 		unsigned char buf[BUFSIZ];
@@ -544,7 +557,7 @@ addsymlink(struct ospfs_inode *dirino, const char *name, const char *linkbuf, un
 	else
 		last = name;
 
-	de = allocdirentry(dirino, last, &dirb, indent);
+	de = allocdirentry(dirino, last, OSPFS_FTYPE_SYMLINK, &dirb, indent);
 
 	if (host_ino)
 		hardlink_ino = get_hardlink(host_ino, 0);
@@ -624,7 +637,7 @@ writedirectory(struct ospfs_inode *parentdirino, char *name, int root, int inden
 		else
 			last = name;
 
-		dirod = allocdirentry(parentdirino, last, &dirb, indent);
+		dirod = allocdirentry(parentdirino, last, OSPFS_FTYPE_DIR, &dirb, indent);
 		dirino = allocinode(&dirod->od_ino, &inob);
 		parentdirino->oi_nlink++;
 		dirino->oi_ftype = OSPFS_FTYPE_DIR;
@@ -723,9 +736,10 @@ flushdisk(void)
 void
 usage(void)
 {
-	fprintf(stderr, "Usage: ospfsformat [-c] [-l SRC:DST] fs.img NBLOCKS NINODES files...\n\
-       ospfsformat [-c] [-l SRC:DST] fs.img NBLOCKS NINODES -r DIR\n\
+	fprintf(stderr, "Usage: ospfsformat [-c] [-j NJOURNAL] [-l SRC:DST] fs.img NBLOCKS NINODES files...\n\
+       ospfsformat [-c] [-j NJOURNAL] [-l SRC:DST] fs.img NBLOCKS NINODES -r DIR\n\
   \"-c\" means treat files with identical contents as hard links.\n\
+  \"-j NJOURNAL\" means reserve NJOURNAL blocks for the metadata journal.\n\
   \"-l SRC:DST\" means add a symbolic link from SRC to DST.\n");
 	abort();
 }
@@ -757,6 +771,15 @@ main(int argc, char **argv)
 		argc--, argv++, link_contents = 1;
 		goto option;
 	}
+	if (argc > 1 && strcmp(argv[1], "-j") == 0) {
+		if (argc < 3)
+			usage();
+		njournal = strtol(argv[2], &s, 0);
+		if (*s || s == argv[2] || (njournal != 0 && njournal < 3))
+			usage();
+		argc -= 2, argv += 2;
+		goto option;
+	}
 	if (argc > 1 && strcmp(argv[1], "-l") == 0) {
 		struct linkrecord *nl;
 		if (argc < 3 || strchr(argv[2], ':') == 0)
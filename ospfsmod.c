@@ -11,10 +11,27 @@
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/namei.h>
+#include <linux/buffer_head.h>
+#include <linux/vmalloc.h>
+#include <linux/parser.h>
+#include <linux/mutex.h>
+#include <linux/sort.h>
+#include <linux/rcupdate.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/crc32.h>
 #include <asm/uaccess.h>
 #include <linux/kernel.h>
 #include <linux/sched.h>
 
+// The journal checksums its transactions with crc32_le.
+#if !defined(CONFIG_CRC32) && !defined(CONFIG_CRC32_MODULE)
+# error "OSPFS needs a kernel built with CONFIG_CRC32"
+#endif
+
 /****************************************************************************
  * ospfsmod
  *
@@ -31,17 +48,144 @@
  * and KERN_EMERG will make sure that you will see messages.) */
 #define eprintk(format, ...) printk(KERN_NOTICE format, ## __VA_ARGS__)
 
-// The actual disk data is just an array of raw memory.
+// The compiled-in disk data is just an array of raw memory.
 // The initial array is defined in fsimg.c, based on your 'base' directory.
+// It is used when OSPFS is mounted without a block device
+// ("mount -t ospfs none DIR").
 extern uint8_t ospfs_data[];
 extern uint32_t ospfs_length;
 
-// A pointer to the superblock; see ospfs.h for details on the struct.
-static ospfs_super_t * const ospfs_super =
-	(ospfs_super_t *) &ospfs_data[OSPFS_BLKSIZE];
+// Per-mount state, hung off the Linux superblock's 's_fs_info'.
+//
+// An OSPFS is backed either by an in-memory image ('osb_data'), or by a
+// block device ("mount -t ospfs /dev/loop0 DIR").  On a block device, each
+// block is read through the buffer cache the first time it is used, and
+// its buffer head stays pinned in 'osb_bh' until the file system is
+// unmounted, so pointers returned by ospfs_block() remain valid just as
+// they do for the in-memory image.
+//
+// An in-memory image can also be given a backing file with the
+// "backing=FILE" mount option.  Every block changed since the last sync is
+// then recorded in the 'osb_dirty' bitmap, and ospfs_sync_fs() writes just
+// those blocks to the file, merging runs of adjacent dirty blocks into
+// single sequential writes.
+//
+// If the image has a journal and changes can reach a disk (a block device,
+// or a backing file), changed metadata blocks are instead recorded in
+// 'osb_jdirty', and ospfs_journal_commit() writes them through the journal
+// (see "JOURNAL" in ospfs.h).  Every operation that changes metadata runs
+// between ospfs_journal_start() and ospfs_journal_stop(), which hold
+// 'osb_jsem' shared; a commit takes it exclusive for just long enough to
+// copy the changed blocks into 'osb_jbuf', so the copies never contain
+// half an operation.  Each commit carries every operation finished since
+// the last one, however many there were.
+//
+// Either way, a per-mount thread ('osb_wb_task') does the writing in the
+// background, so operations never wait for the disk: see
+// ospfs_writeback_thread().  Without a journal, 'osb_meta' marks which
+// dirty blocks hold metadata, so that file data can be written first.
+//
+// An in-memory image can be checkpointed while in use (see
+// ospfs_checkpoint()).  'osb_ckdirty' records the blocks changed since the
+// last checkpoint, for incremental checkpoints, and since the last pass of
+// a running checkpoint.
+typedef struct ospfs_sb_info {
+	uint8_t *osb_data;		// In-memory image, or NULL
+	int osb_data_owned;		// Set if 'osb_data' was vmalloc()ed
+	struct buffer_head **osb_bh;	// Block device: pinned buffers
+	uint32_t osb_nblocks;		// Number of blocks usable
+	ospfs_super_t *osb_super;	// The OSPFS superblock (block 1)
+
+	struct file *osb_backing;	// Backing file for 'osb_data', or NULL
+	unsigned long *osb_dirty;	// Blocks not yet written to it
+	unsigned long *osb_meta;	// Which of those are metadata
+	atomic_t osb_ndirty;		// Number of bits set in 'osb_dirty'
+	struct mutex osb_sync_mutex;	// Serializes flushes
+	struct mutex osb_alloc_mutex;	// Protects block and inode allocation
+	unsigned long *osb_orphans;	// Inodes unlinked but still open
+
+	uint32_t osb_jstart;		// First journal block
+	uint32_t osb_jmax;		// Most blocks in a transaction, or 0
+					// if not journaling
+	struct rw_semaphore osb_jsem;	// Held shared by running operations
+	unsigned long *osb_jdirty;	// Metadata blocks changed since the
+					// last commit
+	atomic_t osb_jcount;		// Number of bits set in 'osb_jdirty'
+	unsigned long *osb_jfreed;	// Blocks freed since the last commit;
+	unsigned long *osb_jfreeing;	// and by the commit in progress
+	char *osb_jbuf;			// Commit buffer: descriptor, copies
+					// and commit block
+	uint32_t osb_jseq;		// Sequence number of the next commit
+	unsigned long osb_jtid;		// Transaction now accepting changes
+	unsigned long osb_jcommitted;	// Last transaction fully written
+
+	struct task_struct *osb_wb_task; // Background writeback thread
+	unsigned long osb_wb_flags;	// OSPFS_WB_* bits
+	unsigned long osb_dirtied;	// When the oldest unwritten change
+					// was made, in jiffies
+
+	struct mutex osb_ckpt_mutex;	// Held while a checkpoint runs
+	unsigned long *osb_ckdirty;	// Blocks changed since the last
+					// checkpoint (or checkpoint pass)
+
+	int osb_id;			// Instance number, for /proc/fs/ospfs
+	struct ospfs_stats *osb_stats;	// Per-CPU operation statistics
+	struct proc_dir_entry *osb_proc; // /proc/fs/ospfs/<osb_id>
+	struct proc_dir_entry *osb_stats_entry; // ... and its "stats"
+} ospfs_sb_info_t;
+
+static inline ospfs_sb_info_t *
+OSPFS_SB(struct super_block *sb)
+{
+	return (ospfs_sb_info_t *) sb->s_fs_info;
+}
+
+// Per-inode in-core state.  Linux allocates every OSPFS 'struct inode'
+// embedded in one of these, from 'ospfs_inode_cachep'.
+//
+// Locking.  A file's data and size are protected by 'oii_rwsem': reads
+// take it shared, so any number run at once, and writes, truncates and
+// ospfs_delete_inode() take it exclusive.  A directory's entries are
+// protected by its i_mutex, which Linux already holds around lookup,
+// readdir and every directory-changing operation (the ioctls take it
+// themselves).  The free-block bitmap, the choice of a free inode and
+// the orphan bitmap are protected by the per-mount 'osb_alloc_mutex',
+// held only inside allocate_block(), free_block(), ospfs_alloc_ino() and
+// briefly when an inode becomes or stops being an orphan.  Locks nest in
+// that order: directory i_mutex, then 'oii_rwsem', then the allocator.
+// A journal handle ('osb_jsem') is taken just inside the i_mutex.
+//
+// 'oii_blocks' caches the physical block number of each of the file's
+// blocks, so reads and writes need not walk the indirect blocks.  It is
+// built on first use by ospfs_file_blockno() and thrown away by
+// ospfs_blockmap_drop() whenever add_block() or remove_block() (and so
+// change_size()) changes the file's block pointers.  'oii_gen' counts the
+// drops, so a map built while the file was changing is not installed.
+typedef struct ospfs_inode_info {
+	struct rw_semaphore oii_rwsem;	// Protects file data and size
+	spinlock_t oii_lock;		// Protects the fields below
+	uint32_t *oii_blocks;		// Block map, or NULL if not built
+	uint32_t oii_nblocks;		// Number of entries in 'oii_blocks'
+	unsigned oii_gen;		// Bumped by every ospfs_blockmap_drop()
+	struct inode oii_vfs_inode;	// The Linux inode
+} ospfs_inode_info_t;
+
+static inline ospfs_inode_info_t *
+OSPFS_I(struct inode *inode)
+{
+	return container_of(inode, ospfs_inode_info_t, oii_vfs_inode);
+}
+
+// Files with more blocks than this are not given a block map; their
+// lookups walk the indirect blocks.
+#define OSPFS_BLKMAP_MAX	(8 * PAGE_SIZE / sizeof(uint32_t))
+
+static struct kmem_cache *ospfs_inode_cachep;
 
-static int change_size(ospfs_inode_t *oi, uint32_t want_size);
-static ospfs_direntry_t *find_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen);
+static int add_block(struct inode *inode);
+static int change_size(struct inode *inode, uint32_t want_size);
+static void ospfs_dcache_drop(struct super_block *sb, ino_t ino);
+static void ospfs_dcache_drop_all(struct super_block *sb);
 
 
 /*****************************************************************************
@@ -80,17 +224,414 @@ static struct file_system_type ospfs_fs_type;
 // Inode and file operations for regular files
 static struct inode_operations ospfs_reg_inode_ops;
 static struct file_operations ospfs_reg_file_ops;
+static struct address_space_operations ospfs_aops;
 // Inode and file operations for directories
 static struct inode_operations ospfs_dir_inode_ops;
 static struct file_operations ospfs_dir_file_ops;
 // Inode operations for symbolic links
 static struct inode_operations ospfs_symlink_inode_ops;
 // Other required operations
-static struct dentry_operations ospfs_dentry_ops;
 static struct super_operations ospfs_superblock_ops;
 
 
 
+/*****************************************************************************
+ * OPERATION STATISTICS
+ *
+ *   Counters for the hot operations, and log2 latency histograms for a
+ *   few of them, kept per mount and per CPU so that updating one costs a
+ *   few instructions with preemption off and never touches a shared cache
+ *   line.  Each mount is given an instance number, shown as "instance=N"
+ *   in /proc/mounts; /proc/fs/ospfs/N/stats adds up every CPU's copy of
+ *   that mount's numbers when read.
+ */
+
+enum {
+	OSPFS_STAT_READ,		// ospfs_read calls
+	OSPFS_STAT_READ_BYTES,		// bytes they returned
+	OSPFS_STAT_WRITE,		// ospfs_write calls
+	OSPFS_STAT_WRITE_BYTES,		// bytes they wrote
+	OSPFS_STAT_LOOKUP,		// ospfs_dir_lookup calls
+	OSPFS_STAT_CREATE,		// files and symlinks created
+	OSPFS_STAT_UNLINK,		// names unlinked
+	OSPFS_STAT_BLOCK_ALLOC,		// blocks allocated
+	OSPFS_STAT_BLOCK_FREE,		// blocks freed
+	OSPFS_STAT_ENOSPC,		// block or inode allocations that failed
+	OSPFS_STAT_JOURNAL_COMMIT,	// journal transactions committed
+	OSPFS_STAT_JOURNAL_BLOCKS,	// metadata blocks they carried
+	OSPFS_STAT_WRITEBACK,		// background writebacks
+	OSPFS_STAT_THROTTLE,		// writes that had to write back first
+	OSPFS_STAT_CHECKPOINT,		// checkpoints written
+	OSPFS_STAT_CHECKPOINT_BLOCKS,	// blocks they wrote
+	OSPFS_NSTATS
+};
+
+enum {
+	OSPFS_LAT_READ,
+	OSPFS_LAT_WRITE,
+	OSPFS_LAT_LOOKUP,
+	OSPFS_LAT_CHANGE_SIZE,
+	OSPFS_NLATS
+};
+
+// Bucket 'i' counts calls that took [2^i, 2^(i+1)) nanoseconds; the last
+// bucket also counts anything slower.
+#define OSPFS_LAT_BUCKETS	32
+
+typedef struct ospfs_stats {
+	uint64_t st_count[OSPFS_NSTATS];
+	uint64_t st_lat[OSPFS_NLATS][OSPFS_LAT_BUCKETS];
+} ospfs_stats_t;
+
+static const char *ospfs_stat_names[OSPFS_NSTATS] = {
+	"read", "read_bytes", "write", "write_bytes", "lookup", "create",
+	"unlink", "block_alloc", "block_free", "enospc", "journal_commits",
+	"journal_blocks", "writebacks", "write_throttled", "checkpoints",
+	"checkpoint_blocks"
+};
+
+static const char *ospfs_lat_names[OSPFS_NLATS] = {
+	"read", "write", "lookup", "change_size"
+};
+
+static struct proc_dir_entry *ospfs_proc_dir;
+static atomic_t ospfs_instances = ATOMIC_INIT(0);
+
+// A stats file can stay open after its mount is gone, so it finds the
+// mount through its proc entry's 'data', which ospfs_stats_release()
+// clears under this lock.
+static DEFINE_SPINLOCK(ospfs_stats_lock);
+
+
+// ospfs_stat_add(sb, stat, n)
+//	Adds 'n' to counter 'stat' of file system 'sb' on this CPU.
+
+static inline void
+ospfs_stat_add(struct super_block *sb, int stat, uint64_t n)
+{
+	ospfs_stats_t *st = per_cpu_ptr(OSPFS_SB(sb)->osb_stats, get_cpu());
+	st->st_count[stat] += n;
+	put_cpu();
+}
+
+
+// ospfs_stat_time(sb, lat, start)
+//	Records a call that began at 'start' (from ktime_get()) in latency
+//	histogram 'lat' of file system 'sb' on this CPU.
+
+static inline void
+ospfs_stat_time(struct super_block *sb, int lat, ktime_t start)
+{
+	int64_t ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	int b = (ns <= 0 ? 0 : (ns >= 0xFFFFFFFFLL ? 32 : fls((uint32_t) ns)) - 1);
+
+	if (b < 0)
+		b = 0;
+	else if (b >= OSPFS_LAT_BUCKETS)
+		b = OSPFS_LAT_BUCKETS - 1;
+	per_cpu_ptr(OSPFS_SB(sb)->osb_stats, get_cpu())->st_lat[lat][b]++;
+	put_cpu();
+}
+
+
+// ospfs_stats_show(m, v)
+//	Prints /proc/fs/ospfs/N/stats: one "name value" line per counter, then
+//	one line per histogram, "name_ns" followed by its bucket counts.  The
+//	file is empty once the file system is unmounted.
+
+static int
+ospfs_stats_show(struct seq_file *m, void *v)
+{
+	struct proc_dir_entry *entry = m->private;
+	ospfs_sb_info_t *osb;
+	ospfs_stats_t sum;
+	int cpu, i, b;
+
+	memset(&sum, 0, sizeof(sum));
+	spin_lock(&ospfs_stats_lock);
+	if (!(osb = entry->data)) {
+		spin_unlock(&ospfs_stats_lock);
+		return 0;
+	}
+	for_each_possible_cpu(cpu) {
+		ospfs_stats_t *st = per_cpu_ptr(osb->osb_stats, cpu);
+		for (i = 0; i < OSPFS_NSTATS; i++)
+			sum.st_count[i] += st->st_count[i];
+		for (i = 0; i < OSPFS_NLATS; i++)
+			for (b = 0; b < OSPFS_LAT_BUCKETS; b++)
+				sum.st_lat[i][b] += st->st_lat[i][b];
+	}
+	spin_unlock(&ospfs_stats_lock);
+
+	for (i = 0; i < OSPFS_NSTATS; i++)
+		seq_printf(m, "%s %llu\n", ospfs_stat_names[i],
+			   (unsigned long long) sum.st_count[i]);
+	for (i = 0; i < OSPFS_NLATS; i++) {
+		seq_printf(m, "%s_ns", ospfs_lat_names[i]);
+		for (b = 0; b < OSPFS_LAT_BUCKETS; b++)
+			seq_printf(m, " %llu", (unsigned long long) sum.st_lat[i][b]);
+		seq_putc(m, '\n');
+	}
+	return 0;
+}
+
+static int
+ospfs_stats_open(struct inode *inode, struct file *file)
+{
+	// The entry outlives its removal while the file is open.
+	return single_open(file, ospfs_stats_show, PDE(inode));
+}
+
+static struct file_operations ospfs_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ospfs_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release
+};
+
+
+// ospfs_stats_setup(sb), ospfs_stats_release(sb)
+//	Give a new mount its instance number, statistics and
+//	/proc/fs/ospfs/N directory, and take them away at unmount.
+//
+//   Returns: 0 on success, -ENOMEM if out of memory.
+
+static int
+ospfs_stats_setup(struct super_block *sb)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	struct proc_dir_entry *entry;
+	char name[16];
+
+	osb->osb_id = atomic_inc_return(&ospfs_instances) - 1;
+	if (!(osb->osb_stats = alloc_percpu(ospfs_stats_t)))
+		return -ENOMEM;
+
+	sprintf(name, "%d", osb->osb_id);
+	if (!(osb->osb_proc = proc_mkdir(name, ospfs_proc_dir)))
+		return -ENOMEM;
+	if (!(entry = create_proc_entry("stats", S_IRUGO, osb->osb_proc))) {
+		remove_proc_entry(name, ospfs_proc_dir);
+		osb->osb_proc = NULL;
+		return -ENOMEM;
+	}
+	entry->data = osb;
+	entry->proc_fops = &ospfs_stats_fops;
+	osb->osb_stats_entry = entry;
+	return 0;
+}
+
+static void
+ospfs_stats_release(struct super_block *sb)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	char name[16];
+
+	if (osb->osb_stats_entry) {
+		spin_lock(&ospfs_stats_lock);
+		osb->osb_stats_entry->data = NULL;
+		spin_unlock(&ospfs_stats_lock);
+	}
+	if (osb->osb_proc) {
+		remove_proc_entry("stats", osb->osb_proc);
+		sprintf(name, "%d", osb->osb_id);
+		remove_proc_entry(name, ospfs_proc_dir);
+	}
+	if (osb->osb_stats)
+		free_percpu(osb->osb_stats);
+}
+
+
+/*****************************************************************************
+ * OPERATION TRACING
+ *
+ *   When tracing is on ("echo 1 > /sys/module/ospfs/parameters/trace"),
+ *   each traced operation appends a record to a ring buffer holding the
+ *   most recent OSPFS_TRACE_SIZE records, which /proc/fs/ospfs/trace
+ *   prints, oldest first, one per line:
+ *
+ *	time_ns cpu instance event ino offset length block result
+ *
+ *   What 'ino', 'offset', 'length' and 'block' mean depends on the event;
+ *   see ospfs_trace_names.  When tracing is off, a trace point costs one
+ *   test of 'ospfs_trace_enabled'.
+ */
+
+enum {
+	OSPFS_TR_READ,		// file, start offset, bytes asked, 0
+	OSPFS_TR_WRITE,		// file, start offset, bytes asked, 0
+	OSPFS_TR_ALLOC,		// 0, 0, bitmap blocks scanned, block
+	OSPFS_TR_FREE,		// 0, 0, 0, block
+	OSPFS_TR_CHANGE_SIZE,	// file, old size, new size, blocks after
+	OSPFS_TR_LOOKUP,	// directory, entry offset, name length, entry's inode
+	OSPFS_TR_BLANK,		// directory, entry offset, name length, blocks after
+	OSPFS_TR_UNLINK,	// directory, entry offset, name length, entry's inode
+	OSPFS_NTR
+};
+
+static const char *ospfs_trace_names[OSPFS_NTR] = {
+	"read", "write", "alloc", "free", "change_size", "lookup",
+	"blank_direntry", "unlink"
+};
+
+#define OSPFS_TRACE_SIZE	4096	// records kept; a power of 2
+
+typedef struct ospfs_trace_rec {
+	uint64_t tr_time;		// nanoseconds, from ktime_get()
+	uint16_t tr_event;		// OSPFS_TR_*
+	uint16_t tr_cpu;
+	int32_t tr_id;			// instance number of the mount
+	int32_t tr_result;		// return value, or -(error code)
+	uint32_t tr_ino;
+	uint32_t tr_off;
+	uint32_t tr_len;
+	uint32_t tr_block;
+} ospfs_trace_rec_t;
+
+static int ospfs_trace_enabled;
+module_param_named(trace, ospfs_trace_enabled, bool, 0644);
+MODULE_PARM_DESC(trace, "Record OSPFS operations in /proc/fs/ospfs/trace");
+
+static ospfs_trace_rec_t *ospfs_trace_ring;
+static uint32_t ospfs_trace_head;	// records ever written
+static DEFINE_SPINLOCK(ospfs_trace_lock);
+
+#define ospfs_trace(sb, event, ino, off, len, block, result)		\
+	do {								\
+		if (unlikely(ospfs_trace_enabled))			\
+			ospfs_trace_record((sb), (event), (ino), (off),	\
+					   (len), (block), (result));	\
+	} while (0)
+
+
+// ospfs_trace_record(sb, event, ino, off, len, block, result)
+//	Appends a record for file system 'sb' to the trace ring.  Use the
+//	ospfs_trace() macro, which skips the call when tracing is off.
+
+static void
+ospfs_trace_record(struct super_block *sb, int event, uint32_t ino, uint32_t off, uint32_t len, uint32_t block, int result)
+{
+	ospfs_trace_rec_t *tr;
+
+	spin_lock(&ospfs_trace_lock);
+	tr = &ospfs_trace_ring[ospfs_trace_head++ & (OSPFS_TRACE_SIZE - 1)];
+	tr->tr_time = ktime_to_ns(ktime_get());
+	tr->tr_event = event;
+	tr->tr_cpu = smp_processor_id();
+	tr->tr_id = OSPFS_SB(sb)->osb_id;
+	tr->tr_result = result;
+	tr->tr_ino = ino;
+	tr->tr_off = off;
+	tr->tr_len = len;
+	tr->tr_block = block;
+	spin_unlock(&ospfs_trace_lock);
+}
+
+
+// ospfs_trace_start, ospfs_trace_next, ospfs_trace_stop, ospfs_trace_show
+//	The seq_file iterator for /proc/fs/ospfs/trace.  The ring is locked
+//	from start to stop; seq_file stops before copying to user space.
+//	Position 'pos' is the 'pos'th oldest record still in the ring.
+
+static ospfs_trace_rec_t *
+ospfs_trace_at(loff_t pos)
+{
+	uint32_t n = (ospfs_trace_head < OSPFS_TRACE_SIZE ? ospfs_trace_head : OSPFS_TRACE_SIZE);
+
+	if (pos >= n)
+		return NULL;
+	return &ospfs_trace_ring[(ospfs_trace_head - n + (uint32_t) pos) & (OSPFS_TRACE_SIZE - 1)];
+}
+
+static void *
+ospfs_trace_start(struct seq_file *m, loff_t *pos)
+{
+	spin_lock(&ospfs_trace_lock);
+	return ospfs_trace_at(*pos);
+}
+
+static void *
+ospfs_trace_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	return ospfs_trace_at(++*pos);
+}
+
+static void
+ospfs_trace_stop(struct seq_file *m, void *v)
+{
+	spin_unlock(&ospfs_trace_lock);
+}
+
+static int
+ospfs_trace_show(struct seq_file *m, void *v)
+{
+	ospfs_trace_rec_t *tr = (ospfs_trace_rec_t *) v;
+
+	seq_printf(m, "%llu %u %d %s %u %u %u %u %d\n",
+		   (unsigned long long) tr->tr_time, tr->tr_cpu, tr->tr_id,
+		   ospfs_trace_names[tr->tr_event], tr->tr_ino, tr->tr_off,
+		   tr->tr_len, tr->tr_block, tr->tr_result);
+	return 0;
+}
+
+static struct seq_operations ospfs_trace_seq_ops = {
+	.start	= ospfs_trace_start,
+	.next	= ospfs_trace_next,
+	.stop	= ospfs_trace_stop,
+	.show	= ospfs_trace_show
+};
+
+static int
+ospfs_trace_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &ospfs_trace_seq_ops);
+}
+
+static struct file_operations ospfs_trace_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ospfs_trace_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= seq_release
+};
+
+
+// ospfs_proc_init, ospfs_proc_exit
+//	Create and remove /proc/fs/ospfs, and the trace ring, at module load
+//	and unload.
+
+static int
+ospfs_proc_init(void)
+{
+	struct proc_dir_entry *entry;
+
+	if (!(ospfs_trace_ring = vmalloc(OSPFS_TRACE_SIZE * sizeof(ospfs_trace_rec_t))))
+		return -ENOMEM;
+	if (!(ospfs_proc_dir = proc_mkdir("fs/ospfs", NULL)))
+		goto fail;
+	if (!(entry = create_proc_entry("trace", S_IRUSR, ospfs_proc_dir)))
+		goto fail_dir;
+	entry->proc_fops = &ospfs_trace_fops;
+	return 0;
+
+    fail_dir:
+	remove_proc_entry("fs/ospfs", NULL);
+    fail:
+	vfree(ospfs_trace_ring);
+	return -ENOMEM;
+}
+
+static void
+ospfs_proc_exit(void)
+{
+	remove_proc_entry("trace", ospfs_proc_dir);
+	remove_proc_entry("fs/ospfs", NULL);
+	vfree(ospfs_trace_ring);
+}
+
+
+
 /*****************************************************************************
  * BITVECTOR OPERATIONS
  *
@@ -139,189 +680,3737 @@ ospfs_size2nblocks(uint32_t size)
 }
 
 
-// ospfs_block(blockno)
+// ospfs_block(sb, blockno)
 //	Use this function to load a block's contents from "disk".
 //
-//   Input:   blockno -- block number
-//   Returns: a pointer to that block's data
+//   Inputs:  sb      -- the Linux super_block for this OSPFS
+//	      blockno -- block number
+//   Returns: a pointer to that block's data, or NULL if 'blockno' is out
+//	      of range or the block device could not read it
+
+static void *
+ospfs_block(struct super_block *sb, uint32_t blockno)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	struct buffer_head *bh;
+
+	if (blockno >= osb->osb_nblocks)
+		return NULL;
+	if (osb->osb_data)
+		return &osb->osb_data[blockno * OSPFS_BLKSIZE];
+
+	if (!(bh = osb->osb_bh[blockno])) {
+		if (!(bh = sb_bread(sb, blockno))) {
+			eprintk("ospfs: I/O error reading block %u\n", blockno);
+			return NULL;
+		}
+		// Someone else may have pinned the block meanwhile.
+		if (cmpxchg(&osb->osb_bh[blockno], NULL, bh) != NULL) {
+			brelse(bh);
+			bh = osb->osb_bh[blockno];
+		}
+	}
+	return bh->b_data;
+}
+
+
+// Background writeback.  Changes are written once the oldest of them is
+// 'dirty_expire_ms' old, or once 'dirty_bytes' worth of blocks are dirty,
+// whichever comes first.  A write that finds twice 'dirty_bytes' dirty
+// writes back itself before returning, which bounds how far the disk can
+// fall behind.
+
+static unsigned int ospfs_dirty_expire_ms = 5000;
+module_param_named(dirty_expire_ms, ospfs_dirty_expire_ms, uint, 0644);
+MODULE_PARM_DESC(dirty_expire_ms, "Age in ms at which OSPFS changes are written back");
+
+static unsigned int ospfs_dirty_bytes = 1 << 20;
+module_param_named(dirty_bytes, ospfs_dirty_bytes, uint, 0644);
+MODULE_PARM_DESC(dirty_bytes, "Amount of dirty OSPFS blocks that starts writeback");
+
+enum {
+	OSPFS_WB_DIRTY,			// Something is waiting to be written
+	OSPFS_WB_KICKED			// ... and 'dirty_bytes' were reached
+};
+
+
+// ospfs_dirty_bytes_now(osb)
+//	Returns the number of bytes of blocks waiting to be written.
+
+static inline unsigned long
+ospfs_dirty_bytes_now(ospfs_sb_info_t *osb)
+{
+	return (unsigned long) (atomic_read(&osb->osb_ndirty)
+				+ atomic_read(&osb->osb_jcount)) * OSPFS_BLKSIZE;
+}
+
+
+// ospfs_writeback_note(osb)
+//	Called when a block becomes dirty.  Starts the clock on the first
+//	change since the last writeback, and wakes the writeback thread then,
+//	so it can time the change's expiry, and again once 'dirty_bytes' are
+//	dirty.
+
+static inline void
+ospfs_writeback_note(ospfs_sb_info_t *osb)
+{
+	if (!osb->osb_wb_task)
+		return;
+	if (!test_and_set_bit(OSPFS_WB_DIRTY, &osb->osb_wb_flags)) {
+		osb->osb_dirtied = jiffies;
+		wake_up_process(osb->osb_wb_task);
+	}
+	if (ospfs_dirty_bytes_now(osb) >= ospfs_dirty_bytes
+	    && !test_and_set_bit(OSPFS_WB_KICKED, &osb->osb_wb_flags))
+		wake_up_process(osb->osb_wb_task);
+}
+
+
+// ospfs_block_dirty(sb, blockno)
+//	Call this function after changing a block's contents through a
+//	pointer returned by ospfs_block.  On a block device this schedules the
+//	block to be written back.  An in-memory image with a backing file
+//	records the block in the dirty bitmap, which ospfs_sync_fs() flushes.
+
+static void
+ospfs_block_dirty(struct super_block *sb, uint32_t blockno)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	if (blockno >= osb->osb_nblocks)
+		return;
+	if (osb->osb_ckdirty)
+		set_bit(blockno, osb->osb_ckdirty);
+	if (osb->osb_dirty) {
+		if (!test_and_set_bit(blockno, osb->osb_dirty)) {
+			atomic_inc(&osb->osb_ndirty);
+			ospfs_writeback_note(osb);
+		}
+	} else if (!osb->osb_data && osb->osb_bh[blockno])
+		mark_buffer_dirty(osb->osb_bh[blockno]);
+}
+
+
+// ospfs_meta_dirty(sb, blockno)
+//	Like ospfs_block_dirty, but for a metadata block: part of the free
+//	block bitmap, an inode block, a directory block or an indirect block.
+//	If the file system is journaling, the block goes into the running
+//	transaction instead, and reaches its home only after that commits.
+
+static void
+ospfs_meta_dirty(struct super_block *sb, uint32_t blockno)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	if (blockno >= osb->osb_nblocks)
+		return;
+	if (!osb->osb_jmax) {
+		if (osb->osb_meta)
+			set_bit(blockno, osb->osb_meta);
+		ospfs_block_dirty(sb, blockno);
+	} else {
+		if (osb->osb_ckdirty)
+			set_bit(blockno, osb->osb_ckdirty);
+		if (!test_and_set_bit(blockno, osb->osb_jdirty)) {
+			atomic_inc(&osb->osb_jcount);
+			ospfs_writeback_note(osb);
+		}
+	}
+}
+
+
+// ospfs_journal_freed(osb, blockno)
+//	Returns nonzero if 'blockno' was freed by a transaction that is not
+//	yet on disk.  Such a block must not be reused: after a crash it still
+//	belongs to its old owner, which new contents would corrupt.
+
+static inline int
+ospfs_journal_freed(ospfs_sb_info_t *osb, uint32_t blockno)
+{
+	return osb->osb_jmax && (test_bit(blockno, osb->osb_jfreed)
+				 || test_bit(blockno, osb->osb_jfreeing));
+}
+
+
+// ospfs_block_unpin(sb, blockno, discard)
+//	Drops a block device's pinned buffer for 'blockno', if any, so the
+//	next ospfs_block() rereads it from the device.  Used around direct
+//	I/O, which bypasses the buffer cache.  A dirty buffer is first written
+//	to the device, unless 'discard' is set because the caller is about to
+//	overwrite the whole block anyway.
+
+static void
+ospfs_block_unpin(struct super_block *sb, uint32_t blockno, int discard)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	struct buffer_head *bh;
+
+	if (osb->osb_data || blockno >= osb->osb_nblocks
+	    || !(bh = xchg(&osb->osb_bh[blockno], NULL)))
+		return;
+	if (discard)
+		bforget(bh);
+	else {
+		if (buffer_dirty(bh))
+			sync_dirty_buffer(bh);
+		brelse(bh);
+	}
+}
+
+
+// ospfs_block_zero(sb, blockno, meta)
+//	Like ospfs_block, but for a block that was just allocated: its old
+//	contents are not read from disk, and it is returned zero-filled and
+//	marked dirty.  Set 'meta' if the block will hold metadata (see
+//	ospfs_meta_dirty).
+//
+//   Returns: a pointer to that block's data, or NULL on error
 
 static void *
-ospfs_block(uint32_t blockno)
+ospfs_block_zero(struct super_block *sb, uint32_t blockno, int meta)
 {
-	return &ospfs_data[blockno * OSPFS_BLKSIZE];
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	struct buffer_head *bh = NULL;
+	void *data;
+
+	if (blockno >= osb->osb_nblocks)
+		return NULL;
+	if (osb->osb_data) {
+		data = &osb->osb_data[blockno * OSPFS_BLKSIZE];
+		memset(data, 0, OSPFS_BLKSIZE);
+	} else {
+		if (!(bh = osb->osb_bh[blockno])) {
+			if (!(bh = sb_getblk(sb, blockno)))
+				return NULL;
+			if (cmpxchg(&osb->osb_bh[blockno], NULL, bh) != NULL) {
+				brelse(bh);
+				bh = osb->osb_bh[blockno];
+			}
+		}
+		lock_buffer(bh);
+		memset(bh->b_data, 0, OSPFS_BLKSIZE);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		data = bh->b_data;
+	}
+
+	// A journaled block may only reach its home from a committed copy,
+	// so cancel any direct write left over from the block's last use.
+	if (meta && osb->osb_jmax) {
+		if (bh)
+			clear_buffer_dirty(bh);
+		else if (test_and_clear_bit(blockno, osb->osb_dirty))
+			atomic_dec(&osb->osb_ndirty);
+		ospfs_meta_dirty(sb, blockno);
+	} else if (meta)
+		ospfs_meta_dirty(sb, blockno);
+	else {
+		if (osb->osb_meta)
+			clear_bit(blockno, osb->osb_meta);
+		ospfs_block_dirty(sb, blockno);
+	}
+	return data;
 }
 
 
-// ospfs_inode(ino)
+// ospfs_inode(sb, ino)
 //	Use this function to load a 'ospfs_inode' structure from "disk".
 //
-//   Input:   ino -- inode number
-//   Returns: a pointer to the corresponding ospfs_inode structure
+//   Inputs:  sb  -- the Linux super_block for this OSPFS
+//	      ino -- inode number
+//   Returns: a pointer to the corresponding ospfs_inode structure, or NULL
+//	      if 'ino' is out of range or its inode block cannot be read
 
 static inline ospfs_inode_t *
-ospfs_inode(ino_t ino)
+ospfs_inode(struct super_block *sb, ino_t ino)
 {
+	ospfs_super_t *os = OSPFS_SB(sb)->osb_super;
 	ospfs_inode_t *oi;
-	if (ino >= ospfs_super->os_ninodes)
+	if (ino >= os->os_ninodes)
+		return 0;
+	oi = ospfs_block(sb, os->os_firstinob + ino / OSPFS_BLKINODES);
+	if (!oi)		// The inode block could not be read
 		return 0;
-	oi = ospfs_block(ospfs_super->os_firstinob);
-	return &oi[ino];
+	return &oi[ino % OSPFS_BLKINODES];
 }
 
 
-// ospfs_inode_blockno(oi, offset)
+// ospfs_inode_dirty(sb, ino)
+//	Call this function after changing an ospfs_inode structure.
+
+static inline void
+ospfs_inode_dirty(struct super_block *sb, ino_t ino)
+{
+	ospfs_super_t *os = OSPFS_SB(sb)->osb_super;
+	ospfs_meta_dirty(sb, os->os_firstinob + ino / OSPFS_BLKINODES);
+}
+
+
+// ospfs_inode_blockno(sb, oi, offset)
 //	Use this function to look up the blocks that are part of a file's
 //	contents.
 //
-//   Inputs:  oi     -- pointer to a OSPFS inode
+//   Inputs:  sb     -- the Linux super_block for this OSPFS
+//	      oi     -- pointer to a OSPFS inode
 //	      offset -- byte offset into that inode
 //   Returns: the block number of the block that contains the 'offset'th byte
-//	      of the file
+//	      of the file, or 0 on error
 
 static inline uint32_t
-ospfs_inode_blockno(ospfs_inode_t *oi, uint32_t offset)
+ospfs_inode_blockno(struct super_block *sb, ospfs_inode_t *oi, uint32_t offset)
 {
 	uint32_t blockno = offset / OSPFS_BLKSIZE;
 	if (offset >= oi->oi_size || oi->oi_ftype == OSPFS_FTYPE_SYMLINK)
 		return 0;
 	else if (blockno >= OSPFS_NDIRECT + OSPFS_NINDIRECT) {
 		uint32_t blockoff = blockno - (OSPFS_NDIRECT + OSPFS_NINDIRECT);
-		uint32_t *indirect2_block = ospfs_block(oi->oi_indirect2);
-		uint32_t *indirect_block = ospfs_block(indirect2_block[blockoff / OSPFS_NINDIRECT]);
-		return indirect_block[blockoff % OSPFS_NINDIRECT];
+		uint32_t *indirect2_block = ospfs_block(sb, oi->oi_indirect2);
+		uint32_t *indirect_block;
+		if (!indirect2_block)
+			return 0;
+		indirect_block = ospfs_block(sb, indirect2_block[blockoff / OSPFS_NINDIRECT]);
+		return indirect_block ? indirect_block[blockoff % OSPFS_NINDIRECT] : 0;
 	} else if (blockno >= OSPFS_NDIRECT) {
-		uint32_t *indirect_block = ospfs_block(oi->oi_indirect);
-		return indirect_block[blockno - OSPFS_NDIRECT];
+		uint32_t *indirect_block = ospfs_block(sb, oi->oi_indirect);
+		return indirect_block ? indirect_block[blockno - OSPFS_NDIRECT] : 0;
 	} else
 		return oi->oi_direct[blockno];
 }
 
 
-// ospfs_inode_data(oi, offset)
+// ospfs_inode_data(sb, oi, offset)
 //	Use this function to load part of inode's data from "disk",
 //	where 'offset' is relative to the first byte of inode data.
 //
-//   Inputs:  oi     -- pointer to a OSPFS inode
+//   Inputs:  sb     -- the Linux super_block for this OSPFS
+//	      oi     -- pointer to a OSPFS inode
 //	      offset -- byte offset into 'oi's data contents
-//   Returns: a pointer to the 'offset'th byte of 'oi's data contents
+//   Returns: a pointer to the 'offset'th byte of 'oi's data contents,
+//	      or NULL on error
 //
 //	Be careful: the returned pointer is only valid within a single block.
 //	This function is a simple combination of 'ospfs_inode_blockno'
 //	and 'ospfs_block'.
 
 static inline void *
-ospfs_inode_data(ospfs_inode_t *oi, uint32_t offset)
+ospfs_inode_data(struct super_block *sb, ospfs_inode_t *oi, uint32_t offset)
 {
-	uint32_t blockno = ospfs_inode_blockno(oi, offset);
-	return (uint8_t *) ospfs_block(blockno) + (offset % OSPFS_BLKSIZE);
+	uint32_t blockno = ospfs_inode_blockno(sb, oi, offset);
+	uint8_t *data = blockno ? ospfs_block(sb, blockno) : NULL;
+	return data ? data + (offset % OSPFS_BLKSIZE) : NULL;
 }
 
 
-/*****************************************************************************
- * LOW-LEVEL FILE SYSTEM FUNCTIONS
- * There are no exercises in this section, and you don't need to understand
- * the code.
- */
+// ospfs_inode_data_dirty(sb, oi, offset)
+//	Call this function after changing the part of inode's data that
+//	contains the 'offset'th byte.  A directory's blocks are metadata.
 
-// ospfs_mk_linux_inode(sb, ino)
-//	Linux's in-memory 'struct inode' structure represents disk
-//	objects (files and directories).  Many file systems have their own
-//	notion of inodes on disk, and for such file systems, Linux's
-//	'struct inode's are like a cache of on-disk inodes.
-//
-//	This function takes an inode number for the OSPFS and constructs
-//	and returns the corresponding Linux 'struct inode'.
-//
-//   Inputs:  sb  -- the relevant Linux super_block structure (one per mount)
-//	      ino -- OSPFS inode number
-//   Returns: 'struct inode'
+static inline void
+ospfs_inode_data_dirty(struct super_block *sb, ospfs_inode_t *oi, uint32_t offset)
+{
+	uint32_t blockno = ospfs_inode_blockno(sb, oi, offset);
+	if (oi->oi_ftype == OSPFS_FTYPE_DIR)
+		ospfs_meta_dirty(sb, blockno);
+	else
+		ospfs_block_dirty(sb, blockno);
+}
 
-static struct inode *
-ospfs_mk_linux_inode(struct super_block *sb, ino_t ino)
+
+// ospfs_blockmap_drop(inode)
+//	Throws away 'inode's cached block map.  Call this before changing any
+//	of the file's block pointers.
+
+static void
+ospfs_blockmap_drop(struct inode *inode)
 {
-	ospfs_inode_t *oi = ospfs_inode(ino);
-	struct inode *inode;
+	ospfs_inode_info_t *oii = OSPFS_I(inode);
+	uint32_t *blocks;
+
+	spin_lock(&oii->oii_lock);
+	blocks = oii->oii_blocks;
+	oii->oii_blocks = NULL;
+	oii->oii_nblocks = 0;
+	oii->oii_gen++;
+	spin_unlock(&oii->oii_lock);
+	kfree(blocks);
+}
+
+
+// ospfs_blockmap_fill(inode, oi)
+//	Builds 'inode's block map from its OSPFS inode 'oi', unless the file
+//	is too big or memory is short.
+
+static void
+ospfs_blockmap_fill(struct inode *inode, ospfs_inode_t *oi)
+{
+	ospfs_inode_info_t *oii = OSPFS_I(inode);
+	uint32_t n = ospfs_size2nblocks(oi->oi_size);
+	uint32_t *blocks, b;
+	unsigned gen;
+
+	if (n == 0 || n > OSPFS_BLKMAP_MAX
+	    || !(blocks = kmalloc(n * sizeof(uint32_t), GFP_KERNEL)))
+		return;
+
+	spin_lock(&oii->oii_lock);
+	gen = oii->oii_gen;
+	spin_unlock(&oii->oii_lock);
+
+	for (b = 0; b < n; b++)
+		blocks[b] = ospfs_inode_blockno(inode->i_sb, oi, b * OSPFS_BLKSIZE);
+
+	spin_lock(&oii->oii_lock);
+	if (!oii->oii_blocks && oii->oii_gen == gen) {
+		oii->oii_blocks = blocks;
+		oii->oii_nblocks = n;
+		blocks = NULL;
+	}
+	spin_unlock(&oii->oii_lock);
+	kfree(blocks);
+}
+
+
+// ospfs_file_blockno(inode, offset)
+//	Like ospfs_inode_blockno, but uses 'inode's cached block map, building
+//	it if necessary.  Use this on the read and write paths.
+//
+//   Returns: the block number of the block that contains the 'offset'th
+//	      byte of the file, or 0 on error
+
+static uint32_t
+ospfs_file_blockno(struct inode *inode, uint32_t offset)
+{
+	ospfs_inode_info_t *oii = OSPFS_I(inode);
+	ospfs_inode_t *oi = ospfs_inode(inode->i_sb, inode->i_ino);
+	uint32_t b = offset / OSPFS_BLKSIZE;
+	uint32_t blockno = 0;
+	int tries;
+
+	if (!oi || offset >= oi->oi_size)
+		return 0;
+
+	for (tries = 0; tries < 2 && !blockno; tries++) {
+		spin_lock(&oii->oii_lock);
+		if (oii->oii_blocks && b < oii->oii_nblocks)
+			blockno = oii->oii_blocks[b];
+		spin_unlock(&oii->oii_lock);
+		if (!blockno && tries == 0)
+			ospfs_blockmap_fill(inode, oi);
+	}
+
+	return blockno ? blockno : ospfs_inode_blockno(inode->i_sb, oi, offset);
+}
+
+
+/*****************************************************************************
+ * LOW-LEVEL FILE SYSTEM FUNCTIONS
+ * There are no exercises in this section, and you don't need to understand
+ * the code.
+ */
+
+// ospfs_linux_mode(oi)
+//	Returns the Linux 'i_mode' (type and permission bits) for OSPFS inode
+//	'oi', or 0 if it has an unknown type.
+
+static umode_t
+ospfs_linux_mode(ospfs_inode_t *oi)
+{
+	if (oi->oi_ftype == OSPFS_FTYPE_REG)
+		return oi->oi_mode | S_IFREG;
+	else if (oi->oi_ftype == OSPFS_FTYPE_DIR)
+		return (oi->oi_mode & ~OSPFS_MODE_FLAGS) | S_IFDIR;
+	else if (oi->oi_ftype == OSPFS_FTYPE_SYMLINK)
+		return S_IRUSR | S_IRGRP | S_IROTH
+			| S_IWUSR | S_IWGRP | S_IWOTH
+			| S_IXUSR | S_IXGRP | S_IXOTH | S_IFLNK;
+	else
+		return 0;
+}
+
+
+// ospfs_mk_linux_inode(sb, ino)
+//	Linux's in-memory 'struct inode' structure represents disk
+//	objects (files and directories).  Many file systems have their own
+//	notion of inodes on disk, and for such file systems, Linux's
+//	'struct inode's are like a cache of on-disk inodes.
+//
+//	This function takes an inode number for the OSPFS and returns the
+//	corresponding Linux 'struct inode', with a reference held.  The VFS
+//	keeps one 'struct inode' per OSPFS inode in its inode cache; this
+//	function only fills one in from disk the first time it is needed.
+//
+//   Inputs:  sb  -- the relevant Linux super_block structure (one per mount)
+//	      ino -- OSPFS inode number
+//   Returns: 'struct inode'
+
+static struct inode *
+ospfs_mk_linux_inode(struct super_block *sb, ino_t ino)
+{
+	ospfs_inode_t *oi = ospfs_inode(sb, ino);
+	struct inode *inode;
+
+	if (!oi)
+		return 0;
+	if (!(inode = iget_locked(sb, ino)))
+		return 0;
+	if (!(inode->i_state & I_NEW))
+		return inode;
+
+	// Make it look like everything was created by root.
+	inode->i_uid = inode->i_gid = 0;
+	inode->i_size = oi->oi_size;
+
+	if (oi->oi_ftype == OSPFS_FTYPE_REG) {
+		// Make an inode for a regular file.
+		inode->i_mode = ospfs_linux_mode(oi);
+		inode->i_op = &ospfs_reg_inode_ops;
+		inode->i_fop = &ospfs_reg_file_ops;
+		inode->i_mapping->a_ops = &ospfs_aops;
+		inode->i_nlink = oi->oi_nlink;
+
+	} else if (oi->oi_ftype == OSPFS_FTYPE_DIR) {
+		// Make an inode for a directory.
+		inode->i_mode = ospfs_linux_mode(oi);
+		inode->i_op = &ospfs_dir_inode_ops;
+		inode->i_fop = &ospfs_dir_file_ops;
+		inode->i_nlink = oi->oi_nlink + 1 /* dot-dot */;
+
+	} else if (oi->oi_ftype == OSPFS_FTYPE_SYMLINK) {
+		// Make an inode for a symbolic link.
+		inode->i_mode = ospfs_linux_mode(oi);
+		inode->i_op = &ospfs_symlink_inode_ops;
+		inode->i_nlink = oi->oi_nlink;
+
+	} else
+		panic("OSPFS: unknown inode type!");
+
+	// Access and modification times are now.
+	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME;
+	unlock_new_inode(inode);
+	return inode;
+}
+
+
+// ospfs_check_super(osb)
+//	Sanity-checks the OSPFS superblock against the size of the backing
+//	store, so that a corrupt or foreign image cannot make us index past
+//	its end.
+//
+//   Returns: 0 if the superblock looks usable, -EINVAL otherwise
+
+static int
+ospfs_check_super(ospfs_sb_info_t *osb)
+{
+	ospfs_super_t *os = osb->osb_super;
+	uint32_t nbitblocks, ninodeblocks;
+
+	if (os->os_magic != OSPFS_MAGIC) {
+		eprintk("ospfs: bad magic number %08x\n", os->os_magic);
+		return -EINVAL;
+	}
+	if (os->os_nblocks > osb->osb_nblocks) {
+		eprintk("ospfs: image has %u blocks, but only %u are available\n",
+			os->os_nblocks, osb->osb_nblocks);
+		return -EINVAL;
+	}
+
+	nbitblocks = (os->os_nblocks + OSPFS_BLKBITSIZE - 1) / OSPFS_BLKBITSIZE;
+	ninodeblocks = (os->os_ninodes + OSPFS_BLKINODES - 1) / OSPFS_BLKINODES;
+	if (os->os_firstinob < OSPFS_FREEMAP_BLK + nbitblocks
+	    || os->os_ninodes <= OSPFS_ROOT_INO
+	    || os->os_firstinob + ninodeblocks > os->os_nblocks
+	    || (os->os_journalnb != 0
+		&& (os->os_journalnb < 3
+		    || os->os_journalb < os->os_firstinob + ninodeblocks
+		    || os->os_journalnb > os->os_nblocks - os->os_journalb))) {
+		eprintk("ospfs: corrupt superblock\n");
+		return -EINVAL;
+	}
+
+	// Never look at blocks past the end of the file system.
+	osb->osb_nblocks = os->os_nblocks;
+	return 0;
+}
+
+
+// ospfs_parse_options(options, data)
+//	Parses the mount options string 'data' into 'options'.
+//	The options understood are "image=FILE" and "backing=FILE".
+//
+//	Returns: 0 on success, -EINVAL on an unknown or malformed option,
+//	-ENOMEM if out of memory.  The caller must call
+//	ospfs_free_options(options) when done.
+
+typedef struct ospfs_mount_options {
+	char *image;			// "image=FILE", or NULL
+	char *backing;			// "backing=FILE", or NULL
+} ospfs_mount_options_t;
+
+enum { Opt_image, Opt_backing, Opt_err };
+
+static match_table_t ospfs_tokens = {
+	{ Opt_image, "image=%s" },
+	{ Opt_backing, "backing=%s" },
+	{ Opt_err, NULL }
+};
+
+static void
+ospfs_free_options(ospfs_mount_options_t *options)
+{
+	kfree(options->image);
+	kfree(options->backing);
+}
+
+static int
+ospfs_parse_options(ospfs_mount_options_t *options, char *data)
+{
+	substring_t args[MAX_OPT_ARGS];
+	char *p;
+
+	while (data && (p = strsep(&data, ",")) != NULL) {
+		if (!*p)
+			continue;
+		switch (match_token(p, ospfs_tokens, args)) {
+		case Opt_image:
+			kfree(options->image);
+			if (!(options->image = match_strdup(&args[0])))
+				return -ENOMEM;
+			break;
+		case Opt_backing:
+			kfree(options->backing);
+			if (!(options->backing = match_strdup(&args[0])))
+				return -ENOMEM;
+			break;
+		default:
+			eprintk("ospfs: unknown mount option \"%s\"\n", p);
+			return -EINVAL;
+		}
+	}
+	return 0;
+}
+
+
+// ospfs_bdev_setup(sb), ospfs_image_setup(sb, path), ospfs_memory_setup(sb)
+//	Attach the storage backend to a new superblock: the block device
+//	Linux opened for us, an image file read into memory at mount time,
+//	or a private copy of the compiled-in image.
+
+static int
+ospfs_bdev_setup(struct super_block *sb)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+
+	if (!sb_set_blocksize(sb, OSPFS_BLKSIZE)) {
+		eprintk("ospfs: device does not support %d-byte blocks\n",
+			OSPFS_BLKSIZE);
+		return -EINVAL;
+	}
+
+	osb->osb_nblocks = i_size_read(sb->s_bdev->bd_inode) >> OSPFS_BLKSIZE_BITS;
+	if (osb->osb_nblocks <= OSPFS_FREEMAP_BLK)
+		return -EINVAL;
+	osb->osb_bh = vmalloc(osb->osb_nblocks * sizeof(struct buffer_head *));
+	if (!osb->osb_bh)
+		return -ENOMEM;
+	memset(osb->osb_bh, 0, osb->osb_nblocks * sizeof(struct buffer_head *));
+
+	if (!(osb->osb_super = ospfs_block(sb, 1)))
+		return -EIO;
+	return ospfs_check_super(osb);
+}
+
+static int
+ospfs_image_setup(struct super_block *sb, const char *path)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	int mode = (sb->s_flags & MS_RDONLY ? O_RDONLY : O_RDWR);
+	mm_segment_t old_fs;
+	struct file *filp;
+	loff_t size, pos = 0;
+	ssize_t n = 0;
+
+	filp = filp_open(path, mode | O_LARGEFILE, 0);
+	if (IS_ERR(filp))
+		return PTR_ERR(filp);
+	// Keep the file open: unless "backing=" names another file, changes
+	// are written back to the image they came from.
+	osb->osb_backing = filp;
+	if (!filp->f_op || !filp->f_op->read)
+		return -EINVAL;
+
+	size = i_size_read(filp->f_dentry->d_inode);
+	if ((size >> OSPFS_BLKSIZE_BITS) > (uint32_t) ~0U)
+		return -EFBIG;
+	osb->osb_nblocks = size >> OSPFS_BLKSIZE_BITS;
+	if (osb->osb_nblocks <= OSPFS_FREEMAP_BLK)
+		return -EINVAL;
+	size = (loff_t) osb->osb_nblocks * OSPFS_BLKSIZE;
+
+	if (!(osb->osb_data = vmalloc(size)))
+		return -ENOMEM;
+	osb->osb_data_owned = 1;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	while (pos < size) {
+		n = vfs_read(filp, (char __user *) &osb->osb_data[pos],
+			     size - pos, &pos);
+		if (n <= 0)
+			break;
+	}
+	set_fs(old_fs);
+	if (pos < size)
+		return n < 0 ? n : -EIO;
+
+	osb->osb_super = ospfs_block(sb, 1);
+	return ospfs_check_super(osb);
+}
+
+static int
+ospfs_memory_setup(struct super_block *sb)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+
+	osb->osb_nblocks = ospfs_length / OSPFS_BLKSIZE;
+	if (osb->osb_nblocks <= OSPFS_FREEMAP_BLK)
+		return -EINVAL;
+
+	// Each mount gets its own copy, so mounts do not share a file system
+	// and the compiled-in image stays as it was built.
+	if (!(osb->osb_data = vmalloc(osb->osb_nblocks * OSPFS_BLKSIZE)))
+		return -ENOMEM;
+	osb->osb_data_owned = 1;
+	memcpy(osb->osb_data, ospfs_data, osb->osb_nblocks * OSPFS_BLKSIZE);
+
+	osb->osb_super = ospfs_block(sb, 1);
+	return ospfs_check_super(osb);
+}
+
+
+// ospfs_backing_setup(sb, path)
+//	Sets up write-back for an in-memory image.  If 'path' is non-NULL,
+//	it is opened as the backing file, replacing any image file, and every
+//	block is marked dirty so the first sync writes out the whole image.
+//	Otherwise the image file the data was read from is the backing file;
+//	it already matches memory, so nothing starts out dirty.
+//	Either way, later syncs write only what changed.
+//
+//	Returns: 0 on success, < 0 on error.
+
+static int
+ospfs_backing_setup(struct super_block *sb, const char *path)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	size_t size = BITS_TO_LONGS(osb->osb_nblocks) * sizeof(unsigned long);
+	struct file *filp;
+
+	if (path) {
+		filp = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+		if (IS_ERR(filp))
+			return PTR_ERR(filp);
+		if (osb->osb_backing)
+			filp_close(osb->osb_backing, NULL);
+		osb->osb_backing = filp;
+	} else if (!osb->osb_backing)
+		return 0;
+
+	if (!osb->osb_backing->f_op || !osb->osb_backing->f_op->write)
+		return -EINVAL;
+	if (!(osb->osb_dirty = vmalloc(size))
+	    || !(osb->osb_meta = vmalloc(size)))
+		return -ENOMEM;
+	memset(osb->osb_dirty, 0, size);
+	memset(osb->osb_meta, 0, size);
+	if (path) {
+		for (size = 0; size < osb->osb_nblocks; size++)
+			set_bit(size, osb->osb_dirty);
+		atomic_set(&osb->osb_ndirty, osb->osb_nblocks);
+	}
+	return 0;
+}
+
+
+// ospfs_write_file(filp, buf, blockno, count)
+//	Writes the 'count' blocks at 'buf' to the file 'filp' (the backing
+//	file, or a checkpoint) in one sequential write, starting at block
+//	'blockno'.
+//
+//	Returns: 0 on success, < 0 on error.
+
+static int
+ospfs_write_file(struct file *filp, const char *buf, uint32_t blockno, uint32_t count)
+{
+	size_t amount = (size_t) count * OSPFS_BLKSIZE;
+	loff_t pos = (loff_t) blockno * OSPFS_BLKSIZE;
+	mm_segment_t old_fs = get_fs();
+	ssize_t n = 0;
+
+	set_fs(KERNEL_DS);
+	while (amount > 0) {
+		n = vfs_write(filp, (const char __user *) buf, amount, &pos);
+		if (n <= 0)
+			break;
+		buf += n;
+		amount -= n;
+	}
+	set_fs(old_fs);
+
+	if (amount == 0)
+		return 0;
+	return n < 0 ? n : -EIO;
+}
+
+
+// ospfs_write_blocks(sb, buf, blocknos, first, count)
+//	Writes the 'count' blocks at 'buf', which must have been vmalloc()ed,
+//	straight to the disk, bypassing the in-memory image and the buffer
+//	cache.  The i'th block goes to block 'blocknos[i]', or, if 'blocknos'
+//	is NULL, to block 'first + i'.  Waits for the writes to finish, but
+//	not for them to reach stable storage (see ospfs_flush).
+//
+//	Returns: 0 on success, < 0 on error.
+
+static int
+ospfs_write_blocks(struct super_block *sb, char *buf, const uint32_t *blocknos,
+		   uint32_t first, uint32_t count)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	struct buffer_head **bhs;
+	uint32_t i;
+	int r = 0;
+
+	if (osb->osb_backing) {
+		if (!blocknos)
+			return ospfs_write_file(osb->osb_backing, buf, first, count);
+		for (i = 0; i < count && r == 0; i++)
+			r = ospfs_write_file(osb->osb_backing, buf + i * OSPFS_BLKSIZE,
+					     blocknos[i], 1);
+		return r;
+	}
+
+	// Submit every write before waiting for any, so the device can sort
+	// and merge them.
+	if (!(bhs = kcalloc(count, sizeof(*bhs), GFP_NOFS)))
+		return -ENOMEM;
+	for (i = 0; i < count; i++) {
+		char *data = buf + i * OSPFS_BLKSIZE;
+		struct buffer_head *bh = alloc_buffer_head(GFP_NOFS);
+		if (!bh) {
+			r = -ENOMEM;
+			break;
+		}
+		bh->b_bdev = sb->s_bdev;
+		bh->b_blocknr = (blocknos ? blocknos[i] : first + i);
+		bh->b_size = OSPFS_BLKSIZE;
+		set_bh_page(bh, vmalloc_to_page(data), offset_in_page(data));
+		bh->b_end_io = end_buffer_write_sync;
+		set_buffer_mapped(bh);
+		set_buffer_uptodate(bh);
+		lock_buffer(bh);
+		get_bh(bh);
+		submit_bh(WRITE, bh);
+		bhs[i] = bh;
+	}
+	for (i = 0; i < count && bhs[i]; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i]) && r == 0)
+			r = -EIO;
+		free_buffer_head(bhs[i]);
+	}
+	kfree(bhs);
+	return r;
+}
+
+
+// ospfs_write_runs(sb, meta)
+//	Writes an in-memory image's dirty data blocks (if 'meta' is 0) or
+//	dirty metadata blocks (if 'meta' is 1) to the backing file.  Adjacent
+//	dirty blocks are written together, so the cost is proportional to how
+//	much changed rather than to the size of the image.
+//	Called with 'osb_sync_mutex' held.
+//
+//	Returns: 0 on success, < 0 on error.  Blocks that could not be
+//	written stay dirty.
+
+static int
+ospfs_write_runs(struct super_block *sb, int meta)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	uint32_t start, end, b;
+	int r = 0;
+
+	start = find_next_bit(osb->osb_dirty, osb->osb_nblocks, 0);
+	while (start < osb->osb_nblocks) {
+		if (!!test_bit(start, osb->osb_meta) != meta) {
+			start = find_next_bit(osb->osb_dirty, osb->osb_nblocks, start + 1);
+			continue;
+		}
+		for (end = start + 1; end < osb->osb_nblocks; end++)
+			if (!test_bit(end, osb->osb_dirty)
+			    || !!test_bit(end, osb->osb_meta) != meta)
+				break;
+
+		// Clear the bits first: a block changed while it is being
+		// written is marked dirty again and goes out next time.
+		for (b = start; b < end; b++) {
+			clear_bit(b, osb->osb_meta);
+			clear_bit(b, osb->osb_dirty);
+		}
+		atomic_sub(end - start, &osb->osb_ndirty);
+		if ((r = ospfs_write_file(osb->osb_backing, (char *) &osb->osb_data[start * OSPFS_BLKSIZE],
+					   start, end - start)) < 0) {
+			for (b = start; b < end; b++) {
+				if (meta)
+					set_bit(b, osb->osb_meta);
+				if (!test_and_set_bit(b, osb->osb_dirty))
+					atomic_inc(&osb->osb_ndirty);
+			}
+			break;
+		}
+
+		start = find_next_bit(osb->osb_dirty, osb->osb_nblocks, end);
+	}
+	return r;
+}
+
+
+// ospfs_fsync_file(filp)
+//	Waits until everything written to the file 'filp' has reached its
+//	disk.
+//
+//	Returns: 0 on success, < 0 on error.
+
+static int
+ospfs_fsync_file(struct file *filp)
+{
+	struct inode *inode = filp->f_dentry->d_inode;
+	int r;
+
+	r = filemap_write_and_wait(inode->i_mapping);
+	if (r == 0 && filp->f_op->fsync) {
+		mutex_lock(&inode->i_mutex);
+		r = filp->f_op->fsync(filp, filp->f_dentry, 1);
+		mutex_unlock(&inode->i_mutex);
+	}
+	return r;
+}
+
+
+// ospfs_flush(sb)
+//	Waits until everything written so far has reached stable storage:
+//	fsyncs the backing file, or flushes the block device's write cache.
+//
+//	Returns: 0 on success, < 0 on error.
+
+static int
+ospfs_flush(struct super_block *sb)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	int r;
+
+	if (osb->osb_backing)
+		return ospfs_fsync_file(osb->osb_backing);
+	r = blkdev_issue_flush(sb->s_bdev, NULL);
+	return (r == -EOPNOTSUPP ? 0 : r);
+}
+
+
+// ospfs_write_dirty(sb)
+//	Writes every block changed outside the journal.  File data goes
+//	first: if metadata blocks are dirty too (only when not journaling),
+//	the data is flushed to stable storage before they are written, so
+//	that no metadata on disk points at blocks whose contents are not.
+//	A block device's dirty buffers are written by sync_blockdev().  Does
+//	not wait for the last writes to reach stable storage.
+//	Called with 'osb_sync_mutex' held.
+//
+//	Returns: 0 on success, < 0 on error.  Blocks that could not be
+//	written stay dirty.
+
+static int
+ospfs_write_dirty(struct super_block *sb)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	uint32_t b;
+	int r;
+
+	if (!osb->osb_dirty)
+		return sync_blockdev(sb->s_bdev);
+
+	if ((r = ospfs_write_runs(sb, 0)) < 0)
+		return r;
+	for (b = find_next_bit(osb->osb_dirty, osb->osb_nblocks, 0);
+	     b < osb->osb_nblocks;
+	     b = find_next_bit(osb->osb_dirty, osb->osb_nblocks, b + 1))
+		if (test_bit(b, osb->osb_meta)) {
+			if ((r = ospfs_flush(sb)) < 0)
+				return r;
+			return ospfs_write_runs(sb, 1);
+		}
+	return 0;
+}
+
+
+
+// ospfs_journal_checksum(desc, copies, n)
+//	Returns the checksum, stored in the commit block, of a transaction of
+//	'n' blocks with descriptor 'desc' and block copies 'copies'.
+
+static uint32_t
+ospfs_journal_checksum(ospfs_journal_block_t *desc, const char *copies, uint32_t n)
+{
+	uint32_t crc = crc32_le(~0, (unsigned char *) desc->oj_blockno,
+				n * sizeof(uint32_t));
+	return crc32_le(crc, (unsigned char *) copies, n * OSPFS_BLKSIZE);
+}
+
+
+// ospfs_journal_empty(sb)
+//	Empties the journal, so that the transaction in it will not be
+//	replayed, and waits for that to reach stable storage.  The last
+//	commit's home writes are flushed first: until they are durable, that
+//	transaction must stay in the journal to be replayed.
+//	Called with 'osb_sync_mutex' held.
+//
+//	Returns: 0 on success, < 0 on error.
+
+static int
+ospfs_journal_empty(struct super_block *sb)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	int r;
+
+	if ((r = ospfs_flush(sb)) < 0)
+		return r;
+	memset(osb->osb_jbuf, 0, OSPFS_BLKSIZE);
+	if ((r = ospfs_write_blocks(sb, osb->osb_jbuf, NULL, osb->osb_jstart, 1)) < 0)
+		return r;
+	return ospfs_flush(sb);
+}
+
+
+// ospfs_journal_commit(sb, tid)
+//	Commits transaction 'tid', and with it every operation that finished
+//	before the commit began.  Does nothing if an earlier commit already
+//	covered 'tid', so operations that sync at about the same time share
+//	one journal write (group commit).  The commit
+//	1. waits for running operations to finish, copies the changed
+//	   metadata blocks into 'osb_jbuf', and lets operations go on;
+//	2. writes changed file data, so that no committed metadata points at
+//	   blocks whose contents never reached the disk, and flushes;
+//	3. writes the descriptor, the copies and the commit block to the
+//	   journal in one sequential write, and flushes;
+//	4. writes the copies to their homes.  These writes reach stable
+//	   storage with the next commit's first flush; until then, a crash
+//	   is repaired by replaying the journal.
+//	If more blocks changed than the journal holds, they are instead
+//	written straight to their homes with the file data, after the
+//	journal is emptied; that commit is not atomic.
+//
+//	Returns: 0 on success, < 0 on error.  Blocks that could not be
+//	committed stay in the running transaction.
+
+static int
+ospfs_journal_commit(struct super_block *sb, unsigned long tid)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	ospfs_journal_block_t *desc = (ospfs_journal_block_t *) osb->osb_jbuf;
+	ospfs_journal_block_t *commit;
+	char *copies = osb->osb_jbuf + OSPFS_BLKSIZE;
+	size_t mapsize = BITS_TO_LONGS(osb->osb_nblocks) * sizeof(unsigned long);
+	uint32_t b, i, n = 0;
+	int emptied = 0, r = 0;
+
+	mutex_lock(&osb->osb_sync_mutex);
+	if (osb->osb_jcommitted >= tid)
+		goto out;
+
+    capture:
+	down_write(&osb->osb_jsem);
+	if (atomic_read(&osb->osb_jcount) > osb->osb_jmax) {
+		if (!emptied) {
+			up_write(&osb->osb_jsem);
+			if ((r = ospfs_journal_empty(sb)) < 0)
+				goto out;
+			emptied = 1;
+			goto capture;
+		}
+		eprintk("ospfs: %d changed blocks overflow the journal\n",
+			atomic_read(&osb->osb_jcount));
+		for (b = find_next_bit(osb->osb_jdirty, osb->osb_nblocks, 0);
+		     b < osb->osb_nblocks;
+		     b = find_next_bit(osb->osb_jdirty, osb->osb_nblocks, b + 1)) {
+			clear_bit(b, osb->osb_jdirty);
+			if (osb->osb_meta)
+				set_bit(b, osb->osb_meta);
+			ospfs_block_dirty(sb, b);
+		}
+	} else
+		for (b = find_next_bit(osb->osb_jdirty, osb->osb_nblocks, 0);
+		     b < osb->osb_nblocks;
+		     b = find_next_bit(osb->osb_jdirty, osb->osb_nblocks, b + 1)) {
+			void *data = ospfs_block(sb, b);
+			clear_bit(b, osb->osb_jdirty);
+			if (!data)
+				continue;
+			desc->oj_blockno[n] = b;
+			memcpy(copies + n * OSPFS_BLKSIZE, data, OSPFS_BLKSIZE);
+			n++;
+		}
+	atomic_set(&osb->osb_jcount, 0);
+	bitmap_or(osb->osb_jfreeing, osb->osb_jfreeing, osb->osb_jfreed,
+		  osb->osb_nblocks);
+	memset(osb->osb_jfreed, 0, mapsize);
+	tid = osb->osb_jtid++;
+	up_write(&osb->osb_jsem);
+
+	if ((r = ospfs_write_dirty(sb)) < 0 || (r = ospfs_flush(sb)) < 0)
+		goto fail;
+
+	if (n > 0) {
+		desc->oj_magic = OSPFS_JOURNAL_MAGIC;
+		desc->oj_seq = osb->osb_jseq;
+		desc->oj_nblocks = n;
+		desc->oj_checksum = 0;
+		commit = (ospfs_journal_block_t *) (copies + n * OSPFS_BLKSIZE);
+		memset(commit, 0, OSPFS_BLKSIZE);
+		commit->oj_magic = OSPFS_COMMIT_MAGIC;
+		commit->oj_seq = osb->osb_jseq;
+		commit->oj_nblocks = n;
+		commit->oj_checksum = ospfs_journal_checksum(desc, copies, n);
+
+		if ((r = ospfs_write_blocks(sb, osb->osb_jbuf, NULL, osb->osb_jstart, n + 2)) < 0
+		    || (r = ospfs_flush(sb)) < 0)
+			goto fail;
+		osb->osb_jseq++;
+	}
+
+	// The transaction is safe: the blocks it freed may be reused.
+	memset(osb->osb_jfreeing, 0, mapsize);
+	osb->osb_jcommitted = tid;
+	ospfs_stat_add(sb, OSPFS_STAT_JOURNAL_COMMIT, 1);
+	ospfs_stat_add(sb, OSPFS_STAT_JOURNAL_BLOCKS, n);
+
+	if (n > 0 && (r = ospfs_write_blocks(sb, copies, desc->oj_blockno, 0, n)) < 0)
+		goto fail;
+	goto out;
+
+    fail:
+	// Put the blocks back in the running transaction.  Their contents
+	// in memory are at least as new as the copies.
+	for (i = 0; i < n; i++)
+		if (!test_and_set_bit(desc->oj_blockno[i], osb->osb_jdirty))
+			atomic_inc(&osb->osb_jcount);
+    out:
+	mutex_unlock(&osb->osb_sync_mutex);
+	if (r < 0)
+		eprintk("ospfs: error %d committing the journal\n", r);
+	return r;
+}
+
+
+// ospfs_journal_start(sb), ospfs_journal_stop(sb)
+//	Bracket every operation that changes metadata, so that its changes
+//	all go into the same transaction.  Start after taking any locks Linux
+//	takes for the operation (directory i_mutex), but before any of
+//	OSPFS's own ('oii_rwsem', the allocator).  If the running transaction
+//	is close to the most the journal holds, start commits it first.
+//	The handle is taken even when not journaling: ospfs_checkpoint()
+//	relies on it for a moment when no operation is half done.
+
+// Most metadata blocks one operation is expected to change.
+#define OSPFS_JOURNAL_RESERVE	16
+
+static void
+ospfs_journal_start(struct super_block *sb)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+
+	if (osb->osb_jmax
+	    && atomic_read(&osb->osb_jcount) + OSPFS_JOURNAL_RESERVE > osb->osb_jmax)
+		ospfs_journal_commit(sb, osb->osb_jtid);
+	down_read(&osb->osb_jsem);
+}
+
+static void
+ospfs_journal_stop(struct super_block *sb)
+{
+	up_read(&OSPFS_SB(sb)->osb_jsem);
+}
+
+
+// ospfs_journal_replay(sb)
+//	If the journal holds a complete transaction, copies it to its homes
+//	again, in case a crash stopped it from getting there, and empties
+//	the journal.  An incomplete transaction is ignored.
+//
+//	Returns: 0 on success (including if there was nothing to replay),
+//	< 0 on error.
+
+static int
+ospfs_journal_replay(struct super_block *sb)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	ospfs_super_t *os = osb->osb_super;
+	ospfs_journal_block_t *desc, *commit;
+	char *copies, *data;
+	uint32_t i, n, home;
+	int r = 0;
+
+	if (!(desc = ospfs_block(sb, osb->osb_jstart)))
+		return -EIO;
+	osb->osb_jseq = desc->oj_seq + 1;
+	n = desc->oj_nblocks;
+	if (desc->oj_magic != OSPFS_JOURNAL_MAGIC || n == 0
+	    || n > OSPFS_JOURNAL_NTAGS || n > os->os_journalnb - 2)
+		return 0;
+	if (!(commit = ospfs_block(sb, osb->osb_jstart + n + 1)))
+		return -EIO;
+	if (commit->oj_magic != OSPFS_COMMIT_MAGIC
+	    || commit->oj_seq != desc->oj_seq || commit->oj_nblocks != n)
+		return 0;
+
+	// The copies are contiguous in an in-memory image, but need not be on
+	// a block device, so gather them.
+	if (!(copies = vmalloc(n * OSPFS_BLKSIZE)))
+		return -ENOMEM;
+	for (i = 0; i < n; i++) {
+		if (!(data = ospfs_block(sb, osb->osb_jstart + 1 + i))) {
+			r = -EIO;
+			goto out;
+		}
+		memcpy(copies + i * OSPFS_BLKSIZE, data, OSPFS_BLKSIZE);
+	}
+	if (ospfs_journal_checksum(desc, copies, n) != commit->oj_checksum) {
+		eprintk("ospfs: ignoring journal transaction %u: bad checksum\n",
+			desc->oj_seq);
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		home = desc->oj_blockno[i];
+		if (home < OSPFS_FREEMAP_BLK
+		    || (home >= osb->osb_jstart
+			&& home < osb->osb_jstart + os->os_journalnb)
+		    || !(data = ospfs_block(sb, home))) {
+			eprintk("ospfs: corrupt journal transaction %u\n", desc->oj_seq);
+			r = -EIO;
+			goto out;
+		}
+		memcpy(data, copies + i * OSPFS_BLKSIZE, OSPFS_BLKSIZE);
+		ospfs_block_dirty(sb, home);
+	}
+	eprintk("ospfs: replayed journal transaction %u (%u blocks)\n",
+		desc->oj_seq, n);
+
+	// The homes must be on disk before the journal is emptied.
+	desc->oj_magic = 0;
+	if (osb->osb_dirty || osb->osb_bh) {
+		mutex_lock(&osb->osb_sync_mutex);
+		if ((r = ospfs_write_dirty(sb)) == 0
+		    && (r = ospfs_flush(sb)) == 0) {
+			ospfs_block_dirty(sb, osb->osb_jstart);
+			if ((r = ospfs_write_dirty(sb)) == 0)
+				r = ospfs_flush(sb);
+		}
+		mutex_unlock(&osb->osb_sync_mutex);
+	}
+
+    out:
+	vfree(copies);
+	return r;
+}
+
+
+// ospfs_journal_setup(sb)
+//	Replays the journal, if the image has one, and starts journaling if
+//	changes to this file system can reach a disk -- that is, unless it
+//	is mounted read-only or is an in-memory image with no backing file.
+//	The replay is the only write a read-only mount makes.
+//
+//	Returns: 0 on success, < 0 on error.
+
+static int
+ospfs_journal_setup(struct super_block *sb)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	ospfs_super_t *os = osb->osb_super;
+	size_t size = BITS_TO_LONGS(osb->osb_nblocks) * sizeof(unsigned long);
+	uint32_t jmax = min_t(uint32_t, os->os_journalnb - 2, OSPFS_JOURNAL_NTAGS);
+	int r;
+
+	if (os->os_journalnb == 0)
+		return 0;
+	osb->osb_jstart = os->os_journalb;
+	if ((r = ospfs_journal_replay(sb)) < 0)
+		return r;
+	if ((sb->s_flags & MS_RDONLY) || (!osb->osb_dirty && !osb->osb_bh))
+		return 0;
+
+	if (!(osb->osb_jdirty = vmalloc(size))
+	    || !(osb->osb_jfreed = vmalloc(size))
+	    || !(osb->osb_jfreeing = vmalloc(size))
+	    || !(osb->osb_jbuf = vmalloc((jmax + 2) * OSPFS_BLKSIZE)))
+		return -ENOMEM;
+	memset(osb->osb_jdirty, 0, size);
+	memset(osb->osb_jfreed, 0, size);
+	memset(osb->osb_jfreeing, 0, size);
+	atomic_set(&osb->osb_jcount, 0);
+	osb->osb_jtid = 1;
+	osb->osb_jcommitted = 0;
+	osb->osb_jmax = jmax;
+	return 0;
+}
+
+
+// ospfs_sync_fs(sb, wait)
+//	Called by Linux to write out a file system's changes, and by
+//	ospfs_put_super() at unmount.  If the file system is journaling,
+//	commits the running transaction when 'wait' is set (Linux calls
+//	again with 'wait' set after calling without).  Otherwise writes every
+//	dirty block of an in-memory image to the backing file, and if 'wait'
+//	is set, waits for them to reach its disk.
+//
+//	Block devices without a journal are left to Linux, which writes back
+//	dirty buffers itself.
+//
+//	Returns: 0 on success, < 0 on error.
+
+static int
+ospfs_sync_fs(struct super_block *sb, int wait)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	int r;
+
+	if (!osb)
+		return 0;
+	if (osb->osb_jmax)
+		return (wait ? ospfs_journal_commit(sb, osb->osb_jtid) : 0);
+	if (!osb->osb_dirty)
+		return 0;
+
+	mutex_lock(&osb->osb_sync_mutex);
+	r = ospfs_write_dirty(sb);
+	if (r == 0 && wait)
+		r = ospfs_flush(sb);
+	mutex_unlock(&osb->osb_sync_mutex);
+
+	if (r < 0)
+		eprintk("ospfs: error %d writing backing file\n", r);
+	return r;
+}
+
+// ospfs_writeback_wait(osb)
+//	Returns how many jiffies the writeback thread should sleep before
+//	writing back: 0 if it should now, MAX_SCHEDULE_TIMEOUT if nothing is
+//	dirty.
+
+static long
+ospfs_writeback_wait(ospfs_sb_info_t *osb)
+{
+	unsigned long expire;
+
+	if (!test_bit(OSPFS_WB_DIRTY, &osb->osb_wb_flags))
+		return MAX_SCHEDULE_TIMEOUT;
+	if (test_bit(OSPFS_WB_KICKED, &osb->osb_wb_flags))
+		return 0;
+	expire = osb->osb_dirtied + msecs_to_jiffies(ospfs_dirty_expire_ms);
+	if (time_after_eq(jiffies, expire))
+		return 0;
+	return expire - jiffies;
+}
+
+
+// ospfs_writeback(sb)
+//	Writes back everything changed so far, as ospfs_sync_fs() does: with
+//	a journal, by committing (file data first, then the transaction);
+//	without one, file data first, then metadata.
+//
+//	Returns: 0 on success, < 0 on error.
+
+static int
+ospfs_writeback(struct super_block *sb)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	int r;
+
+	// Changes made from now on start a new clock.
+	clear_bit(OSPFS_WB_KICKED, &osb->osb_wb_flags);
+	clear_bit(OSPFS_WB_DIRTY, &osb->osb_wb_flags);
+	r = ospfs_sync_fs(sb, 1);
+	ospfs_stat_add(sb, OSPFS_STAT_WRITEBACK, 1);
+
+	// Try again once the blocks that failed expire again.
+	if (r < 0 && ospfs_dirty_bytes_now(osb) > 0
+	    && !test_and_set_bit(OSPFS_WB_DIRTY, &osb->osb_wb_flags))
+		osb->osb_dirtied = jiffies;
+	return r;
+}
+
+
+// ospfs_writeback_thread(arg)
+//	The per-mount writeback thread, "ospfs-wb/N".  Sleeps until the
+//	oldest change is 'dirty_expire_ms' old or 'dirty_bytes' are dirty
+//	(ospfs_writeback_note() wakes it), then writes everything back.
+
+static int
+ospfs_writeback_thread(void *arg)
+{
+	struct super_block *sb = (struct super_block *) arg;
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	long timeout;
+
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if ((timeout = ospfs_writeback_wait(osb)) > 0)
+			schedule_timeout(timeout);
+		__set_current_state(TASK_RUNNING);
+
+		if (!kthread_should_stop() && ospfs_writeback_wait(osb) == 0)
+			ospfs_writeback(sb);
+	}
+	return 0;
+}
+
+
+// ospfs_writeback_setup(sb)
+//	Starts the writeback thread, if changes to this file system reach a
+//	disk through OSPFS: a backing file, or a journal.  Block devices
+//	without a journal are written back by Linux.  Read-only mounts
+//	have nothing to write back.
+//
+//	Returns: 0 on success, < 0 on error.
+
+static int
+ospfs_writeback_setup(struct super_block *sb)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	struct task_struct *task;
+
+	if ((sb->s_flags & MS_RDONLY) || (!osb->osb_dirty && !osb->osb_jmax))
+		return 0;
+	task = kthread_run(ospfs_writeback_thread, sb, "ospfs-wb/%d", osb->osb_id);
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+	osb->osb_wb_task = task;
+
+	// Blocks dirtied before the thread started (a new backing file
+	// starts out all dirty) still need writing back.
+	if (ospfs_dirty_bytes_now(osb) > 0)
+		ospfs_writeback_note(osb);
+	return 0;
+}
+
+
+// ospfs_writeback_throttle(sb)
+//	Called by writers, with no locks held.  If twice 'dirty_bytes' are
+//	dirty -- the writeback thread is not keeping up -- writes back before
+//	returning, so the disk never falls far behind.
+
+static void
+ospfs_writeback_throttle(struct super_block *sb)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+
+	if (osb->osb_wb_task
+	    && ospfs_dirty_bytes_now(osb) >= 2 * (unsigned long) ospfs_dirty_bytes) {
+		ospfs_stat_add(sb, OSPFS_STAT_THROTTLE, 1);
+		ospfs_writeback(sb);
+	}
+}
+
+
+// ospfs_checkpoint_setup(sb)
+//	Starts recording the blocks changed since the last checkpoint, if
+//	the file system is an in-memory image.  Until the first checkpoint,
+//	every block counts as changed.
+//
+//	Returns: 0 on success, < 0 on error.
+
+static int
+ospfs_checkpoint_setup(struct super_block *sb)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	size_t size = BITS_TO_LONGS(osb->osb_nblocks) * sizeof(unsigned long);
+
+	if (!osb->osb_data)
+		return 0;
+	if (!(osb->osb_ckdirty = vmalloc(size)))
+		return -ENOMEM;
+	memset(osb->osb_ckdirty, 0xFF, size);
+	return 0;
+}
+
+
+// ospfs_checkpoint_take(osb, want, taken)
+//	Moves the blocks recorded in 'osb_ckdirty' into the bitmap 'want',
+//	and notes them in 'taken'.  Called with 'osb_jsem' held exclusive:
+//	an operation may mark a block dirty before it is done changing it,
+//	so a block's bit is only taken once the operation that set it has
+//	finished.
+//
+//	Returns: the number of blocks now in 'want'.
+
+static uint32_t
+ospfs_checkpoint_take(ospfs_sb_info_t *osb, unsigned long *want, unsigned long *taken)
+{
+	uint32_t i;
+
+	for (i = 0; i < BITS_TO_LONGS(osb->osb_nblocks); i++) {
+		want[i] |= xchg(&osb->osb_ckdirty[i], 0);
+		taken[i] |= want[i];
+	}
+	return bitmap_weight(want, osb->osb_nblocks);
+}
+
+
+// ospfs_checkpoint_copy(osb, want, buf, blocknos, max)
+//	Copies up to 'max' of the blocks in 'want', lowest first, from the
+//	image into 'buf', removes them from 'want', and stores their numbers
+//	in 'blocknos'.
+//
+//	Returns: the number of blocks copied.
+
+static uint32_t
+ospfs_checkpoint_copy(ospfs_sb_info_t *osb, unsigned long *want, char *buf, uint32_t *blocknos, uint32_t max)
+{
+	uint32_t b, n = 0;
+
+	for (b = find_next_bit(want, osb->osb_nblocks, 0);
+	     b < osb->osb_nblocks && n < max;
+	     b = find_next_bit(want, osb->osb_nblocks, b + 1)) {
+		clear_bit(b, want);
+		memcpy(buf + n * OSPFS_BLKSIZE, &osb->osb_data[b * OSPFS_BLKSIZE], OSPFS_BLKSIZE);
+		blocknos[n++] = b;
+	}
+	return n;
+}
+
+
+// ospfs_checkpoint_write(filp, buf, blocknos, n)
+//	Writes the 'n' blocks at 'buf' to the file 'filp', the i'th at block
+//	'blocknos[i]', merging runs of consecutive blocks into single writes.
+//
+//	Returns: 0 on success, < 0 on error.
+
+static int
+ospfs_checkpoint_write(struct file *filp, const char *buf, const uint32_t *blocknos, uint32_t n)
+{
+	uint32_t i, j;
+	int r = 0;
+
+	for (i = 0; i < n && r == 0; i = j) {
+		for (j = i + 1; j < n && blocknos[j] == blocknos[j - 1] + 1; j++)
+			/* do nothing */;
+		r = ospfs_write_file(filp, buf + i * OSPFS_BLKSIZE, blocknos[i], j - i);
+	}
+	return r;
+}
+
+
+// ospfs_checkpoint(sb, filp, flags)
+//	Writes the in-memory image to the file 'filp' while the file system
+//	stays in use.  With OSPFS_CKPT_INCREMENTAL in 'flags', writes only the
+//	blocks changed since the last checkpoint; otherwise writes every
+//	block.  Waits for the file to reach its disk.
+//
+//	The blocks are copied as they are, with operations running; then the
+//	blocks dirtied meanwhile ('osb_ckdirty' -- every change marks its
+//	block dirty before the operation ends) are copied again, in passes
+//	that get shorter as they go.  The final pass copies while no
+//	operation holds a journal handle, so the file ends up with the image
+//	as it was at that moment.  Operations wait only for that copy, and
+//	for each pass to collect its dirty bits.  Nothing is copied on read,
+//	and a block is copied only if the checkpoint wants it.
+//
+//	Returns: the number of blocks written (counting a block again each
+//	time it changed during the checkpoint), or < 0 on error (-EBUSY if
+//	another checkpoint is running).  After an error the blocks count as
+//	changed again, so the next incremental checkpoint rewrites them.
+
+// Most passes before the final one; the final pass is started early once
+// at most OSPFS_CKPT_FINAL blocks are left.  Other passes write at most
+// OSPFS_CKPT_CHUNK blocks at once.
+#define OSPFS_CKPT_PASSES	8
+#define OSPFS_CKPT_FINAL	256
+#define OSPFS_CKPT_CHUNK	64
+
+static int
+ospfs_checkpoint(struct super_block *sb, struct file *filp, unsigned flags)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	size_t mapsize = BITS_TO_LONGS(osb->osb_nblocks) * sizeof(unsigned long);
+	unsigned long *want = NULL, *taken = NULL;
+	uint32_t *blocknos = NULL;
+	char *buf = NULL;
+	uint32_t b, n, cap = OSPFS_CKPT_CHUNK, pass, written = 0;
+	int r = -ENOMEM;
+
+	if (!osb->osb_ckdirty || !filp->f_op || !filp->f_op->write)
+		return -EINVAL;
+	if (!mutex_trylock(&osb->osb_ckpt_mutex))
+		return -EBUSY;
+	if (!(want = vmalloc(mapsize))
+	    || !(taken = vmalloc(mapsize))
+	    || !(blocknos = vmalloc(cap * sizeof(uint32_t)))
+	    || !(buf = vmalloc(cap * OSPFS_BLKSIZE)))
+		goto out;
+	memset(want, (flags & OSPFS_CKPT_INCREMENTAL ? 0 : 0xFF), mapsize);
+	memset(taken, 0, mapsize);
+	r = 0;
+
+	for (pass = 0; ; pass++) {
+		down_write(&osb->osb_jsem);
+		n = ospfs_checkpoint_take(osb, want, taken);
+		up_write(&osb->osb_jsem);
+		if (n <= OSPFS_CKPT_FINAL || pass == OSPFS_CKPT_PASSES)
+			break;
+		while ((n = ospfs_checkpoint_copy(osb, want, buf, blocknos, cap)) > 0) {
+			if ((r = ospfs_checkpoint_write(filp, buf, blocknos, n)) < 0)
+				goto out;
+			written += n;
+			cond_resched();
+		}
+	}
+
+	// The final pass copies the rest with operations shut out.  Make
+	// room for them first, without holding anyone up.
+	while (1) {
+		if (n > cap) {
+			vfree(blocknos);
+			vfree(buf);
+			cap = n + OSPFS_CKPT_CHUNK;
+			blocknos = vmalloc(cap * sizeof(uint32_t));
+			buf = vmalloc(cap * OSPFS_BLKSIZE);
+			if (!blocknos || !buf) {
+				r = -ENOMEM;
+				goto out;
+			}
+		}
+		down_write(&osb->osb_jsem);
+		if ((n = ospfs_checkpoint_take(osb, want, taken)) <= cap)
+			break;
+		up_write(&osb->osb_jsem);
+	}
+	n = ospfs_checkpoint_copy(osb, want, buf, blocknos, cap);
+	up_write(&osb->osb_jsem);
+
+	if ((r = ospfs_checkpoint_write(filp, buf, blocknos, n)) == 0) {
+		written += n;
+		r = ospfs_fsync_file(filp);
+	}
+
+    out:
+	if (r < 0 && taken)
+		for (b = find_next_bit(taken, osb->osb_nblocks, 0);
+		     b < osb->osb_nblocks;
+		     b = find_next_bit(taken, osb->osb_nblocks, b + 1))
+			set_bit(b, osb->osb_ckdirty);
+	vfree(buf);
+	vfree(blocknos);
+	vfree(taken);
+	vfree(want);
+	mutex_unlock(&osb->osb_ckpt_mutex);
+	if (r < 0)
+		return r;
+	ospfs_stat_add(sb, OSPFS_STAT_CHECKPOINT, 1);
+	ospfs_stat_add(sb, OSPFS_STAT_CHECKPOINT_BLOCKS, written);
+	return written;
+}
+
+
+
+// ospfs_release_sb_info(sb)
+//	Releases the per-mount state: unpins any buffers, closes the backing
+//	file, and frees 'osb'.
+//	Dirty buffers stay in the block device's page cache, and are written
+//	back by Linux as usual.
+
+static void
+ospfs_release_sb_info(struct super_block *sb)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	uint32_t blockno;
+
+	if (!osb)
+		return;
+	if (osb->osb_wb_task)
+		kthread_stop(osb->osb_wb_task);
+	ospfs_stats_release(sb);
+	ospfs_dcache_drop_all(sb);
+	if (osb->osb_bh) {
+		for (blockno = 0; blockno < osb->osb_nblocks; blockno++)
+			if (osb->osb_bh[blockno])
+				brelse(osb->osb_bh[blockno]);
+		vfree(osb->osb_bh);
+	}
+	if (osb->osb_backing)
+		filp_close(osb->osb_backing, NULL);
+	vfree(osb->osb_dirty);
+	vfree(osb->osb_meta);
+	vfree(osb->osb_jdirty);
+	vfree(osb->osb_jfreed);
+	vfree(osb->osb_jfreeing);
+	vfree(osb->osb_jbuf);
+	vfree(osb->osb_ckdirty);
+	vfree(osb->osb_orphans);
+	if (osb->osb_data_owned)
+		vfree(osb->osb_data);
+	kfree(osb);
+	sb->s_fs_info = NULL;
+}
+
+
+// ospfs_alloc_inode, ospfs_destroy_inode, ospfs_inode_init_once
+//	Linux calls these to allocate and free every 'struct inode' of an
+//	OSPFS, which lives inside an ospfs_inode_info_t from the
+//	'ospfs_inode_cachep' slab cache.  ospfs_inode_init_once is the slab
+//	constructor.
+
+static struct inode *
+ospfs_alloc_inode(struct super_block *sb)
+{
+	ospfs_inode_info_t *oii = kmem_cache_alloc(ospfs_inode_cachep, GFP_KERNEL);
+
+	if (!oii)
+		return NULL;
+	oii->oii_blocks = NULL;
+	oii->oii_nblocks = 0;
+	oii->oii_gen = 0;
+	return &oii->oii_vfs_inode;
+}
+
+static void
+ospfs_destroy_inode(struct inode *inode)
+{
+	ospfs_inode_info_t *oii = OSPFS_I(inode);
+
+	kfree(oii->oii_blocks);
+	kmem_cache_free(ospfs_inode_cachep, oii);
+}
+
+static void
+ospfs_inode_init_once(void *foo, struct kmem_cache *cachep, unsigned long flags)
+{
+	ospfs_inode_info_t *oii = (ospfs_inode_info_t *) foo;
+
+	if ((flags & (SLAB_CTOR_VERIFY | SLAB_CTOR_CONSTRUCTOR))
+	    == SLAB_CTOR_CONSTRUCTOR) {
+		init_rwsem(&oii->oii_rwsem);
+		spin_lock_init(&oii->oii_lock);
+		inode_init_once(&oii->oii_vfs_inode);
+	}
+}
+
+
+// ospfs_fill_super, ospfs_get_sb
+//	These functions are called by Linux when the user mounts a version of
+//	the OSPFS onto some directory.  They help construct a Linux
+//	'struct super_block' for that file system.
+//
+//	"mount -t ospfs none DIR" mounts the compiled-in image; any other
+//	device name is opened as a block device holding an OSPFS image
+//	(for instance, a loop device set up over a file made by ospfsformat).
+//	"mount -t ospfs -o image=FILE none DIR" instead reads an image made by
+//	ospfsformat into memory at mount time.  An in-memory image is written
+//	back to its image file (if any) on sync and at unmount, or to the file
+//	named by "-o backing=FILE".  Changes to the compiled-in image with no
+//	backing file are lost at unmount.  Each mount is independent: it has
+//	its own data, allocator, statistics and /proc/fs/ospfs/N directory,
+//	all hung off 'sb->s_fs_info'.  If the image has a journal
+//	("ospfsformat -j"), metadata changes that can reach a disk go through
+//	it, and a transaction a crash left in the journal is replayed first.
+
+static int
+ospfs_fill_super(struct super_block *sb, void *data, int flags)
+{
+	ospfs_sb_info_t *osb;
+	ospfs_mount_options_t options = { NULL };
+	struct inode *root_inode;
+	size_t size;
+	int r;
+
+	if (!(osb = kzalloc(sizeof(ospfs_sb_info_t), GFP_KERNEL)))
+		return -ENOMEM;
+	sb->s_fs_info = osb;
+	mutex_init(&osb->osb_sync_mutex);
+	mutex_init(&osb->osb_alloc_mutex);
+	init_rwsem(&osb->osb_jsem);
+	mutex_init(&osb->osb_ckpt_mutex);
+
+	if ((r = ospfs_parse_options(&options, data)) < 0)
+		goto fail;
+
+	sb->s_blocksize = OSPFS_BLKSIZE;
+	sb->s_blocksize_bits = OSPFS_BLKSIZE_BITS;
+	sb->s_magic = OSPFS_MAGIC;
+	sb->s_op = &ospfs_superblock_ops;
+
+	if (sb->s_bdev && (options.image || options.backing)) {
+		eprintk("ospfs: \"image\" and \"backing\" need an in-memory image\n");
+		r = -EINVAL;
+		goto fail;
+	} else if (sb->s_bdev)
+		r = ospfs_bdev_setup(sb);
+	else if (options.image)
+		r = ospfs_image_setup(sb, options.image);
+	else
+		r = ospfs_memory_setup(sb);
+	if (r < 0)
+		goto fail;
+
+	if (!sb->s_bdev && !(sb->s_flags & MS_RDONLY)
+	    && (r = ospfs_backing_setup(sb, options.backing)) < 0)
+		goto fail;
+
+	if ((r = ospfs_journal_setup(sb)) < 0)
+		goto fail;
+
+	// Inodes unlinked while open; see ospfs_drop_link().
+	size = BITS_TO_LONGS(osb->osb_super->os_ninodes) * sizeof(unsigned long);
+	if (!(osb->osb_orphans = vmalloc(size))) {
+		r = -ENOMEM;
+		goto fail;
+	}
+	memset(osb->osb_orphans, 0, size);
+
+	if ((r = ospfs_stats_setup(sb)) < 0
+	    || (r = ospfs_writeback_setup(sb)) < 0
+	    || (r = ospfs_checkpoint_setup(sb)) < 0)
+		goto fail;
+
+	if (!(root_inode = ospfs_mk_linux_inode(sb, OSPFS_ROOT_INO))
+	    || !(sb->s_root = d_alloc_root(root_inode))) {
+		iput(root_inode);
+		r = -ENOMEM;
+		goto fail;
+	}
+
+	ospfs_free_options(&options);
+	return 0;
+
+    fail:
+	ospfs_free_options(&options);
+	ospfs_release_sb_info(sb);
+	sb->s_dev = 0;
+	return r;
+}
+
+static int
+ospfs_get_sb(struct file_system_type *fs_type, int flags, const char *dev_name, void *data, struct vfsmount *mount)
+{
+	// Every in-memory mount is a separate file system with its own
+	// superblock and its own copy of the data.
+	if (dev_name && strcmp(dev_name, "none") != 0)
+		return get_sb_bdev(fs_type, flags, dev_name, data, ospfs_fill_super, mount);
+	return get_sb_nodev(fs_type, flags, data, ospfs_fill_super, mount);
+}
+
+
+// ospfs_show_options(m, mnt)
+//	Adds the mount's instance number to its line in /proc/mounts, so it
+//	can be matched with its /proc/fs/ospfs directory.
+
+static int
+ospfs_show_options(struct seq_file *m, struct vfsmount *mnt)
+{
+	seq_printf(m, ",instance=%d", OSPFS_SB(mnt->mnt_sb)->osb_id);
+	return 0;
+}
+
+
+// ospfs_remount_fs(sb, flags, data)
+//	Called by Linux to change a mounted file system's flags.  A mount
+//	made read-only has no journal or writeback thread, so it cannot be
+//	made writable again; mount it afresh instead.
+//
+//	Returns: 0 on success, -EINVAL for a read-only to read-write remount.
+
+static int
+ospfs_remount_fs(struct super_block *sb, int *flags, char *data)
+{
+	if ((sb->s_flags & MS_RDONLY) && !(*flags & MS_RDONLY))
+		return -EINVAL;
+	return 0;
+}
+
+
+// ospfs_put_super, ospfs_kill_sb
+//	These functions are called by Linux when the file system is
+//	unmounted.
+
+static void
+ospfs_put_super(struct super_block *sb)
+{
+	ospfs_sync_fs(sb, 1);
+	ospfs_release_sb_info(sb);
+}
+
+static void
+ospfs_kill_sb(struct super_block *sb)
+{
+	if (sb->s_bdev)
+		kill_block_super(sb);
+	else
+		kill_anon_super(sb);
+}
+
+
+/*****************************************************************************
+ * DIRECTORY ENTRIES
+ *
+ *   A directory holds either fixed-size 'ospfs_direntry_t's or, if it is
+ *   packed, variable-length 'ospfs_dirrec_t's (see ospfs.h).  These
+ *   functions hide the difference from the rest of the directory code,
+ *   which reads entries into 'ospfs_dirent_t's and otherwise refers to
+ *   them by offset.  In either format, no entry crosses a block boundary,
+ *   so most of these functions work on one block at a time.
+ */
+
+typedef struct ospfs_dirent {
+	uint32_t dn_off;		// Offset of the entry in the directory
+	uint32_t dn_reclen;		// Bytes from this entry to the next
+	uint32_t dn_ino;		// Inode number, or 0 if empty
+	uint32_t dn_hash;		// ospfs_name_hash of the name
+	int dn_type;			// OSPFS_FTYPE_*, or -1 if not recorded
+	int dn_namelen;
+	const char *dn_name;		// Not null-terminated
+} ospfs_dirent_t;
+
+// Most live entries a block can hold, in either format.
+#define OSPFS_BLKMAXENTRIES	(OSPFS_BLKSIZE / OSPFS_DIRREC_SIZE(1))
+
+static inline int
+ospfs_dir_packed(ospfs_inode_t *dir_oi)
+{
+	return (dir_oi->oi_mode & OSPFS_MODE_PACKED) != 0;
+}
+
+// ospfs_dirent_size(packed, namelen)
+//	Returns the number of bytes an entry for a 'namelen'-character name
+//	takes up.
+
+static inline uint32_t
+ospfs_dirent_size(int packed, int namelen)
+{
+	return packed ? OSPFS_DIRREC_SIZE(namelen) : OSPFS_DIRENTRY_SIZE;
+}
+
+
+// ospfs_dirent_parse(packed, data, off, dn)
+//	Reads the entry at 'data', whose offset in its directory is 'off',
+//	into '*dn'.  'dn->dn_name' points into 'data'.
+//
+//   Returns: 0 on success, or -EIO if the entry is corrupt.
+
+static int
+ospfs_dirent_parse(int packed, const void *data, uint32_t off, ospfs_dirent_t *dn)
+{
+	dn->dn_off = off;
+	if (packed) {
+		const ospfs_dirrec_t *dr = data;
+		if (dr->dr_reclen < OSPFS_DIRREC_SIZE(dr->dr_ino ? dr->dr_namelen : 0)
+		    || dr->dr_reclen % 4 != 0
+		    || off % OSPFS_BLKSIZE + dr->dr_reclen > OSPFS_BLKSIZE
+		    || (dr->dr_ino && dr->dr_namelen == 0)) {
+			eprintk("ospfs: corrupt directory record at offset %u\n", off);
+			return -EIO;
+		}
+		dn->dn_reclen = dr->dr_reclen;
+		dn->dn_ino = dr->dr_ino;
+		dn->dn_hash = dr->dr_hash;
+		dn->dn_type = dr->dr_type;
+		dn->dn_namelen = dr->dr_namelen;
+		dn->dn_name = dr->dr_name;
+	} else {
+		const ospfs_direntry_t *od = data;
+		const char *name = od->od_name;
+		dn->dn_reclen = OSPFS_DIRENTRY_SIZE;
+		dn->dn_ino = od->od_ino;
+		// Older entries have no type, and their names may run into
+		// 'od_type'.  A stale name byte is not a valid type.
+		if (od->od_type > 0 && od->od_type <= OSPFS_FTYPE_SYMLINK + 1) {
+			dn->dn_type = od->od_type - 1;
+			dn->dn_namelen = strnlen(name, OSPFS_MAXNAMELEN);
+		} else {
+			dn->dn_type = -1;
+			dn->dn_namelen = strnlen(name, OSPFS_MAXNAMELEN + 1);
+		}
+		dn->dn_name = name;
+		dn->dn_hash = (od->od_ino ? ospfs_name_hash(od->od_name, dn->dn_namelen) : 0);
+	}
+	return 0;
+}
+
+
+// ospfs_dirent_get(sb, dir_oi, off, dn)
+//	Reads the entry at offset 'off' of directory 'dir_oi' into '*dn'.
+//
+//   Returns: 0 on success, or -EIO.
+
+static int
+ospfs_dirent_get(struct super_block *sb, ospfs_inode_t *dir_oi, uint32_t off, ospfs_dirent_t *dn)
+{
+	void *data = ospfs_inode_data(sb, dir_oi, off);
+	if (!data)
+		return -EIO;
+	return ospfs_dirent_parse(ospfs_dir_packed(dir_oi), data, off, dn);
+}
+
+
+// ospfs_dirent_align(sb, dir_oi, off)
+//	Returns the offset of the first entry of 'dir_oi' at or after 'off',
+//	or -EIO.  In a packed directory, removing a record merges it into the
+//	one before, so a saved offset may no longer start a record.
+
+static int
+ospfs_dirent_align(struct super_block *sb, ospfs_inode_t *dir_oi, uint32_t off)
+{
+	ospfs_dirent_t dn;
+	uint32_t pos;
+	int r;
+
+	if (!ospfs_dir_packed(dir_oi))
+		return off - off % OSPFS_DIRENTRY_SIZE
+			+ (off % OSPFS_DIRENTRY_SIZE ? OSPFS_DIRENTRY_SIZE : 0);
+	for (pos = off - off % OSPFS_BLKSIZE; pos < off; pos += dn.dn_reclen)
+		if ((r = ospfs_dirent_get(sb, dir_oi, pos, &dn)) < 0)
+			return r;
+	return pos;
+}
+
+
+// ospfs_dirent_set(sb, dir_oi, off, name, namelen, ino, type)
+//	Fills in the blank entry at offset 'off' of directory 'dir_oi', as
+//	returned by create_blank_direntry, and marks it dirty.
+//
+//   Returns: 0 on success, or -EIO.
+
+static int
+ospfs_dirent_set(struct super_block *sb, ospfs_inode_t *dir_oi, uint32_t off,
+		 const char *name, int namelen, uint32_t ino, int type)
+{
+	void *data = ospfs_inode_data(sb, dir_oi, off);
+
+	if (!data)
+		return -EIO;
+	if (ospfs_dir_packed(dir_oi)) {
+		ospfs_dirrec_t *dr = data;
+		dr->dr_ino = ino;
+		dr->dr_namelen = namelen;
+		dr->dr_type = type;
+		dr->dr_hash = ospfs_name_hash(name, namelen);
+		memcpy(dr->dr_name, name, namelen);
+	} else {
+		ospfs_direntry_t *od = data;
+		od->od_ino = ino;
+		memcpy(od->od_name, name, namelen);
+		od->od_name[namelen] = '\0';
+		od->od_type = type + 1;
+	}
+	ospfs_inode_data_dirty(sb, dir_oi, off);
+	return 0;
+}
+
+
+// ospfs_dirent_clear(sb, dir_oi, off)
+//	Removes the entry at offset 'off' of directory 'dir_oi', and marks it
+//	dirty.  A record in a packed directory is merged into the record
+//	before it in its block, if any, so that free space stays in one piece.
+//
+//   Returns: 0 on success, or -EIO.
+
+static int
+ospfs_dirent_clear(struct super_block *sb, ospfs_inode_t *dir_oi, uint32_t off)
+{
+	uint8_t *blk = ospfs_inode_data(sb, dir_oi, off - off % OSPFS_BLKSIZE);
+	uint32_t boff = off % OSPFS_BLKSIZE, pos, prev;
+	ospfs_dirent_t dn;
+	int r;
+
+	if (!blk)
+		return -EIO;
+	if (!ospfs_dir_packed(dir_oi)) {
+		((ospfs_direntry_t *) (blk + boff))->od_ino = 0;
+	} else {
+		for (pos = prev = 0; pos < boff; prev = pos, pos += dn.dn_reclen)
+			if ((r = ospfs_dirent_parse(1, blk + pos, pos, &dn)) < 0)
+				return r;
+		if (pos != boff
+		    || (r = ospfs_dirent_parse(1, blk + boff, boff, &dn)) < 0)
+			return -EIO;
+		if (boff > 0)
+			((ospfs_dirrec_t *) (blk + prev))->dr_reclen +=
+				((ospfs_dirrec_t *) (blk + boff))->dr_reclen;
+		else
+			((ospfs_dirrec_t *) blk)->dr_ino = 0;
+	}
+	ospfs_inode_data_dirty(sb, dir_oi, off);
+	return 0;
+}
+
+
+// ospfs_dirblock_init(blk, packed)
+//	Initializes the directory block 'blk' to hold no entries.
+
+static void
+ospfs_dirblock_init(void *blk, int packed)
+{
+	memset(blk, 0, OSPFS_BLKSIZE);
+	if (packed)
+		((ospfs_dirrec_t *) blk)->dr_reclen = OSPFS_BLKSIZE;
+}
+
+
+// ospfs_dirblock_room(blk, packed, namelen)
+//	Finds room for an entry with a 'namelen'-character name in directory
+//	block 'blk'.  In a packed block, this may split a record in two.  The
+//	caller marks the block dirty.
+//
+//   Returns: the offset of a blank entry within the block, -ENOSPC if the
+//	      block is full, or -EIO.
+
+static int
+ospfs_dirblock_room(void *blk, int packed, int namelen)
+{
+	uint32_t need = ospfs_dirent_size(packed, namelen), pos;
+	ospfs_dirent_t dn;
+	int r;
+
+	for (pos = 0; pos < OSPFS_BLKSIZE; pos += dn.dn_reclen) {
+		if ((r = ospfs_dirent_parse(packed, (uint8_t *) blk + pos, pos, &dn)) < 0)
+			return r;
+		if (!dn.dn_ino && dn.dn_reclen >= need)
+			return pos;
+		if (dn.dn_ino && packed
+		    && dn.dn_reclen - OSPFS_DIRREC_SIZE(dn.dn_namelen) >= need) {
+			// Give the record's spare space to a new, empty record.
+			ospfs_dirrec_t *dr = (ospfs_dirrec_t *) ((uint8_t *) blk + pos);
+			ospfs_dirrec_t *newdr;
+			dr->dr_reclen = OSPFS_DIRREC_SIZE(dn.dn_namelen);
+			newdr = (ospfs_dirrec_t *) ((uint8_t *) blk + pos + dr->dr_reclen);
+			newdr->dr_ino = 0;
+			newdr->dr_reclen = dn.dn_reclen - dr->dr_reclen;
+			newdr->dr_namelen = 0;
+			return pos + dr->dr_reclen;
+		}
+	}
+	return -ENOSPC;
+}
+
+
+// ospfs_dirblock_fill(blk, packed, ents, n)
+//	Replaces the contents of directory block 'blk' with the 'n' entries
+//	in 'ents', which must fit.  The entries' names must not point into
+//	'blk'.
+
+static void
+ospfs_dirblock_fill(void *blk, int packed, const ospfs_dirent_t *ents, int n)
+{
+	uint32_t pos = 0;
+	int i;
+
+	ospfs_dirblock_init(blk, packed);
+	for (i = 0; i < n; i++) {
+		const ospfs_dirent_t *dn = &ents[i];
+		if (packed) {
+			ospfs_dirrec_t *dr = (ospfs_dirrec_t *) ((uint8_t *) blk + pos);
+			dr->dr_ino = dn->dn_ino;
+			dr->dr_namelen = dn->dn_namelen;
+			dr->dr_type = dn->dn_type;
+			dr->dr_hash = dn->dn_hash;
+			memcpy(dr->dr_name, dn->dn_name, dn->dn_namelen);
+			// The last record takes the rest of the block.
+			dr->dr_reclen = (i + 1 < n ? OSPFS_DIRREC_SIZE(dn->dn_namelen)
+					 : OSPFS_BLKSIZE - pos);
+		} else {
+			ospfs_direntry_t *od = (ospfs_direntry_t *) ((uint8_t *) blk + pos);
+			od->od_ino = dn->dn_ino;
+			memcpy(od->od_name, dn->dn_name, dn->dn_namelen);
+			od->od_type = (dn->dn_type >= 0 ? dn->dn_type + 1 : 0);
+		}
+		pos += ospfs_dirent_size(packed, dn->dn_namelen);
+	}
+}
+
+static int
+ospfs_cmp_dirent_hash(const void *a, const void *b)
+{
+	const ospfs_dirent_t *x = a, *y = b;
+	return (x->dn_hash > y->dn_hash) - (x->dn_hash < y->dn_hash);
+}
+
+// Orders entries by hash, and entries with equal hashes by name, so that
+// every readdir call lists a leaf's entries in the same order.
+static int
+ospfs_cmp_dirent_hash_name(const void *a, const void *b)
+{
+	const ospfs_dirent_t *x = a, *y = b;
+	int r;
+
+	if (x->dn_hash != y->dn_hash)
+		return ospfs_cmp_dirent_hash(a, b);
+	r = memcmp(x->dn_name, y->dn_name, min(x->dn_namelen, y->dn_namelen));
+	return r ? r : x->dn_namelen - y->dn_namelen;
+}
+
+
+/*****************************************************************************
+ * DIRECTORY INDEXES
+ *
+ *   These functions maintain the hash index of large directories (see
+ *   ospfs.h).  A linear directory is converted to an indexed one when it
+ *   fills its blocks and must grow; after that, finding, adding and
+ *   removing a name touches only the index blocks and one leaf block.
+ *   Linear directories, including every directory made by ospfsformat,
+ *   are still read and searched entry by entry.
+ */
+
+// Readdir positions in an indexed directory are derived from name hashes,
+// so they stay valid while leaves split.  Positions 0 and 1 are "." and
+// "..", and positions fit in 31 bits for the sake of 32-bit telldir(), so
+// a position holds the top 31 bits of a hash, plus two.  (The highest few
+// hashes share the last position before OSPFS_DX_POS_EOF.)
+//
+// Names whose hashes share a position are told apart per open file, as
+// ext3 does for htree hash collisions.  When 'filldir' runs out of room
+// partway through the names at a position, 'filp->f_version' records one
+// more than the number of them returned (in ospfs_cmp_dirent_hash_name
+// order), and the next call skips that many.  Seeking elsewhere resets
+// 'f_version' to 0, so the count only applies where it was taken.
+#define OSPFS_DX_POS_EOF	0x7FFFFFFF
+#define OSPFS_DX_POS(hash)	(2 + min_t(uint32_t, (hash) >> 1, OSPFS_DX_POS_EOF - 3))
+#define OSPFS_DX_POS_HASH(pos)	(((uint32_t) (pos) - 2) << 1)
+
+static inline int
+ospfs_dir_indexed(ospfs_inode_t *dir_oi)
+{
+	return (dir_oi->oi_mode & OSPFS_MODE_DX) != 0;
+}
+
+
+// ospfs_dx_block(sb, dir_oi, lblock)
+//	Returns a pointer to the index block at block index 'lblock' of the
+//	directory, or NULL if it cannot be read or is not an index block.
+
+static ospfs_dx_block_t *
+ospfs_dx_block(struct super_block *sb, ospfs_inode_t *dir_oi, uint32_t lblock)
+{
+	ospfs_dx_block_t *dh;
+
+	if (lblock >= ospfs_size2nblocks(dir_oi->oi_size))
+		return NULL;
+	dh = ospfs_inode_data(sb, dir_oi, lblock * OSPFS_BLKSIZE);
+	if (!dh || dh->dh_magic != OSPFS_DX_MAGIC
+	    || dh->dh_count == 0 || dh->dh_count > OSPFS_DX_LIMIT)
+		return NULL;
+	return dh;
+}
+
+
+// ospfs_dx_search(dh, hash)
+//	Returns the position of the entry in index block 'dh' that covers
+//	'hash': the last entry whose 'dx_hash' is <= 'hash'.
+
+static int
+ospfs_dx_search(ospfs_dx_block_t *dh, uint32_t hash)
+{
+	int lo = 1, hi = dh->dh_count;
+
+	// Entry 0 covers everything below entry 1.
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (dh->dh_entries[mid].dx_hash <= hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+
+// A path from the root of a directory index down to a leaf.
+typedef struct ospfs_dx_path {
+	int levels;			// Index blocks on the path (1 or 2)
+	ospfs_dx_block_t *dh[2];	// The index blocks, root first
+	uint32_t lblock[2];		// Their block indexes
+	int pos[2];			// The entry followed in each
+	uint32_t leaf;			// Block index of the leaf
+} ospfs_dx_path_t;
+
+
+// ospfs_dx_probe(sb, dir_oi, hash, path)
+//	Walks the index of directory 'dir_oi' to the leaf covering 'hash',
+//	and records the way there in 'path'.
+//
+//   Returns: 0 on success, -EIO if the index is damaged.
+
+static int
+ospfs_dx_probe(struct super_block *sb, ospfs_inode_t *dir_oi, uint32_t hash, ospfs_dx_path_t *path)
+{
+	uint32_t nblocks = ospfs_size2nblocks(dir_oi->oi_size);
+	uint32_t lblock = 0;
+	int level;
+
+	if (!(path->dh[0] = ospfs_dx_block(sb, dir_oi, 0))
+	    || path->dh[0]->dh_levels > 1)
+		return -EIO;
+	path->levels = path->dh[0]->dh_levels + 1;
+	path->lblock[0] = 0;
+
+	for (level = 0; level < path->levels; level++) {
+		if (level > 0) {
+			path->dh[level] = ospfs_dx_block(sb, dir_oi, lblock);
+			if (!path->dh[level])
+				return -EIO;
+			path->lblock[level] = lblock;
+		}
+		path->pos[level] = ospfs_dx_search(path->dh[level], hash);
+		lblock = path->dh[level]->dh_entries[path->pos[level]].dx_block;
+		if (lblock == 0 || lblock >= nblocks)
+			return -EIO;
+	}
+
+	path->leaf = lblock;
+	return 0;
+}
+
+
+// ospfs_dx_next_leaf(sb, dir_oi, path)
+//	Advances 'path' to the next leaf in hash order.
+//
+//   Returns: 1 if there is a next leaf, 0 at the end of the index,
+//	      -EIO if the index is damaged.
+
+static int
+ospfs_dx_next_leaf(struct super_block *sb, ospfs_inode_t *dir_oi, ospfs_dx_path_t *path)
+{
+	int level = path->levels - 1;
+	uint32_t lblock = 0;
+
+	// Find the deepest index block with entries left...
+	while (level >= 0 && path->pos[level] + 1 >= path->dh[level]->dh_count)
+		level--;
+	if (level < 0)
+		return 0;
+	path->pos[level]++;
+
+	// ...then follow its next entry down to a leaf.
+	for (; level < path->levels; level++) {
+		if (level > 0 && path->pos[level] < 0) {
+			path->dh[level] = ospfs_dx_block(sb, dir_oi, lblock);
+			if (!path->dh[level])
+				return -EIO;
+			path->lblock[level] = lblock;
+			path->pos[level] = 0;
+		}
+		lblock = path->dh[level]->dh_entries[path->pos[level]].dx_block;
+		if (lblock == 0 || lblock >= ospfs_size2nblocks(dir_oi->oi_size))
+			return -EIO;
+		if (level + 1 < path->levels)
+			path->pos[level + 1] = -1;
+	}
+
+	path->leaf = lblock;
+	return 1;
+}
+
+
+// ospfs_dir_scan(sb, dir_oi, start, end, name, namelen, dn)
+//	Searches the directory entries at offsets 'start' up to 'end' for one
+//	named 'name'.  This is how linear directories are searched, and how
+//	a single leaf of an indexed directory is searched.  Records in a
+//	packed directory are skipped by length and hash, without looking at
+//	their names.
+//
+//   Returns: 1 if the entry is found, setting '*dn' (if non-NULL) to it;
+//	      0 if there is none; or -EIO.
+
+static int
+ospfs_dir_scan(struct super_block *sb, ospfs_inode_t *dir_oi, uint32_t start, uint32_t end, const char *name, int namelen, ospfs_dirent_t *dn)
+{
+	int packed = ospfs_dir_packed(dir_oi);
+	uint32_t hash = (packed ? ospfs_name_hash(name, namelen) : 0);
+	uint32_t off, reclen;
+	ospfs_dirent_t tmp;
+
+	if (!dn)
+		dn = &tmp;
+	for (off = start; off < end; off += reclen) {
+		void *data = ospfs_inode_data(sb, dir_oi, off);
+		if (!data)
+			return -EIO;
+		if (packed) {
+			ospfs_dirrec_t *dr = data;
+			reclen = dr->dr_reclen;
+			if (reclen < sizeof(ospfs_dirrec_t) || reclen % 4 != 0
+			    || off % OSPFS_BLKSIZE + reclen > OSPFS_BLKSIZE)
+				return ospfs_dirent_parse(1, data, off, dn);
+			if (!dr->dr_ino
+			    || dr->dr_namelen != namelen
+			    || dr->dr_hash != hash
+			    || memcmp(dr->dr_name, name, namelen) != 0)
+				continue;
+		} else {
+			ospfs_direntry_t *od = data;
+			reclen = OSPFS_DIRENTRY_SIZE;
+			if (!od->od_ino
+			    || strlen(od->od_name) != namelen
+			    || memcmp(od->od_name, name, namelen) != 0)
+				continue;
+		}
+		return ospfs_dirent_parse(packed, data, off, dn) < 0 ? -EIO : 1;
+	}
+	return 0;
+}
+
+
+// ospfs_dx_find(sb, dir_oi, name, namelen, dn)
+//	Like ospfs_dir_scan, but searches only the leaf of indexed directory
+//	'dir_oi' that can hold 'name'.
+
+static int
+ospfs_dx_find(struct super_block *sb, ospfs_inode_t *dir_oi, const char *name, int namelen, ospfs_dirent_t *dn)
+{
+	ospfs_dx_path_t path;
+	int r;
+
+	r = ospfs_dx_probe(sb, dir_oi, ospfs_name_hash(name, namelen), &path);
+	if (r < 0)
+		return r;
+	return ospfs_dir_scan(sb, dir_oi, path.leaf * OSPFS_BLKSIZE,
+			      (path.leaf + 1) * OSPFS_BLKSIZE,
+			      name, namelen, dn);
+}
+
+
+// ospfs_dx_insert(dh, pos, hash, lblock)
+//	Inserts the pair ('hash', 'lblock') into index block 'dh' at
+//	position 'pos'.  The caller makes sure there is room, and marks the
+//	block dirty.
+
+static void
+ospfs_dx_insert(ospfs_dx_block_t *dh, int pos, uint32_t hash, uint32_t lblock)
+{
+	memmove(&dh->dh_entries[pos + 1], &dh->dh_entries[pos],
+		(dh->dh_count - pos) * sizeof(ospfs_dx_entry_t));
+	dh->dh_entries[pos].dx_hash = hash;
+	dh->dh_entries[pos].dx_block = lblock;
+	dh->dh_count++;
+}
+
+
+// ospfs_dx_new_block(dir, lblock)
+//	Adds a zeroed block to directory 'dir', and sets '*lblock' to its
+//	block index.
+//
+//   Returns: a pointer to the block, or an error pointer.
+
+static void *
+ospfs_dx_new_block(struct inode *dir, uint32_t *lblock)
+{
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_sb, dir->i_ino);
+	void *data;
+	int r;
+
+	*lblock = ospfs_size2nblocks(dir_oi->oi_size);
+	if ((r = add_block(dir)) < 0)
+		return ERR_PTR(r);
+	if (!(data = ospfs_inode_data(dir->i_sb, dir_oi, *lblock * OSPFS_BLKSIZE)))
+		return ERR_PTR(-EIO);
+	return data;
+}
+
+
+// ospfs_dx_grow_index(dir, path)
+//	Makes room in the index block that points at 'path's leaf, so that
+//	the leaf can be split.  A full root is pushed down a level; a full
+//	interior block is split in two.
+//
+//   Returns: 0 on success (the caller must probe again, since the index
+//	      has changed), -ENOSPC if the index cannot grow further, or
+//	      another error.
+
+static int
+ospfs_dx_grow_index(struct inode *dir, ospfs_dx_path_t *path)
+{
+	struct super_block *sb = dir->i_sb;
+	ospfs_inode_t *dir_oi = ospfs_inode(sb, dir->i_ino);
+	ospfs_dx_block_t *root = path->dh[0], *dh, *newdh;
+	uint32_t lblock;
+	int half;
+
+	if (path->levels == 1) {
+		// Move the root's entries into a new interior block.
+		newdh = ospfs_dx_new_block(dir, &lblock);
+		if (IS_ERR(newdh))
+			return PTR_ERR(newdh);
+		memcpy(newdh, root, OSPFS_BLKSIZE);
+		newdh->dh_levels = 0;
+		ospfs_inode_data_dirty(sb, dir_oi, lblock * OSPFS_BLKSIZE);
+
+		root->dh_levels = 1;
+		root->dh_count = 1;
+		root->dh_entries[0].dx_hash = 0;
+		root->dh_entries[0].dx_block = lblock;
+		ospfs_inode_data_dirty(sb, dir_oi, 0);
+		return 0;
+	}
+
+	if (root->dh_count >= OSPFS_DX_LIMIT)
+		return -ENOSPC;
+
+	// Move the upper half of the interior block into a new one.
+	dh = path->dh[1];
+	newdh = ospfs_dx_new_block(dir, &lblock);
+	if (IS_ERR(newdh))
+		return PTR_ERR(newdh);
+	half = dh->dh_count / 2;
+	newdh->dh_magic = OSPFS_DX_MAGIC;
+	newdh->dh_count = dh->dh_count - half;
+	memcpy(newdh->dh_entries, &dh->dh_entries[half],
+	       newdh->dh_count * sizeof(ospfs_dx_entry_t));
+	dh->dh_count = half;
+	ospfs_inode_data_dirty(sb, dir_oi, lblock * OSPFS_BLKSIZE);
+	ospfs_inode_data_dirty(sb, dir_oi, path->lblock[1] * OSPFS_BLKSIZE);
+
+	ospfs_dx_insert(root, path->pos[0] + 1,
+			newdh->dh_entries[0].dx_hash, lblock);
+	ospfs_inode_data_dirty(sb, dir_oi, 0);
+	return 0;
+}
+
+
+// ospfs_dx_split_hash(hashes, n)
+//	'hashes' is a sorted array of 'n' hashes.  Returns the hash at which
+//	to split them in two, as near the middle as possible without
+//	separating equal hashes, or 0 if all the hashes are equal.
+
+static uint32_t
+ospfs_dx_split_hash(uint32_t *hashes, int n)
+{
+	int d;
+
+	for (d = 0; d < n; d++) {
+		int i = n / 2 + d, j = n / 2 - d;
+		if (i < n && i > 0 && hashes[i - 1] != hashes[i])
+			return hashes[i];
+		if (j > 0 && j < n && hashes[j - 1] != hashes[j])
+			return hashes[j];
+	}
+	return 0;
+}
+
+static int
+ospfs_cmp_hash(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+
+// ospfs_dx_split_leaf(dir, path, hash)
+//	Splits the full leaf at the end of 'path' in two, so that a name with
+//	hash 'hash' can be added.  Names whose hashes are at least the split
+//	hash move to a new leaf.
+//
+//   Returns: 0 on success (the caller must probe again), -ENOSPC if the
+//	      leaf cannot be split, or another error.
+
+static int
+ospfs_dx_split_leaf(struct inode *dir, ospfs_dx_path_t *path, uint32_t hash)
+{
+	struct super_block *sb = dir->i_sb;
+	ospfs_inode_t *dir_oi = ospfs_inode(sb, dir->i_ino);
+	int packed = ospfs_dir_packed(dir_oi);
+	ospfs_dx_block_t *parent = path->dh[path->levels - 1];
+	uint32_t hashes[OSPFS_BLKMAXENTRIES + 1];
+	ospfs_dirent_t dn, *ents = NULL;
+	uint8_t *copy = NULL, *leaf, *newleaf;
+	uint32_t split, lblock, pos;
+	int i, n = 0, nlow, r;
+
+	if (parent->dh_count >= OSPFS_DX_LIMIT)
+		return ospfs_dx_grow_index(dir, path);
+
+	if (!(leaf = ospfs_inode_data(sb, dir_oi, path->leaf * OSPFS_BLKSIZE)))
+		return -EIO;
+
+	// Work from a copy of the leaf, sorted by hash, since both halves
+	// are rewritten.
+	r = -ENOMEM;
+	if (!(copy = kmalloc(OSPFS_BLKSIZE, GFP_KERNEL))
+	    || !(ents = kmalloc(OSPFS_BLKMAXENTRIES * sizeof(ospfs_dirent_t), GFP_KERNEL)))
+		goto out;
+	memcpy(copy, leaf, OSPFS_BLKSIZE);
+	for (pos = 0; pos < OSPFS_BLKSIZE; pos += dn.dn_reclen) {
+		if ((r = ospfs_dirent_parse(packed, copy + pos, pos, &dn)) < 0)
+			goto out;
+		if (dn.dn_ino)
+			ents[n++] = dn;
+	}
+	sort(ents, n, sizeof(ospfs_dirent_t), ospfs_cmp_dirent_hash, NULL);
+
+	for (i = 0; i < n; i++)
+		hashes[i] = ents[i].dn_hash;
+	hashes[n] = hash;
+	sort(hashes, n + 1, sizeof(uint32_t), ospfs_cmp_hash, NULL);
+	r = -ENOSPC;
+	if (!(split = ospfs_dx_split_hash(hashes, n + 1)))
+		goto out;
+
+	newleaf = ospfs_dx_new_block(dir, &lblock);
+	if (IS_ERR(newleaf)) {
+		r = PTR_ERR(newleaf);
+		goto out;
+	}
+	for (nlow = 0; nlow < n && ents[nlow].dn_hash < split; nlow++)
+		/* do nothing */;
+	ospfs_dirblock_fill(newleaf, packed, &ents[nlow], n - nlow);
+	ospfs_dirblock_fill(leaf, packed, ents, nlow);
+	ospfs_inode_data_dirty(sb, dir_oi, lblock * OSPFS_BLKSIZE);
+	ospfs_inode_data_dirty(sb, dir_oi, path->leaf * OSPFS_BLKSIZE);
+
+	ospfs_dx_insert(parent, path->pos[path->levels - 1] + 1, split, lblock);
+	ospfs_inode_data_dirty(sb, dir_oi, path->lblock[path->levels - 1] * OSPFS_BLKSIZE);
+	r = 0;
+
+    out:
+	kfree(ents);
+	kfree(copy);
+	return r;
+}
+
+
+// ospfs_dx_add_slot(dir, name, namelen, entry_off)
+//	Finds a blank directory entry in the leaf of indexed directory 'dir'
+//	that covers 'name', splitting leaves as necessary.  On success,
+//	'*entry_off' is set to the entry's offset.
+//
+//   Returns: 0 on success, < 0 on error.
+
+static int
+ospfs_dx_add_slot(struct inode *dir, const char *name, int namelen, uint32_t *entry_off)
+{
+	struct super_block *sb = dir->i_sb;
+	ospfs_inode_t *dir_oi = ospfs_inode(sb, dir->i_ino);
+	uint32_t hash = ospfs_name_hash(name, namelen);
+	ospfs_dx_path_t path;
+	void *leaf;
+	int r;
+
+	while (1) {
+		if ((r = ospfs_dx_probe(sb, dir_oi, hash, &path)) < 0)
+			return r;
+
+		if (!(leaf = ospfs_inode_data(sb, dir_oi, path.leaf * OSPFS_BLKSIZE)))
+			return -EIO;
+		r = ospfs_dirblock_room(leaf, ospfs_dir_packed(dir_oi), namelen);
+		if (r >= 0) {
+			*entry_off = path.leaf * OSPFS_BLKSIZE + r;
+			ospfs_inode_data_dirty(sb, dir_oi, *entry_off);
+			return 0;
+		} else if (r != -ENOSPC)
+			return r;
+
+		if ((r = ospfs_dx_split_leaf(dir, &path, hash)) < 0)
+			return r;
+	}
+}
+
+
+// ospfs_dx_convert(dir)
+//	Converts the full linear directory 'dir' into an indexed directory.
+//	The directory's entries are sorted by hash and written as packed
+//	records into leaves three-quarters full, leaving room for new names,
+//	behind a root index block (and interior index blocks, if the
+//	directory is very large).
+//
+//	Readdir positions change meaning, so a process reading the directory
+//	while it is converted may see some names twice or not at all.
+//
+//   Returns: 0 on success, < 0 on error.  On error the directory is
+//	      put back as it was, a linear directory with its old size and
+//	      entries, from the copy taken first.  (If even that fails, the
+//	      error is logged.)
+
+static int
+ospfs_dx_convert(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	ospfs_inode_t *dir_oi = ospfs_inode(sb, dir->i_ino);
+	int packed = ospfs_dir_packed(dir_oi);
+	uint32_t old_size = dir_oi->oi_size;
+	uint32_t nblocks = ospfs_size2nblocks(old_size), old_nblocks = nblocks;
+	uint32_t maxents = nblocks * (packed ? OSPFS_BLKMAXENTRIES : OSPFS_BLKSIZE / OSPFS_DIRENTRY_SIZE);
+	char *copy = NULL;
+	ospfs_dirent_t dn, *ents = NULL;
+	ospfs_dx_entry_t *leaves = NULL;
+	uint32_t n = 0, nleaves, ninterior, b, i, off, used;
+	int r = -ENOMEM;
+
+	// Copy the live entries, and sort them by hash.  Entries that do not
+	// record their file's type get it from the inode.
+	if (!(copy = vmalloc(nblocks * OSPFS_BLKSIZE))
+	    || !(ents = vmalloc(maxents * sizeof(*ents))))
+		goto out;
+	for (b = 0; b < nblocks; b++) {
+		void *data = ospfs_inode_data(sb, dir_oi, b * OSPFS_BLKSIZE);
+		if (!data) {
+			r = -EIO;
+			goto out;
+		}
+		memcpy(copy + b * OSPFS_BLKSIZE, data, OSPFS_BLKSIZE);
+	}
+	for (off = 0; off < nblocks * OSPFS_BLKSIZE; off += dn.dn_reclen) {
+		if ((r = ospfs_dirent_parse(packed, copy + off, off, &dn)) < 0)
+			goto out;
+		if (!dn.dn_ino)
+			continue;
+		if (dn.dn_type < 0) {
+			ospfs_inode_t *entry_oi = ospfs_inode(sb, dn.dn_ino);
+			if (!entry_oi) {
+				r = -EIO;
+				goto out;
+			}
+			dn.dn_type = entry_oi->oi_ftype;
+		}
+		ents[n++] = dn;
+	}
+	sort(ents, n, sizeof(*ents), ospfs_cmp_dirent_hash, NULL);
+
+	// Divide the entries into leaves, never separating equal hashes.
+	r = -ENOMEM;
+	if (!(leaves = vmalloc((n + 1) * sizeof(*leaves))))
+		goto out;
+	nleaves = 1;
+	leaves[0].dx_hash = 0;
+	leaves[0].dx_block = 0;		// First entry of the leaf, for now
+	for (i = 0, used = 0; i < n; i++) {
+		uint32_t size = OSPFS_DIRREC_SIZE(ents[i].dn_namelen);
+		if (used + size > OSPFS_BLKSIZE * 3 / 4 && used > 0
+		    && ents[i].dn_hash != ents[i - 1].dn_hash) {
+			leaves[nleaves].dx_hash = ents[i].dn_hash;
+			leaves[nleaves].dx_block = i;
+			nleaves++;
+			used = 0;
+		} else if (used + size > OSPFS_BLKSIZE) {
+			r = -ENOSPC;
+			goto out;
+		}
+		used += size;
+	}
+	ninterior = (nleaves > OSPFS_DX_LIMIT
+		     ? (nleaves + OSPFS_DX_LIMIT - 1) / OSPFS_DX_LIMIT : 0);
+	if (ninterior > OSPFS_DX_LIMIT) {
+		r = -ENOSPC;
+		goto out;
+	}
+
+	// Grow the directory to fit: root, interior blocks, then leaves.
+	if ((r = change_size(dir, (1 + ninterior + nleaves) * OSPFS_BLKSIZE)) < 0)
+		goto undo;
+	nblocks = 1 + ninterior + nleaves;
+	for (b = 0; b < nblocks; b++) {
+		void *data = ospfs_inode_data(sb, dir_oi, b * OSPFS_BLKSIZE);
+		if (!data) {
+			r = -EIO;
+			goto undo;
+		}
+		memset(data, 0, OSPFS_BLKSIZE);
+		ospfs_inode_data_dirty(sb, dir_oi, b * OSPFS_BLKSIZE);
+	}
+
+	// Fill the leaves.
+	for (b = 0; b < nleaves; b++) {
+		uint32_t first = leaves[b].dx_block;
+		uint32_t last = (b + 1 < nleaves ? leaves[b + 1].dx_block : n);
+
+		leaves[b].dx_block = 1 + ninterior + b;
+		ospfs_dirblock_fill(ospfs_inode_data(sb, dir_oi, leaves[b].dx_block * OSPFS_BLKSIZE),
+				    1, &ents[first], last - first);
+	}
+
+	// Fill the index blocks.
+	{
+		ospfs_dx_block_t *root = ospfs_inode_data(sb, dir_oi, 0);
+		root->dh_magic = OSPFS_DX_MAGIC;
+		if (ninterior == 0) {
+			root->dh_count = nleaves;
+			memcpy(root->dh_entries, leaves, nleaves * sizeof(*leaves));
+		} else {
+			root->dh_levels = 1;
+			root->dh_count = ninterior;
+			for (b = 0; b < ninterior; b++) {
+				ospfs_dx_block_t *dh = ospfs_inode_data(sb, dir_oi, (1 + b) * OSPFS_BLKSIZE);
+				uint32_t first = b * OSPFS_DX_LIMIT;
+				dh->dh_magic = OSPFS_DX_MAGIC;
+				dh->dh_count = min_t(uint32_t, nleaves - first, OSPFS_DX_LIMIT);
+				memcpy(dh->dh_entries, &leaves[first],
+				       dh->dh_count * sizeof(*leaves));
+				root->dh_entries[b].dx_hash = leaves[first].dx_hash;
+				root->dh_entries[b].dx_block = 1 + b;
+			}
+		}
+	}
+
+	dir_oi->oi_mode |= OSPFS_MODE_DX | OSPFS_MODE_PACKED;
+	ospfs_inode_dirty(sb, dir->i_ino);
+	ospfs_dcache_drop(sb, dir->i_ino);
+	r = 0;
+	goto out;
+
+    undo:
+	// Blocks may have been added, removed or cleared: restore the old
+	// size, then the old contents.
+	b = 0;
+	if (change_size(dir, old_size) == 0)
+		for (; b < old_nblocks; b++) {
+			void *data = ospfs_inode_data(sb, dir_oi, b * OSPFS_BLKSIZE);
+			if (!data)
+				break;
+			memcpy(data, copy + b * OSPFS_BLKSIZE, OSPFS_BLKSIZE);
+			ospfs_inode_data_dirty(sb, dir_oi, b * OSPFS_BLKSIZE);
+		}
+	if (b < old_nblocks)
+		eprintk("ospfs: directory %lu damaged by a failed conversion\n",
+			(unsigned long) dir->i_ino);
+	ospfs_dcache_drop(sb, dir->i_ino);
+
+    out:
+	vfree(leaves);
+	vfree(ents);
+	vfree(copy);
+	return r;
+}
+
+
+// ospfs_dx_readdir(filp, dirent, filldir, dir_oi)
+//	Reads indexed directory 'dir_oi' for ospfs_dir_readdir, in hash
+//	order, starting at position 'filp->f_pos' (which must be at least 2).
+//	If 'filldir' runs out of room among names that share a position,
+//	'filp->f_version' remembers how many were returned.  (If names at that
+//	position are added or removed before the next call, it may repeat or
+//	skip some of them, as readdir may when a directory changes.)
+//
+//   Returns: 1 at end of directory, 0 if filldir returns < 0 before the
+//	      end, and -(error number) on error.
+
+static int ospfs_entry_dtype(struct super_block *sb, const ospfs_dirent_t *dn);
+
+static int
+ospfs_dx_readdir(struct file *filp, void *dirent, filldir_t filldir, ospfs_inode_t *dir_oi)
+{
+	struct super_block *sb = filp->f_dentry->d_inode->i_sb;
+	int packed = ospfs_dir_packed(dir_oi);
+	ospfs_dirent_t dn, *ents;
+	uint32_t start, pos, done = 0;
+	uint32_t skip = (filp->f_version ? filp->f_version - 1 : 0);
+	loff_t first = filp->f_pos, last = first;
+	ospfs_dx_path_t path;
+	int r, i, n;
+
+	if (filp->f_pos >= OSPFS_DX_POS_EOF)
+		return 1;
+
+	start = OSPFS_DX_POS_HASH(first);
+	if ((r = ospfs_dx_probe(sb, dir_oi, start, &path)) < 0)
+		return r;
+	if (!(ents = kmalloc(OSPFS_BLKMAXENTRIES * sizeof(ospfs_dirent_t), GFP_KERNEL)))
+		return -ENOMEM;
+
+	do {
+		uint8_t *leaf = ospfs_inode_data(sb, dir_oi, path.leaf * OSPFS_BLKSIZE);
+		if (!leaf) {
+			r = -EIO;
+			goto out;
+		}
+
+		for (pos = 0, n = 0; pos < OSPFS_BLKSIZE; pos += dn.dn_reclen) {
+			if ((r = ospfs_dirent_parse(packed, leaf + pos, pos, &dn)) < 0)
+				goto out;
+			if (dn.dn_ino && dn.dn_hash >= start)
+				ents[n++] = dn;
+		}
+		sort(ents, n, sizeof(ospfs_dirent_t), ospfs_cmp_dirent_hash_name, NULL);
+
+		for (i = 0; i < n; i++) {
+			loff_t fpos = OSPFS_DX_POS(ents[i].dn_hash);
+			int type;
+
+			// Count the names returned at each position, and skip
+			// those an earlier call returned at the first one.
+			if (fpos != last) {
+				last = fpos;
+				done = 0;
+			}
+			if (fpos == first && done < skip) {
+				done++;
+				continue;
+			}
+
+			type = ospfs_entry_dtype(sb, &ents[i]);
+			if (type < 0) {
+				r = type;
+				goto out;
+			}
+			if (filldir(dirent, ents[i].dn_name, ents[i].dn_namelen,
+				    fpos, ents[i].dn_ino, type) < 0) {
+				filp->f_pos = fpos;
+				filp->f_version = done + 1;
+				r = 0;
+				goto out;
+			}
+			done++;
+		}
+	} while ((r = ospfs_dx_next_leaf(sb, dir_oi, &path)) > 0);
+
+	if (r == 0) {
+		filp->f_pos = OSPFS_DX_POS_EOF;
+		filp->f_version = 0;
+		r = 1;
+	}
+
+    out:
+	kfree(ents);
+	return r;
+}
+
+
+/*****************************************************************************
+ * DIRECTORY COMPACTION
+ *
+ *   Removing names leaves free space behind, and a directory that once
+ *   held many names would otherwise keep its blocks forever.  In an
+ *   indexed directory, neighboring leaves that have become sparse are
+ *   merged, and the freed blocks are released by moving the directory's
+ *   last blocks into the holes and shrinking it.  Readdir positions are
+ *   name hashes, so they stay valid while leaves move.  A linear
+ *   directory's readdir positions are entry offsets, so its entries never
+ *   move; it only loses trailing blocks that hold no live entries.
+ *
+ *   ospfs_unlink compacts around the name it removes; OSPFS_IOC_COMPACT
+ *   compacts the whole directory.
+ */
+
+// Leaves are merged on unlink when the result is at most half full, so
+// that the merged leaf is not split again right away.  OSPFS_IOC_COMPACT
+// packs leaves as full as ospfs_dx_convert does.
+#define OSPFS_DX_MERGE_AUTO	(OSPFS_BLKSIZE / 2)
+#define OSPFS_DX_MERGE_FULL	(OSPFS_BLKSIZE * 3 / 4)
+
+
+// ospfs_dirblock_used(blk, packed, ents, n)
+//	Returns the bytes the live entries of directory block 'blk' need, or
+//	-EIO.  If 'ents' is non-NULL, the entries are also appended to it,
+//	starting at index '*n', and '*n' is advanced.
+
+static int
+ospfs_dirblock_used(const void *blk, int packed, ospfs_dirent_t *ents, int *n)
+{
+	ospfs_dirent_t dn;
+	uint32_t pos;
+	int used = 0, r;
+
+	for (pos = 0; pos < OSPFS_BLKSIZE; pos += dn.dn_reclen) {
+		if ((r = ospfs_dirent_parse(packed, (const uint8_t *) blk + pos, pos, &dn)) < 0)
+			return r;
+		if (!dn.dn_ino)
+			continue;
+		used += ospfs_dirent_size(packed, dn.dn_namelen);
+		if (ents)
+			ents[(*n)++] = dn;
+	}
+	return used;
+}
+
+
+// ospfs_dx_merge_leaves(dir, dh, dh_lblock, pos, limit)
+//	Merges the leaf named by entry 'pos' + 1 of index block 'dh' (at
+//	block index 'dh_lblock') into the leaf named by entry 'pos', if
+//	their live entries fit in 'limit' bytes.  The second leaf's block is
+//	left unreferenced, for ospfs_dx_release_blocks.
+//
+//   Returns: 1 if the leaves were merged, 0 if not, or < 0 on error.
+
+static int
+ospfs_dx_merge_leaves(struct inode *dir, ospfs_dx_block_t *dh, uint32_t dh_lblock, int pos, uint32_t limit)
+{
+	struct super_block *sb = dir->i_sb;
+	ospfs_inode_t *dir_oi = ospfs_inode(sb, dir->i_ino);
+	int packed = ospfs_dir_packed(dir_oi);
+	uint32_t a = dh->dh_entries[pos].dx_block;
+	uint32_t b = dh->dh_entries[pos + 1].dx_block;
+	uint8_t *leafa, *leafb, *copy = NULL;
+	ospfs_dirent_t *ents = NULL;
+	int usedb, n = 0, r;
+
+	if (!(leafa = ospfs_inode_data(sb, dir_oi, a * OSPFS_BLKSIZE))
+	    || !(leafb = ospfs_inode_data(sb, dir_oi, b * OSPFS_BLKSIZE)))
+		return -EIO;
+	if ((r = ospfs_dirblock_used(leafa, packed, NULL, NULL)) < 0
+	    || (usedb = ospfs_dirblock_used(leafb, packed, NULL, NULL)) < 0)
+		return (r < 0 ? r : usedb);
+	if (r + usedb > limit)
+		return 0;
+
+	// Work from a copy of the first leaf, since it is rewritten.
+	r = -ENOMEM;
+	if (!(copy = kmalloc(OSPFS_BLKSIZE, GFP_KERNEL))
+	    || !(ents = kmalloc(2 * OSPFS_BLKMAXENTRIES * sizeof(ospfs_dirent_t), GFP_KERNEL)))
+		goto out;
+	memcpy(copy, leafa, OSPFS_BLKSIZE);
+	if ((r = ospfs_dirblock_used(copy, packed, ents, &n)) < 0
+	    || (r = ospfs_dirblock_used(leafb, packed, ents, &n)) < 0)
+		goto out;
+	ospfs_dirblock_fill(leafa, packed, ents, n);
+	ospfs_inode_data_dirty(sb, dir_oi, a * OSPFS_BLKSIZE);
+
+	memmove(&dh->dh_entries[pos + 1], &dh->dh_entries[pos + 2],
+		(dh->dh_count - pos - 2) * sizeof(ospfs_dx_entry_t));
+	dh->dh_count--;
+	ospfs_inode_data_dirty(sb, dir_oi, dh_lblock * OSPFS_BLKSIZE);
+	r = 1;
+
+    out:
+	kfree(ents);
+	kfree(copy);
+	return r;
+}
+
+
+// ospfs_dx_release_blocks(dir)
+//	Releases the blocks of indexed directory 'dir' that its index no
+//	longer refers to.  Blocks from the end of the directory are moved
+//	into the holes, and their index entries updated, until the directory
+//	can be shrunk.
+//
+//   Returns: the number of blocks released, or < 0 on error.
+
+typedef struct ospfs_dx_owner {
+	uint32_t parent;		// Index block referring to this block
+	int pos;			// Entry in 'parent', or -1 if none
+} ospfs_dx_owner_t;
+
+static int
+ospfs_dx_release_blocks(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	ospfs_inode_t *dir_oi = ospfs_inode(sb, dir->i_ino);
+	uint32_t oldn = ospfs_size2nblocks(dir_oi->oi_size), n = oldn;
+	uint32_t hole, last, b, child;
+	ospfs_dx_block_t *root, *dh;
+	ospfs_dx_owner_t *owner;
+	int i, j, r;
+
+	if (!(root = ospfs_dx_block(sb, dir_oi, 0)) || root->dh_levels > 1)
+		return -EIO;
+	if (!(owner = vmalloc(oldn * sizeof(ospfs_dx_owner_t))))
+		return -ENOMEM;
+	for (b = 0; b < oldn; b++)
+		owner[b].pos = -1;
+	owner[0].pos = 0;		// The root owns itself
+
+	// Find every block the index refers to.
+	r = -EIO;
+	for (i = 0; i < root->dh_count; i++) {
+		child = root->dh_entries[i].dx_block;
+		if (child == 0 || child >= oldn || owner[child].pos >= 0)
+			goto out;
+		owner[child].parent = 0;
+		owner[child].pos = i;
+		if (root->dh_levels == 0)
+			continue;
+		if (!(dh = ospfs_dx_block(sb, dir_oi, child)))
+			goto out;
+		for (j = 0; j < dh->dh_count; j++) {
+			b = dh->dh_entries[j].dx_block;
+			if (b == 0 || b >= oldn || owner[b].pos >= 0)
+				goto out;
+			owner[b].parent = child;
+			owner[b].pos = j;
+		}
+	}
+
+	// Fill holes from the end.
+	while (1) {
+		while (n > 1 && owner[n - 1].pos < 0)
+			n--;
+		for (hole = 1; hole < n && owner[hole].pos >= 0; hole++)
+			/* do nothing */;
+		if (hole >= n)
+			break;
+
+		last = n - 1;
+		dh = ospfs_inode_data(sb, dir_oi, owner[last].parent * OSPFS_BLKSIZE);
+		if (!dh
+		    || !ospfs_inode_data(sb, dir_oi, hole * OSPFS_BLKSIZE)
+		    || !ospfs_inode_data(sb, dir_oi, last * OSPFS_BLKSIZE))
+			goto out;
+		memcpy(ospfs_inode_data(sb, dir_oi, hole * OSPFS_BLKSIZE),
+		       ospfs_inode_data(sb, dir_oi, last * OSPFS_BLKSIZE),
+		       OSPFS_BLKSIZE);
+		ospfs_inode_data_dirty(sb, dir_oi, hole * OSPFS_BLKSIZE);
+		dh->dh_entries[owner[last].pos].dx_block = hole;
+		ospfs_inode_data_dirty(sb, dir_oi, owner[last].parent * OSPFS_BLKSIZE);
+
+		owner[hole] = owner[last];
+		owner[last].pos = -1;
+		// A moved interior block takes its children with it.
+		for (b = 1; b < n; b++)
+			if (owner[b].pos >= 0 && owner[b].parent == last && b != hole)
+				owner[b].parent = hole;
+	}
+
+	r = 0;
+	if (n < oldn && (r = change_size(dir, n * OSPFS_BLKSIZE)) == 0)
+		r = oldn - n;
+
+    out:
+	vfree(owner);
+	return r;
+}
+
+
+// ospfs_dir_trim(dir)
+//	Releases the trailing blocks of linear directory 'dir' that hold no
+//	live entries.
+//
+//   Returns: the number of blocks released, or < 0 on error.
+
+static int
+ospfs_dir_trim(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	ospfs_inode_t *dir_oi = ospfs_inode(sb, dir->i_ino);
+	uint32_t oldn = ospfs_size2nblocks(dir_oi->oi_size), n = oldn;
+	void *blk;
+	int r = 0;
+
+	while (n > 0) {
+		if (!(blk = ospfs_inode_data(sb, dir_oi, (n - 1) * OSPFS_BLKSIZE)))
+			return -EIO;
+		if ((r = ospfs_dirblock_used(blk, ospfs_dir_packed(dir_oi), NULL, NULL)) != 0)
+			break;
+		n--;
+	}
+	if (r < 0)
+		return r;
+	if (n == oldn)
+		return 0;
+
+	ospfs_dcache_drop(sb, dir->i_ino);
+	if ((r = change_size(dir, n * OSPFS_BLKSIZE)) < 0)
+		return r;
+	return oldn - n;
+}
+
+
+// ospfs_dir_shrink(dir, hash, entry_off)
+//	Called by ospfs_unlink after removing the name with hash 'hash', at
+//	offset 'entry_off', from 'dir'.  Merges the name's leaf with a
+//	neighbor if both are sparse, or trims a linear directory whose last
+//	block has emptied.  Failing to shrink is not an error.
+
+static void
+ospfs_dir_shrink(struct inode *dir, uint32_t hash, uint32_t entry_off)
+{
+	struct super_block *sb = dir->i_sb;
+	ospfs_inode_t *dir_oi = ospfs_inode(sb, dir->i_ino);
+	ospfs_dx_path_t path;
+	ospfs_dx_block_t *dh;
+	int pos, r;
+
+	if (!ospfs_dir_indexed(dir_oi)) {
+		if (entry_off / OSPFS_BLKSIZE + 1 == ospfs_size2nblocks(dir_oi->oi_size))
+			(void) ospfs_dir_trim(dir);
+		return;
+	}
+
+	if (ospfs_dx_probe(sb, dir_oi, hash, &path) < 0)
+		return;
+	dh = path.dh[path.levels - 1];
+	pos = path.pos[path.levels - 1];
+	r = 0;
+	if (pos + 1 < dh->dh_count)
+		r = ospfs_dx_merge_leaves(dir, dh, path.lblock[path.levels - 1], pos, OSPFS_DX_MERGE_AUTO);
+	if (r == 0 && pos > 0)
+		r = ospfs_dx_merge_leaves(dir, dh, path.lblock[path.levels - 1], pos - 1, OSPFS_DX_MERGE_AUTO);
+	if (r > 0)
+		(void) ospfs_dx_release_blocks(dir);
+}
+
+
+// ospfs_dir_compact(dir)
+//	Compacts all of 'dir': merges every run of neighboring leaves that
+//	fit in one block, then releases the freed blocks.  This is
+//	OSPFS_IOC_COMPACT.
+//
+//   Returns: the number of blocks released, or < 0 on error.
+
+static int
+ospfs_dir_compact(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	ospfs_inode_t *dir_oi = ospfs_inode(sb, dir->i_ino);
+	ospfs_dx_block_t *root, *dh;
+	uint32_t lblock;
+	int i, pos, r;
+
+	if (!ospfs_dir_indexed(dir_oi))
+		return ospfs_dir_trim(dir);
+
+	if (!(root = ospfs_dx_block(sb, dir_oi, 0)) || root->dh_levels > 1)
+		return -EIO;
+	for (i = 0; i < (root->dh_levels ? root->dh_count : 1); i++) {
+		lblock = (root->dh_levels ? root->dh_entries[i].dx_block : 0);
+		if (!(dh = ospfs_dx_block(sb, dir_oi, lblock)))
+			return -EIO;
+		pos = 0;
+		while (pos + 1 < dh->dh_count) {
+			r = ospfs_dx_merge_leaves(dir, dh, lblock, pos, OSPFS_DX_MERGE_FULL);
+			if (r < 0)
+				return r;
+			else if (r == 0)
+				pos++;
+		}
+	}
+	return ospfs_dx_release_blocks(dir);
+}
+
+
+/*****************************************************************************
+ * DIRECTORY NAME CACHE
+ *
+ *   Looking up a name in a large linear directory reads every entry.  So
+ *   the first lookup in a linear directory of more than one block builds
+ *   an in-memory table from name hash to entry offset, and later lookups
+ *   probe the table instead.  The table holds no names; a candidate
+ *   offset is checked against the entry itself.  Indexed directories are
+ *   already searched by hash, and are not cached.
+ *
+ *   The table also keeps an occupancy map: for each directory block, the
+ *   number of live entries and the bytes not used by live entries, plus
+ *   a hint that no block before 'dc_firstfree' has any free space.  So
+ *   create_blank_direntry goes straight to a block that can hold the new
+ *   entry, and readdir skips blocks with no live entries.
+ *
+ *   ospfs_create, ospfs_link, ospfs_symlink and ospfs_unlink keep the table
+ *   up to date.  They run under the directory's i_mutex, but the shrinker
+ *   may free a table at any time, so changes to the tables, their contents
+ *   and the LRU are made with ospfs_dcache_lock held.
+ *
+ *   Lookups take no lock: ospfs_dcache_find walks the chains and buckets
+ *   under rcu_read_lock().  Writers publish entries and tables with the
+ *   _rcu list operations, after the directory entry itself is written,
+ *   and free them with call_rcu(), so a lookup never follows a freed
+ *   pointer.  A lookup only sees offsets; each candidate is checked
+ *   against the directory entry, so a stale one is harmless.  Rather than
+ *   move its table to the front of the LRU, which would need the lock, a
+ *   lookup sets 'dc_referenced', and the shrinker gives referenced tables
+ *   another trip around the LRU.
+ */
+
+#define OSPFS_DCACHE_CHAINS	64	// chains for finding a directory's table
+#define OSPFS_DCACHE_MINBUCKETS	16
+#define OSPFS_DCACHE_MAXBUCKETS	4096
+#define OSPFS_DCACHE_PROBE	4	// candidates checked per lookup
+
+typedef struct ospfs_dcache_ent {
+	struct hlist_node de_link;
+	uint32_t de_hash;		// ospfs_name_hash of the entry's name
+	uint32_t de_off;		// offset of the entry in the directory
+	struct rcu_head de_rcu;		// for freeing after lookups finish
+} ospfs_dcache_ent_t;
+
+typedef struct ospfs_dcache_blk {
+	uint16_t db_live;		// live entries in the block
+	uint16_t db_free;		// bytes not used by live entries
+} ospfs_dcache_blk_t;
+
+typedef struct ospfs_dcache {
+	struct hlist_node dc_link;	// in ospfs_dcache_chains
+	struct list_head dc_lru;	// in ospfs_dcache_lru, most recent first
+	struct rcu_head dc_rcu;		// for freeing after lookups finish
+	int dc_referenced;		// looked up since the shrinker last looked
+	struct super_block *dc_sb;
+	ino_t dc_ino;
+	uint32_t dc_count;		// number of entries
+	uint32_t dc_mask;		// number of buckets - 1
+	uint32_t dc_nblocks;		// directory blocks in 'dc_blocks'
+	uint32_t dc_firstfree;		// no free space in blocks before this
+	ospfs_dcache_blk_t *dc_blocks;	// occupancy of each block
+	struct hlist_head dc_buckets[0];
+} ospfs_dcache_t;
+
+static struct hlist_head ospfs_dcache_chains[OSPFS_DCACHE_CHAINS];
+static LIST_HEAD(ospfs_dcache_lru);
+static DEFINE_SPINLOCK(ospfs_dcache_lock);
+static int ospfs_dcache_nr;		// entries in all tables
+static struct shrinker *ospfs_dcache_shrinker;
+
+
+// ospfs_dcache_chain(sb, ino)
+//	Returns the chain that holds the name cache for directory 'ino'.
+
+static inline struct hlist_head *
+ospfs_dcache_chain(struct super_block *sb, ino_t ino)
+{
+	return &ospfs_dcache_chains[(((unsigned long) sb >> 4) ^ ino) % OSPFS_DCACHE_CHAINS];
+}
+
+
+// ospfs_dcache_get(sb, ino)
+//	Returns the name cache for directory 'ino', or NULL if it has none.
+//	Call with ospfs_dcache_lock held, or under rcu_read_lock().
+
+static ospfs_dcache_t *
+ospfs_dcache_get(struct super_block *sb, ino_t ino)
+{
+	ospfs_dcache_t *dc;
+	struct hlist_node *pos;
+
+	hlist_for_each_entry_rcu(dc, pos, ospfs_dcache_chain(sb, ino), dc_link)
+		if (dc->dc_sb == sb && dc->dc_ino == ino)
+			return dc;
+	return NULL;
+}
+
+
+// ospfs_dcache_unhash(dc)
+//	Takes 'dc' off its chain and the LRU, so no one else can find it.
+//	Call with ospfs_dcache_lock held, then free 'dc' with
+//	ospfs_dcache_release after dropping the lock.
+
+static void
+ospfs_dcache_unhash(ospfs_dcache_t *dc)
+{
+	hlist_del_rcu(&dc->dc_link);
+	list_del(&dc->dc_lru);
+	ospfs_dcache_nr -= dc->dc_count;
+}
+
+
+// ospfs_dcache_free(dc)
+//	Frees a name cache and its entries at once.  Only for a table that
+//	lookups cannot see: one never published, or one whose grace period
+//	has passed.
+
+static void
+ospfs_dcache_free(ospfs_dcache_t *dc)
+{
+	ospfs_dcache_ent_t *de;
+	struct hlist_node *pos, *n;
+	uint32_t b;
+
+	for (b = 0; b <= dc->dc_mask; b++)
+		hlist_for_each_entry_safe(de, pos, n, &dc->dc_buckets[b], de_link)
+			kfree(de);
+	kfree(dc->dc_blocks);
+	kfree(dc);
+}
+
+static void
+ospfs_dcache_free_rcu(struct rcu_head *head)
+{
+	ospfs_dcache_free(container_of(head, ospfs_dcache_t, dc_rcu));
+}
+
+static void
+ospfs_dcache_ent_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, ospfs_dcache_ent_t, de_rcu));
+}
+
+
+// ospfs_dcache_release(dc)
+//	Frees an unhashed name cache once no lookup can still be reading it.
+
+static void
+ospfs_dcache_release(ospfs_dcache_t *dc)
+{
+	call_rcu(&dc->dc_rcu, ospfs_dcache_free_rcu);
+}
+
+
+// ospfs_dcache_build(dir)
+//	Builds the name cache for 'dir' if it is a linear directory of more
+//	than one block and has none.  Failing to build one is not an error;
+//	lookups in 'dir' just scan it as before.
+
+static void
+ospfs_dcache_build(struct inode *dir)
+{
+	struct super_block *sb = dir->i_sb;
+	ospfs_inode_t *dir_oi = ospfs_inode(sb, dir->i_ino);
+	ospfs_dcache_t *dc;
+	ospfs_dirent_t dn;
+	uint32_t nbuckets, off;
+	int packed, present;
+
+	if (!dir_oi || ospfs_dir_indexed(dir_oi)
+	    || dir_oi->oi_size <= OSPFS_BLKSIZE)
+		return;
+
+	rcu_read_lock();
+	present = (ospfs_dcache_get(sb, dir->i_ino) != NULL);
+	rcu_read_unlock();
+	if (present)
+		return;
+
+	// About one bucket per entry slot
+	nbuckets = OSPFS_DCACHE_MINBUCKETS;
+	while (nbuckets < OSPFS_DCACHE_MAXBUCKETS
+	       && nbuckets * OSPFS_DIRENTRY_SIZE < dir_oi->oi_size)
+		nbuckets *= 2;
+
+	dc = kmalloc(sizeof(ospfs_dcache_t) + nbuckets * sizeof(struct hlist_head), GFP_KERNEL);
+	if (!dc)
+		return;
+	dc->dc_referenced = 0;
+	dc->dc_sb = sb;
+	dc->dc_ino = dir->i_ino;
+	dc->dc_count = 0;
+	dc->dc_mask = nbuckets - 1;
+	for (off = 0; off < nbuckets; off++)
+		INIT_HLIST_HEAD(&dc->dc_buckets[off]);
+	dc->dc_nblocks = ospfs_size2nblocks(dir_oi->oi_size);
+	dc->dc_firstfree = dc->dc_nblocks;
+	dc->dc_blocks = kmalloc(dc->dc_nblocks * sizeof(ospfs_dcache_blk_t), GFP_KERNEL);
+	if (!dc->dc_blocks)
+		goto fail;
+	for (off = 0; off < dc->dc_nblocks; off++) {
+		dc->dc_blocks[off].db_live = 0;
+		dc->dc_blocks[off].db_free = OSPFS_BLKSIZE;
+	}
+
+	packed = ospfs_dir_packed(dir_oi);
+	for (off = 0; off < dir_oi->oi_size; off += dn.dn_reclen) {
+		ospfs_dcache_blk_t *db = &dc->dc_blocks[off / OSPFS_BLKSIZE];
+		ospfs_dcache_ent_t *de;
+
+		if (ospfs_dirent_get(sb, dir_oi, off, &dn) < 0)
+			goto fail;
+		if (!dn.dn_ino)
+			continue;
+		db->db_live++;
+		db->db_free -= ospfs_dirent_size(packed, dn.dn_namelen);
+		if (!(de = kmalloc(sizeof(ospfs_dcache_ent_t), GFP_KERNEL)))
+			goto fail;
+		de->de_hash = dn.dn_hash;
+		de->de_off = off;
+		hlist_add_head(&de->de_link, &dc->dc_buckets[de->de_hash & dc->dc_mask]);
+		dc->dc_count++;
+	}
+	for (off = 0; off < dc->dc_nblocks; off++)
+		if (dc->dc_blocks[off].db_free > 0) {
+			dc->dc_firstfree = off;
+			break;
+		}
+
+	// The directory's i_mutex keeps anyone else from building one too.
+	// hlist_add_head_rcu() orders the table's contents before the link
+	// that makes it visible to lookups.
+	spin_lock(&ospfs_dcache_lock);
+	hlist_add_head_rcu(&dc->dc_link, ospfs_dcache_chain(sb, dir->i_ino));
+	list_add(&dc->dc_lru, &ospfs_dcache_lru);
+	ospfs_dcache_nr += dc->dc_count;
+	spin_unlock(&ospfs_dcache_lock);
+	return;
+
+    fail:
+	ospfs_dcache_free(dc);
+}
+
+
+// ospfs_dcache_next_room(dir, need, b)
+//	Returns the first block of 'dir', at or after block 'b', that the
+//	occupancy map says has at least 'need' free bytes, or the number of
+//	blocks if there is none.  If 'dir' has no name cache, returns 'b':
+//	every block might have room.  The free bytes in a packed block may be
+//	split among records, so the block still has to be checked.
+
+static uint32_t
+ospfs_dcache_next_room(struct inode *dir, uint32_t need, uint32_t b)
+{
+	ospfs_dcache_t *dc;
+
+	spin_lock(&ospfs_dcache_lock);
+	if ((dc = ospfs_dcache_get(dir->i_sb, dir->i_ino))) {
+		while (dc->dc_firstfree < dc->dc_nblocks
+		       && dc->dc_blocks[dc->dc_firstfree].db_free == 0)
+			dc->dc_firstfree++;
+		if (b < dc->dc_firstfree)
+			b = dc->dc_firstfree;
+		while (b < dc->dc_nblocks && dc->dc_blocks[b].db_free < need)
+			b++;
+	}
+	spin_unlock(&ospfs_dcache_lock);
+	return b;
+}
+
+
+// ospfs_dcache_next_live(dir, b)
+//	Returns the first block of 'dir', at or after block 'b', that the
+//	occupancy map says has a live entry, or the number of blocks if there
+//	is none.  If 'dir' has no name cache, returns 'b'.
+
+static uint32_t
+ospfs_dcache_next_live(struct inode *dir, uint32_t b)
+{
+	ospfs_dcache_t *dc;
+
+	spin_lock(&ospfs_dcache_lock);
+	if ((dc = ospfs_dcache_get(dir->i_sb, dir->i_ino)))
+		while (b < dc->dc_nblocks && dc->dc_blocks[b].db_live == 0)
+			b++;
+	spin_unlock(&ospfs_dcache_lock);
+	return b;
+}
+
+
+// ospfs_dcache_find(dir, dir_oi, name, namelen, dn, result)
+//	Looks up 'name' using the name cache for 'dir'.
+//
+//   Returns: 0 if 'dir' has no name cache (or too many entries share the
+//	      name's hash), in which case the caller must scan the directory;
+//	      otherwise 1, with '*result' and '*dn' set as find_direntry sets
+//	      its return value and 'dn'.
+
+static int
+ospfs_dcache_find(struct inode *dir, ospfs_inode_t *dir_oi, const char *name, int namelen, ospfs_dirent_t *dn, int *result)
+{
+	uint32_t hash = ospfs_name_hash(name, namelen);
+	uint32_t cand[OSPFS_DCACHE_PROBE];
+	int ncand = 0, i;
+	ospfs_dcache_t *dc;
+	ospfs_dcache_ent_t *de;
+	struct hlist_node *pos;
+
+	// Copy the candidates out: reading the entries may sleep.
+	rcu_read_lock();
+	if (!(dc = ospfs_dcache_get(dir->i_sb, dir->i_ino))) {
+		rcu_read_unlock();
+		return 0;
+	}
+	if (!dc->dc_referenced)
+		dc->dc_referenced = 1;
+	hlist_for_each_entry_rcu(de, pos, &dc->dc_buckets[hash & dc->dc_mask], de_link)
+		if (de->de_hash == hash) {
+			if (ncand == OSPFS_DCACHE_PROBE) {
+				rcu_read_unlock();
+				return 0;
+			}
+			cand[ncand++] = de->de_off;
+		}
+	rcu_read_unlock();
+
+	*result = 0;
+	for (i = 0; i < ncand; i++) {
+		int r = ospfs_dirent_get(dir->i_sb, dir_oi, cand[i], dn);
+		if (r < 0) {
+			*result = r;
+			break;
+		}
+		if (dn->dn_ino
+		    && dn->dn_namelen == namelen
+		    && memcmp(dn->dn_name, name, namelen) == 0) {
+			*result = 1;
+			break;
+		}
+	}
+	return 1;
+}
+
+
+// ospfs_dcache_add(dir, name, namelen, entry_off)
+//	Records the new entry 'name', at offset 'entry_off', in the name cache
+//	and occupancy map for 'dir', if it has them.  If memory is short, or
+//	the directory has outgrown its table or grown a block, the table is
+//	dropped instead; the next lookup builds a new one.
+
+static void
+ospfs_dcache_add(struct inode *dir, const char *name, int namelen, uint32_t entry_off)
+{
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_sb, dir->i_ino);
+	uint32_t size = ospfs_dirent_size(ospfs_dir_packed(dir_oi), namelen);
+	uint32_t b = entry_off / OSPFS_BLKSIZE;
+	ospfs_dcache_ent_t *de = kmalloc(sizeof(ospfs_dcache_ent_t), GFP_KERNEL);
+	ospfs_dcache_t *dc;
+
+	spin_lock(&ospfs_dcache_lock);
+	if ((dc = ospfs_dcache_get(dir->i_sb, dir->i_ino))) {
+		if (!de || b >= dc->dc_nblocks
+		    || (dc->dc_mask + 1 < OSPFS_DCACHE_MAXBUCKETS
+			&& dc->dc_count >= 4 * (dc->dc_mask + 1)))
+			ospfs_dcache_unhash(dc);
+		else {
+			de->de_hash = ospfs_name_hash(name, namelen);
+			de->de_off = entry_off;
+			hlist_add_head_rcu(&de->de_link, &dc->dc_buckets[de->de_hash & dc->dc_mask]);
+			dc->dc_count++;
+			ospfs_dcache_nr++;
+			dc->dc_blocks[b].db_live++;
+			dc->dc_blocks[b].db_free -= size;
+			de = NULL;
+			dc = NULL;
+		}
+	}
+	spin_unlock(&ospfs_dcache_lock);
+
+	kfree(de);
+	if (dc)
+		ospfs_dcache_release(dc);
+}
 
-	if (!oi)
-		return 0;
-	if (!(inode = new_inode(sb)))
-		return 0;
 
-	inode->i_ino = ino;
-	// Make it look like everything was created by root.
-	inode->i_uid = inode->i_gid = 0;
-	inode->i_size = oi->oi_size;
+// ospfs_dcache_remove(dir, name, namelen, entry_off)
+//	Forgets the entry 'name', at offset 'entry_off', in the name cache and
+//	occupancy map for 'dir', if it has them.
 
-	if (oi->oi_ftype == OSPFS_FTYPE_REG) {
-		// Make an inode for a regular file.
-		inode->i_mode = oi->oi_mode | S_IFREG;
-		inode->i_op = &ospfs_reg_inode_ops;
-		inode->i_fop = &ospfs_reg_file_ops;
-		inode->i_nlink = oi->oi_nlink;
+static void
+ospfs_dcache_remove(struct inode *dir, const char *name, int namelen, uint32_t entry_off)
+{
+	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_sb, dir->i_ino);
+	uint32_t size = ospfs_dirent_size(ospfs_dir_packed(dir_oi), namelen);
+	uint32_t hash = ospfs_name_hash(name, namelen);
+	uint32_t b = entry_off / OSPFS_BLKSIZE;
+	ospfs_dcache_t *dc;
+	ospfs_dcache_ent_t *de, *found = NULL;
+	struct hlist_node *pos;
+
+	spin_lock(&ospfs_dcache_lock);
+	if ((dc = ospfs_dcache_get(dir->i_sb, dir->i_ino))) {
+		hlist_for_each_entry(de, pos, &dc->dc_buckets[hash & dc->dc_mask], de_link)
+			if (de->de_off == entry_off) {
+				hlist_del_rcu(&de->de_link);
+				dc->dc_count--;
+				ospfs_dcache_nr--;
+				found = de;
+				break;
+			}
+		if (b < dc->dc_nblocks) {
+			dc->dc_blocks[b].db_live--;
+			dc->dc_blocks[b].db_free += size;
+			if (b < dc->dc_firstfree)
+				dc->dc_firstfree = b;
+		}
+	}
+	spin_unlock(&ospfs_dcache_lock);
 
-	} else if (oi->oi_ftype == OSPFS_FTYPE_DIR) {
-		// Make an inode for a directory.
-		inode->i_mode = oi->oi_mode | S_IFDIR;
-		inode->i_op = &ospfs_dir_inode_ops;
-		inode->i_fop = &ospfs_dir_file_ops;
-		inode->i_nlink = oi->oi_nlink + 1 /* dot-dot */;
+	if (found)
+		call_rcu(&found->de_rcu, ospfs_dcache_ent_free_rcu);
+}
 
-	} else if (oi->oi_ftype == OSPFS_FTYPE_SYMLINK) {
-		// Make an inode for a symbolic link.
-		inode->i_mode = S_IRUSR | S_IRGRP | S_IROTH
-			| S_IWUSR | S_IWGRP | S_IWOTH
-			| S_IXUSR | S_IXGRP | S_IXOTH | S_IFLNK;
-		inode->i_op = &ospfs_symlink_inode_ops;
-		inode->i_nlink = oi->oi_nlink;
 
-	} else
-		panic("OSPFS: unknown inode type!");
+// ospfs_dcache_drop(sb, ino)
+//	Frees the name cache for directory 'ino', if it has one.  Called when
+//	the directory's entries move, as when it is converted to an index.
 
-	// Access and modification times are now.
-	inode->i_mtime = inode->i_atime = inode->i_ctime = CURRENT_TIME;
-	return inode;
+static void
+ospfs_dcache_drop(struct super_block *sb, ino_t ino)
+{
+	ospfs_dcache_t *dc;
+
+	spin_lock(&ospfs_dcache_lock);
+	if ((dc = ospfs_dcache_get(sb, ino)))
+		ospfs_dcache_unhash(dc);
+	spin_unlock(&ospfs_dcache_lock);
+
+	if (dc)
+		ospfs_dcache_release(dc);
 }
 
 
-// ospfs_fill_super, ospfs_get_sb
-//	These functions are called by Linux when the user mounts a version of
-//	the OSPFS onto some directory.  They help construct a Linux
-//	'struct super_block' for that file system.
+// ospfs_dcache_drop_all(sb)
+//	Frees every name cache belonging to 'sb'.  Called at unmount.
 
-static int
-ospfs_fill_super(struct super_block *sb, void *data, int flags)
+static void
+ospfs_dcache_drop_all(struct super_block *sb)
 {
-	struct inode *root_inode;
+	LIST_HEAD(victims);
+	ospfs_dcache_t *dc, *n;
+
+	spin_lock(&ospfs_dcache_lock);
+	list_for_each_entry_safe(dc, n, &ospfs_dcache_lru, dc_lru)
+		if (dc->dc_sb == sb) {
+			ospfs_dcache_unhash(dc);
+			list_add(&dc->dc_lru, &victims);
+		}
+	spin_unlock(&ospfs_dcache_lock);
 
-	sb->s_blocksize = OSPFS_BLKSIZE;
-	sb->s_blocksize_bits = OSPFS_BLKSIZE_BITS;
-	sb->s_magic = OSPFS_MAGIC;
-	sb->s_op = &ospfs_superblock_ops;
+	list_for_each_entry_safe(dc, n, &victims, dc_lru)
+		ospfs_dcache_release(dc);
+}
 
-	if (!(root_inode = ospfs_mk_linux_inode(sb, OSPFS_ROOT_INO))
-	    || !(sb->s_root = d_alloc_root(root_inode))) {
-		iput(root_inode);
-		sb->s_dev = 0;
-		return -ENOMEM;
-	}
 
-	return 0;
-}
+// ospfs_dcache_shrink(nr_to_scan, gfp_mask)
+//	The name cache's shrinker, called by the VM under memory pressure.
+//	Frees least recently used tables until about 'nr_to_scan' entries
+//	are gone.  A table looked up since it was last considered is moved
+//	to the front of the LRU instead.
+//
+//   Returns: the number of entries left in all tables.
 
 static int
-ospfs_get_sb(struct file_system_type *fs_type, int flags, const char *dev_name, void *data, struct vfsmount *mount)
+ospfs_dcache_shrink(int nr_to_scan, gfp_t gfp_mask)
 {
-	return get_sb_single(fs_type, flags, data, ospfs_fill_super, mount);
+	LIST_HEAD(victims);
+	ospfs_dcache_t *dc, *n;
+	int nr;
+
+	spin_lock(&ospfs_dcache_lock);
+	while (nr_to_scan > 0 && !list_empty(&ospfs_dcache_lru)) {
+		dc = list_entry(ospfs_dcache_lru.prev, ospfs_dcache_t, dc_lru);
+		nr_to_scan -= dc->dc_count + 1;
+		if (dc->dc_referenced) {
+			dc->dc_referenced = 0;
+			list_move(&dc->dc_lru, &ospfs_dcache_lru);
+			continue;
+		}
+		ospfs_dcache_unhash(dc);
+		list_add(&dc->dc_lru, &victims);
+	}
+	nr = ospfs_dcache_nr;
+	spin_unlock(&ospfs_dcache_lock);
+
+	list_for_each_entry_safe(dc, n, &victims, dc_lru)
+		ospfs_dcache_release(dc);
+	return nr;
 }
 
 
-// ospfs_delete_dentry
-//	Another bookkeeping function.
+// find_direntry(dir, name, namelen, dn)
+//	Looks through the directory to find an entry with name 'name' (length
+//	in characters 'namelen').  Returns 1 if one exists, 0 if one does not,
+//	or -EIO if the directory could not be read.  If an entry is found and
+//	'dn' is non-NULL, the entry is read into '*dn'; its 'dn_off' is the
+//	entry's offset.
+//
+//   Inputs:  dir     -- the Linux inode for the directory
+//	      name    -- name to search for
+//	      namelen -- length of 'name'.  (If -1, then use strlen(name).)
+//	      dn      -- if non-NULL, set to the entry found
+//
+//	We have written this function for you.  An indexed directory is
+//	searched through its index, and a linear one through its name cache
+//	if it has one.
 
 static int
-ospfs_delete_dentry(struct dentry *dentry)
+find_direntry(struct inode *dir, const char *name, int namelen, ospfs_dirent_t *dn)
 {
-	return 1;
+	struct super_block *sb = dir->i_sb;
+	ospfs_inode_t *dir_oi = ospfs_inode(sb, dir->i_ino);
+	ospfs_dirent_t tmp;
+	int r;
+
+	if (!dir_oi)
+		return -EIO;
+	if (namelen < 0)
+		namelen = strlen(name);
+	if (ospfs_dir_indexed(dir_oi))
+		return ospfs_dx_find(sb, dir_oi, name, namelen, dn);
+	if (ospfs_dcache_find(dir, dir_oi, name, namelen, dn ? dn : &tmp, &r))
+		return r;
+	return ospfs_dir_scan(sb, dir_oi, 0, dir_oi->oi_size, name, namelen, dn);
 }
 
 
@@ -348,44 +4437,44 @@ ospfs_delete_dentry(struct dentry *dentry)
 static struct dentry *
 ospfs_dir_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *ignore)
 {
-	// Find the OSPFS inode corresponding to 'dir'
-	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
 	struct inode *entry_inode = NULL;
-	int entry_off;
+	ktime_t start = ktime_get();
+	ospfs_dirent_t dn;
+	int r;
+
+	ospfs_stat_add(dir->i_sb, OSPFS_STAT_LOOKUP, 1);
 
 	// Make sure filename is not too long
 	if (dentry->d_name.len > OSPFS_MAXNAMELEN)
 		return (struct dentry *) ERR_PTR(-ENAMETOOLONG);
 
-	// Mark with our operations
-	dentry->d_op = &ospfs_dentry_ops;
-
-	// Search through the directory block
-	for (entry_off = 0; entry_off < dir_oi->oi_size;
-	     entry_off += OSPFS_DIRENTRY_SIZE) {
-		// Find the OSPFS inode for the entry
-		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, entry_off);
-
-		// Set 'entry_inode' if we find the file we are looking for
-		if (od->od_ino > 0
-		    && strlen(od->od_name) == dentry->d_name.len
-		    && memcmp(od->od_name, dentry->d_name.name, dentry->d_name.len) == 0) {
-			entry_inode = ospfs_mk_linux_inode(dir->i_sb, od->od_ino);
-			if (!entry_inode)
-				return (struct dentry *) ERR_PTR(-EINVAL);
-			break;
-		}
+	// Search through the directory (or just one leaf of its index).
+	// A large linear directory gets a name cache on its first lookup.
+	ospfs_dcache_build(dir);
+	r = find_direntry(dir, dentry->d_name.name, dentry->d_name.len, &dn);
+	if (r < 0)
+		return (struct dentry *) ERR_PTR(r);
+
+	// Set 'entry_inode' if we found the file we are looking for
+	if (r > 0) {
+		entry_inode = ospfs_mk_linux_inode(dir->i_sb, dn.dn_ino);
+		if (!entry_inode)
+			return (struct dentry *) ERR_PTR(-EINVAL);
 	}
+	ospfs_stat_time(dir->i_sb, OSPFS_LAT_LOOKUP, start);
+	ospfs_trace(dir->i_sb, OSPFS_TR_LOOKUP, dir->i_ino, r > 0 ? dn.dn_off : 0,
+		    dentry->d_name.len, r > 0 ? dn.dn_ino : 0, r);
 
 	// We return a dentry whether or not the file existed.
 	// The file exists if and only if 'entry_inode != NULL'.
 	// If the file doesn't exist, the dentry is called a "negative dentry".
 
+	// Both kinds stay in the dcache, so later lookups of the same name
+	// never reach us.  ospfs_create, ospfs_link and ospfs_symlink
+	// instantiate negative dentries, and the VFS handles unlink.
+
 	// d_splice_alias() attaches the inode to the dentry.
-	// If it returns a new dentry, we need to set its operations.
-	if ((dentry = d_splice_alias(entry_inode, dentry)))
-		dentry->d_op = &ospfs_dentry_ops;
-	return dentry;
+	return d_splice_alias(entry_inode, dentry);
 }
 
 
@@ -419,12 +4508,41 @@ ospfs_dir_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *ign
 //     of the directory, and -(error number) on error.
 //
 
+// ospfs_entry_dtype(sb, dn)
+//	Returns the DT_* type of the file named by directory entry 'dn', for
+//	'filldir', or -EINVAL if the file has an unknown type.  The type comes
+//	from the entry if it records one, and otherwise from the inode.
+
+static int
+ospfs_entry_dtype(struct super_block *sb, const ospfs_dirent_t *dn)
+{
+	int ftype = dn->dn_type;
+
+	if (ftype < 0) {
+		ospfs_inode_t *entry_oi = ospfs_inode(sb, dn->dn_ino);
+		if (!entry_oi)
+			return -EIO;
+		ftype = entry_oi->oi_ftype;
+	}
+	switch (ftype) {
+	case OSPFS_FTYPE_REG:
+		return DT_REG;
+	case OSPFS_FTYPE_DIR:
+		return DT_DIR;
+	case OSPFS_FTYPE_SYMLINK:
+		return DT_LNK;
+	default:
+		eprintk("Invalid Directory Entry Type!");
+		return -EINVAL;
+	}
+}
+
 static int
 ospfs_dir_readdir(struct file *filp, void *dirent, filldir_t filldir)
 {
 
 	struct inode *dir_inode = filp->f_dentry->d_inode;
-	ospfs_inode_t *dir_oi = ospfs_inode(dir_inode->i_ino);
+	ospfs_inode_t *dir_oi = ospfs_inode(dir_inode->i_sb, dir_inode->i_ino);
 	uint32_t f_pos = filp->f_pos;
 	int r = 0;		/* Error return value, if any */
 	int ok_so_far = 0;	/* Return value from 'filldir' */
@@ -443,25 +4561,42 @@ ospfs_dir_readdir(struct file *filp, void *dirent, filldir_t filldir)
 			f_pos++;
 	}
 
+	// An indexed directory is read in hash order.
+	if (ok_so_far >= 0 && f_pos >= 2 && ospfs_dir_indexed(dir_oi)) {
+		filp->f_pos = f_pos;
+		return ospfs_dx_readdir(filp, dirent, filldir, dir_oi);
+	}
+
+	// A packed directory's records may have merged since 'f_pos' was
+	// saved; resume at the next record.
+	if (ok_so_far >= 0 && f_pos > 2 && ospfs_dir_packed(dir_oi)
+	    && f_pos - 2 < dir_oi->oi_size) {
+		r = ospfs_dirent_align(dir_inode->i_sb, dir_oi, f_pos - 2);
+		if (r < 0)
+			return r;
+		f_pos = r + 2;
+		r = 0;
+	}
+
 	// actual entries
 	while (f_pos >= 2) {
-		ospfs_direntry_t *od;
-		ospfs_inode_t *entry_oi;
+		ospfs_dirent_t dn;
 
 		/* If at the end of the directory, set 'r' to 1 and exit
 		 * the loop.  For now we do this all the time.
 		 */
                  
-		/* Get a pointer to the next entry (od) in the directory.
+		/* Read the next entry (dn) in the directory.
 		 * The file system interprets the contents of a
-		 * directory-file as a sequence of ospfs_direntry structures.
-		 * You will find 'f_pos' and 'ospfs_inode_data' useful.
+		 * directory-file as a sequence of ospfs_direntry structures,
+		 * or of packed records.  You will find 'f_pos' and
+		 * 'ospfs_dirent_get' useful.
 		 *
 		 * Then use the fields of that file to fill in the directory
 		 * entry.  To figure out whether a file is a regular file or
-		 * another directory, use 'ospfs_inode' to get the directory
-		 * entry's corresponding inode, and check out its 'oi_ftype'
-		 * member.
+		 * another directory, use 'ospfs_entry_dtype', which uses the
+		 * type recorded in the entry, and only reads the entry's
+		 * inode if there is none.
 		 *
 		 * Make sure you ignore blank directory entries!  (Which have
 		 * an inode number of 0.)
@@ -483,39 +4618,241 @@ ospfs_dir_readdir(struct file *filp, void *dirent, filldir_t filldir)
                      break;
                  }
 
-		 od = ospfs_inode_data(dir_oi, entry_off);
-
-		 if (od->od_ino > 0 ) { //If non-blank directory entry
-                     entry_oi = ospfs_inode(od->od_ino);
-
-                     switch(entry_oi->oi_ftype) {
-                         case OSPFS_FTYPE_REG:
-                             entry_type = DT_REG;
-                             break;
-                         case OSPFS_FTYPE_DIR:
-                             entry_type = DT_DIR;
-                             break;
-                         case OSPFS_FTYPE_SYMLINK:
-                             entry_type = DT_LNK;
-                             break;
-                         default:
-                             eprintk("Invalid Directory Entry Type!");
-                             return -EINVAL;
+                 //Skip blocks the occupancy map knows are empty
+                 if(entry_off % OSPFS_BLKSIZE == 0) {
+                     uint32_t b = ospfs_dcache_next_live(dir_inode, entry_off / OSPFS_BLKSIZE);
+                     if(b * OSPFS_BLKSIZE != entry_off) {
+                         f_pos = b * OSPFS_BLKSIZE + 2;
+                         continue;
                      }
-                     ok_so_far = filldir(dirent, od->od_name, strlen(od->od_name), f_pos, od->od_ino, entry_type);
+                 }
+
+		 r = ospfs_dirent_get(dir_inode->i_sb, dir_oi, entry_off, &dn);
+		 if (r < 0)
+			 break;
+
+		 if (dn.dn_ino > 0 ) { //If non-blank directory entry
+                     entry_type = ospfs_entry_dtype(dir_inode->i_sb, &dn);
+                     if (entry_type < 0)
+                         return entry_type;
+                     ok_so_far = filldir(dirent, dn.dn_name, dn.dn_namelen, f_pos, dn.dn_ino, entry_type);
                      if( ok_so_far < 0 )
                          break;
                  }
 
-                 f_pos += OSPFS_DIRENTRY_SIZE;
+                 f_pos += dn.dn_reclen;
 	}
 
-	// Save the file position and return!
+	// Save the file position and return!  (A linear directory's
+	// positions are unique, so it keeps no count in 'f_version'.)
 	filp->f_pos = f_pos;
+	filp->f_version = 0;
 	return r;
 }
 
 
+// ospfs_readdirplus_fill(buf, name, namelen, pos, ino, type)
+//	The 'filldir' callback for OSPFS_IOC_READDIRPLUS.  Copies one entry,
+//	with its inode's size and mode, to the user's array.
+//
+//   Returns: 0 to keep going, < 0 to stop (the array is full, or there was
+//	      an error, saved in 'rb_error').
+
+typedef struct ospfs_readdirplus_buf {
+	struct super_block *rb_sb;
+	ospfs_statent_t __user *rb_ents;
+	uint32_t rb_count;		// Room left in 'rb_ents'
+	uint32_t rb_filled;		// Entries stored
+	int rb_error;
+} ospfs_readdirplus_buf_t;
+
+static int
+ospfs_readdirplus_fill(void *buf, const char *name, int namelen, loff_t pos, u64 ino, unsigned type)
+{
+	ospfs_readdirplus_buf_t *rb = buf;
+	ospfs_inode_t *oi;
+	ospfs_statent_t se;
+
+	if (rb->rb_filled == rb->rb_count)
+		return -EINVAL;
+	if (!(oi = ospfs_inode(rb->rb_sb, ino))) {
+		rb->rb_error = -EIO;
+		return -EIO;
+	}
+
+	memset(&se, 0, sizeof(se));
+	se.se_ino = ino;
+	se.se_size = oi->oi_size;
+	se.se_mode = ospfs_linux_mode(oi);
+	se.se_type = type;
+	se.se_namelen = namelen;
+	memcpy(se.se_name, name, namelen);
+	if (copy_to_user(&rb->rb_ents[rb->rb_filled], &se, sizeof(se))) {
+		rb->rb_error = -EFAULT;
+		return -EFAULT;
+	}
+	rb->rb_filled++;
+	return 0;
+}
+
+
+// ospfs_dir_may_change(dir)
+//	Checks that the caller may add to or rewrite directory 'dir', as
+//	vfs_create does before creating a file: the directory must still
+//	exist, and the caller needs write and search permission on it.
+//	Called with 'dir->i_mutex' held, by the ioctls that change a
+//	directory without going through the VFS.
+//
+//   Returns: 0 if so, or -(error code).
+
+static int
+ospfs_dir_may_change(struct inode *dir)
+{
+	if (IS_DEADDIR(dir))
+		return -ENOENT;
+	return permission(dir, MAY_WRITE | MAY_EXEC, NULL);
+}
+
+
+// ospfs_dir_ioctl(filp, cmd, arg)
+//	The ospfs_dir_file_ops.unlocked_ioctl callback.  See ospfs.h for the
+//	commands.  OSPFS_IOC_READDIRPLUS walks the directory with
+//	ospfs_dir_readdir, so it sees entries exactly as getdents does.
+//	OSPFS_IOC_CHECKPOINT covers the whole file system, so it holds no
+//	directory lock.
+//
+//   Returns: the command's result, or -(error number).
+
+static int ospfs_create_batch(struct file *filp, ospfs_createbatch_t __user *arg);
+
+static long
+ospfs_dir_ioctl(struct file *filp, unsigned cmd, unsigned long arg)
+{
+	struct inode *dir = filp->f_dentry->d_inode;
+	ospfs_readdirplus_t rp;
+	ospfs_readdirplus_buf_t rb;
+	ospfs_checkpoint_t ck;
+	struct file *out;
+	int r;
+
+	switch (cmd) {
+	case OSPFS_IOC_READDIRPLUS:
+		if (copy_from_user(&rp, (void __user *) arg, sizeof(rp)))
+			return -EFAULT;
+		if (rp.rp_reserved)
+			return -EINVAL;
+		rb.rb_sb = dir->i_sb;
+		rb.rb_ents = (ospfs_statent_t __user *) (unsigned long) rp.rp_ents;
+		rb.rb_count = rp.rp_count;
+		rb.rb_filled = 0;
+		rb.rb_error = 0;
+
+		mutex_lock(&dir->i_mutex);
+		r = ospfs_dir_readdir(filp, &rb, ospfs_readdirplus_fill);
+		mutex_unlock(&dir->i_mutex);
+		if (r >= 0)
+			r = rb.rb_error;
+		return (r < 0 && rb.rb_filled == 0 ? r : rb.rb_filled);
+
+	case OSPFS_IOC_CREATE:
+		return ospfs_create_batch(filp, (ospfs_createbatch_t __user *) arg);
+
+	case OSPFS_IOC_COMPACT:
+		mutex_lock(&dir->i_mutex);
+		if ((r = ospfs_dir_may_change(dir)) == 0) {
+			ospfs_journal_start(dir->i_sb);
+			r = ospfs_dir_compact(dir);
+			ospfs_journal_stop(dir->i_sb);
+		}
+		mutex_unlock(&dir->i_mutex);
+		return r;
+
+	case OSPFS_IOC_CHECKPOINT:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&ck, (void __user *) arg, sizeof(ck)))
+			return -EFAULT;
+		if (ck.ck_flags & ~OSPFS_CKPT_INCREMENTAL)
+			return -EINVAL;
+		if (!(out = fget(ck.ck_fd)))
+			return -EBADF;
+		if (!(out->f_mode & FMODE_WRITE))
+			r = -EBADF;
+		else
+			r = ospfs_checkpoint(dir->i_sb, out, ck.ck_flags);
+		fput(out);
+		return r;
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+
+// ospfs_drop_link(inode)
+//	Drops one link to 'inode', whose directory entry has just been
+//	removed.  When the last link goes, the inode becomes an orphan: it
+//	keeps its blocks, and its number, until the last reference to it is
+//	dropped and ospfs_delete_inode() frees them, so a file that is still
+//	open can still be read and written.  Used by ospfs_unlink and
+//	ospfs_rename.
+//
+//   Returns: 0 on success, < 0 on error.
+
+static int
+ospfs_drop_link(struct inode *inode)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(inode->i_sb);
+	ospfs_inode_t *oi = ospfs_inode(inode->i_sb, inode->i_ino);
+
+	if (oi->oi_nlink == 1) {
+		// Mark the orphan before its link count says it is free.
+		mutex_lock(&osb->osb_alloc_mutex);
+		set_bit(inode->i_ino, osb->osb_orphans);
+		oi->oi_nlink = 0;
+		mutex_unlock(&osb->osb_alloc_mutex);
+		clear_nlink(inode);
+	} else {
+		oi->oi_nlink--;
+		drop_nlink(inode);
+	}
+	ospfs_inode_dirty(inode->i_sb, inode->i_ino);
+	return 0;
+}
+
+
+// ospfs_delete_inode(inode)
+//	The super_operations.delete_inode callback: Linux calls it when the
+//	last reference to an inode with no links goes away.  Frees the
+//	orphan's blocks, in one journal transaction, and then its number.
+//	(An orphan left by a crash keeps its blocks.)
+
+static void
+ospfs_delete_inode(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	ospfs_inode_t *oi = ospfs_inode(sb, inode->i_ino);
+
+	truncate_inode_pages(&inode->i_data, 0);
+	if (oi && !oi->oi_nlink && test_bit(inode->i_ino, osb->osb_orphans)) {
+		if (oi->oi_ftype != OSPFS_FTYPE_SYMLINK) {
+			ospfs_journal_start(sb);
+			down_write(&OSPFS_I(inode)->oii_rwsem);
+			if (change_size(inode, 0) < 0)
+				eprintk("ospfs: could not free the blocks of inode %lu\n",
+					(unsigned long) inode->i_ino);
+			up_write(&OSPFS_I(inode)->oii_rwsem);
+			ospfs_journal_stop(sb);
+		}
+		mutex_lock(&osb->osb_alloc_mutex);
+		clear_bit(inode->i_ino, osb->osb_orphans);
+		mutex_unlock(&osb->osb_alloc_mutex);
+	}
+	clear_inode(inode);
+}
+
+
 // ospfs_unlink(dirino, dentry)
 //   This function is called to remove a file.
 //
@@ -531,32 +4868,28 @@ ospfs_dir_readdir(struct file *filp, void *dirent, filldir_t filldir)
 static int
 ospfs_unlink(struct inode *dirino, struct dentry *dentry)
 {
-	ospfs_inode_t *oi = ospfs_inode(dentry->d_inode->i_ino);
-	ospfs_inode_t *dir_oi = ospfs_inode(dentry->d_parent->d_inode->i_ino);
-	int entry_off;
-	ospfs_direntry_t *od;
-
-	od = NULL; // silence compiler warning; entry_off indicates when !od
-	for (entry_off = 0; entry_off < dir_oi->oi_size;
-	     entry_off += OSPFS_DIRENTRY_SIZE) {
-		od = ospfs_inode_data(dir_oi, entry_off);
-		if (od->od_ino > 0
-		    && strlen(od->od_name) == dentry->d_name.len
-		    && memcmp(od->od_name, dentry->d_name.name, dentry->d_name.len) == 0)
-			break;
-	}
-
-	if (entry_off == dir_oi->oi_size) {
+	struct super_block *sb = dirino->i_sb;
+	ospfs_inode_t *dir_oi = ospfs_inode(sb, dentry->d_parent->d_inode->i_ino);
+	ospfs_dirent_t dn;
+	int r;
+
+	r = find_direntry(dirino, dentry->d_name.name, dentry->d_name.len, &dn);
+	if (r < 0)
+		return r;
+	if (r == 0) {
 		printk("<1>ospfs_unlink should not fail!\n");
 		return -ENOENT;
 	}
 
-	od->od_ino = 0;
-	oi->oi_nlink--;
-        if(oi->oi_nlink == 0 && oi->oi_ftype != OSPFS_FTYPE_SYMLINK) 
-            return change_size(oi,0); //Free all blocks associate w/ the file
-        else
-            return 0;
+	if ((r = ospfs_dirent_clear(sb, dir_oi, dn.dn_off)) < 0)
+		return r;
+	ospfs_dcache_remove(dirino, dentry->d_name.name, dentry->d_name.len, dn.dn_off);
+	ospfs_dir_shrink(dirino, dn.dn_hash, dn.dn_off);
+	ospfs_stat_add(sb, OSPFS_STAT_UNLINK, 1);
+	r = ospfs_drop_link(dentry->d_inode);
+	ospfs_trace(sb, OSPFS_TR_UNLINK, dirino->i_ino, dn.dn_off, dentry->d_name.len,
+		    dn.dn_ino, r);
+	return r;
 }
 
 
@@ -567,10 +4900,10 @@ ospfs_unlink(struct inode *dirino, struct dentry *dentry)
  * EXERCISE: Implement these functions.
  */
 
-// allocate_block()
+// allocate_block(sb)
 //	Use this function to allocate a block.
 //
-//   Inputs:  none
+//   Inputs:  sb -- the Linux super_block for this OSPFS
 //   Returns: block number of the allocated block,
 //	      or 0 if the disk is full
 //
@@ -585,35 +4918,44 @@ ospfs_unlink(struct inode *dirino, struct dentry *dentry)
 //   bitvector_test() to do bit operations on the map.
 
 static uint32_t
-allocate_block(void)
+allocate_block(struct super_block *sb)
 {
-        uint32_t free_block = 0;
-        int bit = 0;
-        uint32_t* free_block_bitmap = ospfs_block(OSPFS_FREEMAP_BLK);
-        int bitmap_blk_size = ospfs_super->os_firstinob - OSPFS_FREEMAP_BLK; //How many bitmap blocks
-        int num_bits = bitmap_blk_size * OSPFS_BLKSIZE * 8; //Number of bits in bitmap
-
-        while( bit < num_bits ) {
-            free_block = bitvector_test(free_block_bitmap, bit);
-            if(free_block)
+        ospfs_sb_info_t *osb = OSPFS_SB(sb);
+        ospfs_super_t *os = osb->osb_super;
+        int bitmap_blk_size = os->os_firstinob - OSPFS_FREEMAP_BLK; //How many bitmap blocks
+        uint32_t blockno = 0;
+        int b, bit;
+
+        //Load the bitmap one block at a time: on a block device,
+        //consecutive blocks are not contiguous in memory
+        mutex_lock(&osb->osb_alloc_mutex);
+        for (b = 0; b < bitmap_blk_size && !blockno; b++) {
+            uint32_t* free_block_bitmap = ospfs_block(sb, OSPFS_FREEMAP_BLK + b);
+            if (!free_block_bitmap) //Could not read this part of the bitmap
                 break;
-            else 
-                bit++;
-        }
 
-        if(free_block) {//If while loop above yielded a free block 
-            bitvector_clear(free_block_bitmap, bit); //Allocate the block corresponding to bit        
-            free_block = bit;
+            for (bit = 0; bit < OSPFS_BLKBITSIZE; bit++)
+                if (bitvector_test(free_block_bitmap, bit)
+                    && !ospfs_journal_freed(osb, b * OSPFS_BLKBITSIZE + bit)) {
+                    bitvector_clear(free_block_bitmap, bit); //Allocate the block corresponding to bit
+                    ospfs_meta_dirty(sb, OSPFS_FREEMAP_BLK + b);
+                    blockno = b * OSPFS_BLKBITSIZE + bit;
+                    break;
+                }
         }
+        mutex_unlock(&osb->osb_alloc_mutex);
 
-	return free_block;
+        ospfs_stat_add(sb, blockno ? OSPFS_STAT_BLOCK_ALLOC : OSPFS_STAT_ENOSPC, 1);
+        ospfs_trace(sb, OSPFS_TR_ALLOC, 0, 0, b, blockno, blockno ? 0 : -ENOSPC);
+	return blockno;
 }
 
 
-// free_block(blockno)
+// free_block(sb, blockno)
 //	Use this function to free an allocated block.
 //
-//   Inputs:  blockno -- the block number to be freed
+//   Inputs:  sb      -- the Linux super_block for this OSPFS
+//	      blockno -- the block number to be freed
 //   Returns: none
 //
 //   This function should mark the named block as free in the free-block
@@ -623,10 +4965,76 @@ allocate_block(void)
 
 
 static void
-free_block(uint32_t blockno)
+free_block(struct super_block *sb, uint32_t blockno)
+{
+    ospfs_sb_info_t *osb = OSPFS_SB(sb);
+    uint32_t bitmap_blockno = OSPFS_FREEMAP_BLK + blockno / OSPFS_BLKBITSIZE;
+    uint32_t* free_block_bitmap;
+
+    mutex_lock(&osb->osb_alloc_mutex);
+    free_block_bitmap = ospfs_block(sb, bitmap_blockno);
+    if (free_block_bitmap) {
+        bitvector_set(free_block_bitmap, blockno % OSPFS_BLKBITSIZE);
+        ospfs_meta_dirty(sb, bitmap_blockno);
+        if (osb->osb_jmax && blockno < osb->osb_nblocks) {
+            //Its last contents need not be journaled, and it may not be
+            //reused until the free is committed (see ospfs_journal_freed)
+            set_bit(blockno, osb->osb_jfreed);
+            if (test_and_clear_bit(blockno, osb->osb_jdirty))
+                atomic_dec(&osb->osb_jcount);
+        }
+    }
+    mutex_unlock(&osb->osb_alloc_mutex);
+    ospfs_stat_add(sb, OSPFS_STAT_BLOCK_FREE, 1);
+    ospfs_trace(sb, OSPFS_TR_FREE, 0, 0, 0, blockno, 0);
+}
+
+
+// ospfs_alloc_ino(sb, first)
+//	Finds a free inode numbered 'first' or higher and claims it by giving
+//	it one link, so that no concurrent create can pick it too.  The
+//	caller fills in the rest of the inode, or gives it back with
+//	ospfs_free_ino() if the create fails.  An orphan (an unlinked file
+//	that is still open) is not free: its blocks are freed, and its number
+//	released, by ospfs_delete_inode().
+//
+//   Returns: the inode number, or -ENOSPC if there is no free inode.
+
+static int
+ospfs_alloc_ino(struct super_block *sb, uint32_t first)
+{
+	ospfs_sb_info_t *osb = OSPFS_SB(sb);
+	uint32_t ino;
+	ospfs_inode_t *oi;
+
+	mutex_lock(&osb->osb_alloc_mutex);
+	for (ino = first; ino < osb->osb_super->os_ninodes; ino++) {
+		oi = ospfs_inode(sb, ino);
+		if (oi && !oi->oi_nlink && !test_bit(ino, osb->osb_orphans)) {
+			oi->oi_nlink = 1;
+			ospfs_inode_dirty(sb, ino);
+			break;
+		}
+	}
+	mutex_unlock(&osb->osb_alloc_mutex);
+
+	if (ino < osb->osb_super->os_ninodes)
+		return ino;
+	ospfs_stat_add(sb, OSPFS_STAT_ENOSPC, 1);
+	return -ENOSPC;
+}
+
+
+// ospfs_free_ino(sb, ino)
+//	Gives back an inode claimed by ospfs_alloc_ino() but never used.
+
+static void
+ospfs_free_ino(struct super_block *sb, uint32_t ino)
 {
-    uint32_t* free_block_bitmap = ospfs_block(OSPFS_FREEMAP_BLK);
-    bitvector_set(free_block_bitmap,blockno);
+	ospfs_inode_t *oi = ospfs_inode(sb, ino);
+
+	oi->oi_nlink = 0;
+	ospfs_inode_dirty(sb, ino);
 }
 
 
@@ -710,18 +5118,19 @@ direct_index(uint32_t b)
 		return b - OSPFS_NDIRECT;
         else if(b >= OSPFS_NINDIRECT + OSPFS_NDIRECT && b < OSPFS_MAXFILEBLKS)
                 return ( b - ( OSPFS_NINDIRECT + OSPFS_NDIRECT ) ) 
-                            % ( OSPFS_NINDIRECT + OSPFS_NDIRECT );
+                            % OSPFS_NINDIRECT;
 	else
 		return -1;
 }
 
 
-// add_block(ospfs_inode_t *oi)
+// add_block(inode)
 //   Adds a single data block to a file, adding indirect and
 //   doubly-indirect blocks if necessary. (Helper function for
 //   change_size).
 //
-// Inputs: oi -- pointer to the file we want to grow
+// Inputs: inode -- the Linux inode for the file we want to grow;
+//                  'oi' below is its OSPFS inode
 // Returns: 0 if successful, < 0 on error.  Specifically:
 //          -ENOSPC if you are unable to allocate a block
 //          due to the disk being full or
@@ -748,8 +5157,13 @@ direct_index(uint32_t b)
 //  3) update the oi->oi_size field
 
 static int
-add_block(ospfs_inode_t *oi)
+add_block(struct inode *inode)
 {
+	struct super_block *sb = inode->i_sb;
+	ospfs_inode_t *oi = ospfs_inode(sb, inode->i_ino);
+
+	ospfs_blockmap_drop(inode);
+
 	// current number of blocks in file
 	uint32_t n = ospfs_size2nblocks(oi->oi_size);
 
@@ -759,11 +5173,13 @@ add_block(ospfs_inode_t *oi)
 
 	// keep track of allocations to free in case of -ENOSPC
         uint32_t allocated[3] = { 0, 0, 0};
+	// a directory's data blocks are metadata, and are journaled
+	int is_dir = (oi->oi_ftype == OSPFS_FTYPE_DIR);
 	// First, we check to see if we can add a direct block.
 	if(n < OSPFS_NDIRECT) {
 		
 		// Attempt to allocate a new block.
-		allocated[0] = allocate_block();
+		allocated[0] = allocate_block(sb);
 
 		
 		// Return error indicating no space left if allocation failed.
@@ -774,7 +5190,7 @@ add_block(ospfs_inode_t *oi)
 		else {
 					
 			// Zero out the block we just allocated.
-			memset(ospfs_block(allocated[0]), 0, OSPFS_BLKSIZE);
+			ospfs_block_zero(sb, allocated[0], is_dir);
 
 			// Add the block number to our inode's array of direct blocks.
 			oi->oi_direct[n] = (uint32_t) allocated[0];
@@ -792,17 +5208,22 @@ add_block(ospfs_inode_t *oi)
 		if(oi->oi_indirect) {
 
 			// Allocate a direct block.
-			allocated[0] = allocate_block();
+			allocated[0] = allocate_block(sb);
 			
 			// Check status of allocation.
 			if(allocated[0]) {
 	
 				// Zero out the block we just allocated.
-				memset(ospfs_block(allocated[0]), 0, OSPFS_BLKSIZE);
+				ospfs_block_zero(sb, allocated[0], is_dir);
 
 				// Set the direct block inode number accordingly.
-				uint32_t *indir_block_contents = (uint32_t *) ospfs_block(oi->oi_indirect);
+				uint32_t *indir_block_contents = (uint32_t *) ospfs_block(sb, oi->oi_indirect);
+				if(!indir_block_contents) {
+					free_block(sb, allocated[0]);
+					return -EIO;
+				}
 				indir_block_contents[direct_index(n)] = (uint32_t) allocated[0];
+				ospfs_meta_dirty(sb, oi->oi_indirect);
 			}
 			else   { 
 				return -ENOSPC;
@@ -810,7 +5231,7 @@ add_block(ospfs_inode_t *oi)
 		}
 		// Otherwise, we allocate a new indirect block.
 		else {
-			allocated[0] = allocate_block();
+			allocated[0] = allocate_block(sb);
 			
 			// Return error indicating no space left if allocation failed.
 			if(!allocated[0])
@@ -819,27 +5240,29 @@ add_block(ospfs_inode_t *oi)
 			else {
 					
 				// Zero out the block we just allocated.
-				memset(ospfs_block(allocated[0]), 0, OSPFS_BLKSIZE);
+				ospfs_block_zero(sb, allocated[0], 1);
 			
 				// Set the inode's indirect block.
 				oi->oi_indirect = (uint32_t) allocated[0];
 
 				// Allocate a direct block.
-				allocated[1] = allocate_block();
+				allocated[1] = allocate_block(sb);
 			
 				// Check status of allocation.
 				if(allocated[1]) {
 	
 					// Zero out the block we just allocated.
-					memset(ospfs_block(allocated[1]), 0, OSPFS_BLKSIZE);
+					ospfs_block_zero(sb, allocated[1], is_dir);
 
 					// Set the direct block inode number accordingly.
-					uint32_t *indir_block_contents = (uint32_t *) ospfs_block(oi->oi_indirect);
+					// (The indirect block was just zeroed, so it is
+					// already in memory and marked dirty.)
+					uint32_t *indir_block_contents = (uint32_t *) ospfs_block(sb, oi->oi_indirect);
 					indir_block_contents[direct_index(n)] = (uint32_t) allocated[1];
 				}
 				// Otherwise, we must undo allocation of our indirect block.
 				else {
-					free_block(allocated[0]);
+					free_block(sb, allocated[0]);
 					oi->oi_indirect = 0;
 					return -ENOSPC;
 				}
@@ -857,7 +5280,9 @@ add_block(ospfs_inode_t *oi)
 		if(oi->oi_indirect2) {
 		
 			// Check if the indirect block pointer exists or not.
-			uint32_t *indir_block_contents = (uint32_t *) ospfs_block(oi->oi_indirect2);
+			uint32_t *indir_block_contents = (uint32_t *) ospfs_block(sb, oi->oi_indirect2);
+			if(!indir_block_contents)
+				return -EIO;
 
 			// Check to see if a valid index was returned.
 			if(indir_index(n) < 0) 
@@ -866,56 +5291,63 @@ add_block(ospfs_inode_t *oi)
 			if(indir_block_contents[indir_index(n)]) {
 				
 				// Create a new direct block.
-				allocated[0] = allocate_block();
+				allocated[0] = allocate_block(sb);
 			
 				// Check allocation status.
 				if(allocated[0]) {
 		
 					// Zero out the block we just allocated.
-					memset(ospfs_block(allocated[0]), 0, OSPFS_BLKSIZE);
+					ospfs_block_zero(sb, allocated[0], is_dir);
 
 					// Set the direct block accordingly.
-					uint32_t *dir_block_contents = (uint32_t *) ospfs_block(indir_block_contents[indir_index(n)]);		
+					uint32_t *dir_block_contents = (uint32_t *) ospfs_block(sb, indir_block_contents[indir_index(n)]);		
+					if(!dir_block_contents) {
+						free_block(sb, allocated[0]);
+						return -EIO;
+					}
 
 					dir_block_contents[direct_index(n)] = (uint32_t) allocated[0];
+					ospfs_meta_dirty(sb, indir_block_contents[indir_index(n)]);
 				}
 				else 
 					return -ENOSPC;
 			}
 			// We must create an indirect block pointer since it doesn't exist.
 			else {
-				allocated[0] = allocate_block();
+				allocated[0] = allocate_block(sb);
 
 				if(!allocated[0])
 					return -ENOSPC;
 
 				// Set the indirect block pointer accordingly.
+				ospfs_block_zero(sb, allocated[0], 1);
 				indir_block_contents[indir_index(n)] = (uint32_t) allocated[0];
+				ospfs_meta_dirty(sb, oi->oi_indirect2);
 
 				// We must create a new direct block.
-				allocated[1] = allocate_block();
+				allocated[1] = allocate_block(sb);
 
 				if(!allocated[1]) {
 
 					// If allocation fails here, then we must undo indirect block allocation.
-					free_block(allocated[0]);
+					free_block(sb, allocated[0]);
 					indir_block_contents[indir_index(n)] = 0;
 					return -ENOSPC;
 				}
 				else {
 						
 					// Zero out the block we just allocated.
-					memset(ospfs_block(allocated[1]), 0, OSPFS_BLKSIZE);
+					ospfs_block_zero(sb, allocated[1], is_dir);
 
 					// Set the direct block accordingly.
-					uint32_t *dir_block_contents = (uint32_t *) ospfs_block(allocated[0]);
+					uint32_t *dir_block_contents = (uint32_t *) ospfs_block(sb, allocated[0]);
 					dir_block_contents[direct_index(n)] = (uint32_t) allocated[1];
 				}
 			}
 		}
 		// Otherwise, we allocate a new doubly-indirect block.
 		else {
-			allocated[0] = allocate_block();
+			allocated[0] = allocate_block(sb);
 			
 			// Return error indicating no space left if allocation failed.
 			if(!allocated[0])
@@ -924,49 +5356,49 @@ add_block(ospfs_inode_t *oi)
 			else {
 					
 				// Zero out the block we just allocated.
-				memset(ospfs_block(allocated[0]), 0, OSPFS_BLKSIZE);
+				ospfs_block_zero(sb, allocated[0], 1);
 		
 				// Set the inode's indirect2 block.
 				oi->oi_indirect2 = (uint32_t) allocated[0];
 
 				// Allocate an indirect block.
-				allocated[1] = allocate_block();
+				allocated[1] = allocate_block(sb);
 			
 				// Check status of allocation.
 				if(allocated[1]) {
 	
 					// Zero out the block we just allocated.
-					memset(ospfs_block(allocated[1]), 0, OSPFS_BLKSIZE);
+					ospfs_block_zero(sb, allocated[1], 1);
 
 					// Set the direct block inode number accordingly.
-					uint32_t *indir_block_contents = (uint32_t *) ospfs_block(oi->oi_indirect2);
+					uint32_t *indir_block_contents = (uint32_t *) ospfs_block(sb, oi->oi_indirect2);
 					indir_block_contents[indir_index(n)] = (uint32_t) allocated[1];
 
 					// Now, we create a direct block.
-					allocated[2] = allocate_block();
+					allocated[2] = allocate_block(sb);
 			
 					if(allocated[2]) {
 
 						// Zero out the block we just allocated.
-						memset(ospfs_block(allocated[2]), 0, OSPFS_BLKSIZE);
+						ospfs_block_zero(sb, allocated[2], is_dir);
 
 						// Set the direct block accordingly.
-						uint32_t *dir_block_contents = (uint32_t *) ospfs_block(allocated[1]);		
+						uint32_t *dir_block_contents = (uint32_t *) ospfs_block(sb, allocated[1]);		
 						dir_block_contents[direct_index(n)] = (uint32_t) allocated[2];
 					}
 					else {
 		
 						// If allocation fails here, we must free both the indirect block and doubly
 						// indirect block pointers.
-						free_block(allocated[0]);
-						free_block(allocated[1]);
+						free_block(sb, allocated[0]);
+						free_block(sb, allocated[1]);
 						oi->oi_indirect2 = 0;
 						return -ENOSPC;
 					}
 				}
 				// Otherwise, we must undo allocation of our indirect block.
 				else {
-					free_block(allocated[0]);
+					free_block(sb, allocated[0]);
 					oi->oi_indirect2 = 0;
 					return -ENOSPC;
 				}
@@ -982,6 +5414,8 @@ add_block(ospfs_inode_t *oi)
 		oi->oi_size += ( OSPFS_BLKSIZE - oi->oi_size % OSPFS_BLKSIZE ) + OSPFS_BLKSIZE;
 	else
 		oi->oi_size += OSPFS_BLKSIZE;
+	i_size_write(inode, oi->oi_size);
+	ospfs_inode_dirty(sb, inode->i_ino);
 
 	// Indicate successful return.
         
@@ -989,12 +5423,13 @@ add_block(ospfs_inode_t *oi)
 }
 
 
-// remove_block(ospfs_inode_t *oi)
+// remove_block(inode)
 //   Removes a single data block from the end of a file, freeing
 //   any indirect and indirect^2 blocks that are no
 //   longer needed. (Helper function for change_size)
 //
-// Inputs: oi -- pointer to the file we want to shrink
+// Inputs: inode -- the Linux inode for the file we want to shrink;
+//                  'oi' below is its OSPFS inode
 // Returns: 0 if successful, < 0 on error.
 //          If the function is successful, then oi->oi_size
 //          should be set to the maximum file size that could
@@ -1012,8 +5447,13 @@ add_block(ospfs_inode_t *oi)
 // deallocated blocks laying around!
 
 static int
-remove_block(ospfs_inode_t *oi)
+remove_block(struct inode *inode)
 {
+	struct super_block *sb = inode->i_sb;
+	ospfs_inode_t *oi = ospfs_inode(sb, inode->i_ino);
+
+	ospfs_blockmap_drop(inode);
+
 	// current number of blocks in file
 	uint32_t n = ospfs_size2nblocks(oi->oi_size);
 
@@ -1027,7 +5467,7 @@ remove_block(ospfs_inode_t *oi)
 		
 		// We remove block n by freeing the block and setting the
 		// direct block pointer entry to 0.
-		free_block(oi->oi_direct[n - 1]);
+		free_block(sb, oi->oi_direct[n - 1]);
 		oi->oi_direct[n - 1] = 0;
 	}
 	// Here, we handle the case where the last allocated block was through the
@@ -1040,15 +5480,18 @@ remove_block(ospfs_inode_t *oi)
 			return -EIO;
 		
 		// We must remove the direct block associated to the indirect block pointer.
-		uint32_t *indir_block_contents = (uint32_t *) ospfs_block(oi->oi_indirect);
-		free_block(indir_block_contents[direct_index(n - 1)]);
+		uint32_t *indir_block_contents = (uint32_t *) ospfs_block(sb, oi->oi_indirect);
+		if(!indir_block_contents)
+			return -EIO;
+		free_block(sb, indir_block_contents[direct_index(n - 1)]);
 		indir_block_contents[direct_index(n - 1)] = 0;
+		ospfs_meta_dirty(sb, oi->oi_indirect);
 
 		// It's necessary to check if we should delloacate this indirect block pointer
 		// if it happens to become empty after removing a block.
 
                 if(indir_index(n-2) < 0) { //After removing block, still need indirect block?
-			free_block(oi->oi_indirect);
+			free_block(sb, oi->oi_indirect);
 			oi->oi_indirect = 0;
 		}
 	}
@@ -1066,22 +5509,26 @@ remove_block(ospfs_inode_t *oi)
 			return -EIO;
 		
 		// Now, we can proceed to removing a direct block.
-		uint32_t *indir_block_contents = (uint32_t *) ospfs_block(oi->oi_indirect2);
-		uint32_t *dir_block_contents = (uint32_t *) ospfs_block(indir_block_contents[indir_index(n - 1)]);
-		free_block(dir_block_contents[direct_index(n - 1)]);
+		uint32_t *indir_block_contents = (uint32_t *) ospfs_block(sb, oi->oi_indirect2);
+		uint32_t *dir_block_contents = indir_block_contents ? (uint32_t *) ospfs_block(sb, indir_block_contents[indir_index(n - 1)]) : NULL;
+		if(!dir_block_contents)
+			return -EIO;
+		free_block(sb, dir_block_contents[direct_index(n - 1)]);
 		dir_block_contents[direct_index(n - 1)] = 0;
+		ospfs_meta_dirty(sb, indir_block_contents[indir_index(n - 1)]);
 
 		// After removing a direct block, we need to check if this removal caused either 
 		// a doubly-indirect block or indirect block pointer points to nothing.  If so,
 		// we deallocate that block pointer.
 
 		if(!direct_index(n - 1)) {
-                        free_block(indir_block_contents[indir_index(n - 1)]);
+                        free_block(sb, indir_block_contents[indir_index(n - 1)]);
                         indir_block_contents[indir_index(n - 1)] = 0; //Mark pos in double indirect block to 0
+                        ospfs_meta_dirty(sb, oi->oi_indirect2);
 	
 			// Check to see if this block was the last one pointed to by the doubly-indirect block pointer.
                         if(indir2_index(n - 2) < 0) {
-				free_block(oi->oi_indirect2);
+				free_block(sb, oi->oi_indirect2);
 				oi->oi_indirect2 = 0;
 			}
 		} 
@@ -1096,17 +5543,20 @@ remove_block(ospfs_inode_t *oi)
 		oi->oi_size -= oi->oi_size % OSPFS_BLKSIZE;
 	else
 		oi->oi_size -= OSPFS_BLKSIZE;
+	i_size_write(inode, oi->oi_size);
+	ospfs_inode_dirty(sb, inode->i_ino);
 
 	// Return 0 to indicate a successful removal of a block.
 	return 0;
 }
 
 
-// change_size(oi, want_size)
+// change_size(inode, want_size)
 //	Use this function to change a file's size, allocating and freeing
 //	blocks as necessary.
 //
-//   Inputs:  oi	-- pointer to the file whose size we're changing
+//   Inputs:  inode	-- the Linux inode for the file whose size we're
+//			   changing; 'oi' below is its OSPFS inode
 //	      want_size -- the requested size in bytes
 //   Returns: 0 on success, < 0 on error.  In particular:
 //		-ENOSPC: if there are no free blocks available
@@ -1139,16 +5589,18 @@ remove_block(ospfs_inode_t *oi)
 //   EXERCISE: Finish off this function.
 
 static int
-change_size(ospfs_inode_t *oi, uint32_t new_size)
+change_size(struct inode *inode, uint32_t new_size)
 {
+	ospfs_inode_t *oi = ospfs_inode(inode->i_sb, inode->i_ino);
 	uint32_t old_size = oi->oi_size;
+	ktime_t start = ktime_get();
 	int r = 0;
 
 	// Here, we attempt to add blocks to our inode until it matches the new size.
 	while (ospfs_size2nblocks(oi->oi_size) < ospfs_size2nblocks(new_size)) {
 	
 		// We add one block at a time to our inode.
-		r = add_block(oi);				
+		r = add_block(inode);				
 		
 		// If there is not enough space, then we must shrink the file until
 		// it matches the original file size.
@@ -1157,37 +5609,46 @@ change_size(ospfs_inode_t *oi, uint32_t new_size)
 			// Remove one block at a time until we are back to our
 			// original file size.	
 			while(oi->oi_size > old_size) {
-				r = remove_block(oi);
+				r = remove_block(inode);
 	
 				// If we encounter an error while removing, return that
 				// error.
 				if(r)
-					return r;
+					goto out;
 			}
-			return -ENOSPC;
+			r = -ENOSPC;
+			goto out;
 		} 
 
 		// Return any other type of error: e.g. -EIO.
 		if(r < 0)
-			return r;
+			goto out;
 	}
 	
 	// Here, we continue to remove blocks to our inode until it matches the new size.
 	while (ospfs_size2nblocks(oi->oi_size) > ospfs_size2nblocks(new_size)) {
 		
 		// We remove one block at a time to our inode.
-		r = remove_block(oi);
+		r = remove_block(inode);
 		
 		// check if attempting to remove a block caused an errors.
 		if(r < 0) 
-			return r;
+			goto out;
 	}
 	
 	// We need to change size field of metadata of the file.
 	oi->oi_size = new_size; 
+	i_size_write(inode, new_size);
+	ospfs_inode_dirty(inode->i_sb, inode->i_ino);
 
 	// Return 0 indicating successful change of file size.
-	return 0; 
+	r = 0;
+
+    out:
+	ospfs_stat_time(inode->i_sb, OSPFS_LAT_CHANGE_SIZE, start);
+	ospfs_trace(inode->i_sb, OSPFS_TR_CHANGE_SIZE, inode->i_ino, old_size,
+		    new_size, ospfs_size2nblocks(oi->oi_size), r);
+	return r;
 }
 
 
@@ -1197,31 +5658,208 @@ change_size(ospfs_inode_t *oi, uint32_t new_size)
 //	OSPFS only pays attention to file size changes (see change_size above).
 //	We have written this function for you -- except for file quotas.
 
-static int
-ospfs_notify_change(struct dentry *dentry, struct iattr *attr)
-{
-	struct inode *inode = dentry->d_inode;
-	ospfs_inode_t *oi = ospfs_inode(inode->i_ino);
-	int retval = 0;
+static int
+ospfs_notify_change(struct dentry *dentry, struct iattr *attr)
+{
+	struct inode *inode = dentry->d_inode;
+	ospfs_inode_t *oi = ospfs_inode(inode->i_sb, inode->i_ino);
+	int retval = 0;
+
+	if (attr->ia_valid & ATTR_SIZE) {
+		// We should not be able to change directory size
+		if (oi->oi_ftype == OSPFS_FTYPE_DIR)
+			return -EPERM;
+		down_write(&OSPFS_I(inode)->oii_rwsem);
+		retval = change_size(inode, attr->ia_size);
+		up_write(&OSPFS_I(inode)->oii_rwsem);
+		if (retval < 0)
+			goto out;
+	}
+
+	if (attr->ia_valid & ATTR_MODE) {
+		// Set this inode's mode to the value 'attr->ia_mode'.
+		// (Keep the OSPFS flags in the mode's high bits.)
+		oi->oi_mode = (oi->oi_mode & OSPFS_MODE_FLAGS)
+			| (attr->ia_mode & ~OSPFS_MODE_FLAGS);
+		ospfs_inode_dirty(inode->i_sb, inode->i_ino);
+	}
+
+	if ((retval = inode_change_ok(inode, attr)) < 0
+	    || (retval = inode_setattr(inode, attr)) < 0)
+		goto out;
+
+    out:
+	return retval;
+}
+
+
+// ospfs_get_block(inode, iblock, bh_result, create)
+//	Maps block 'iblock' of a file onto the block device, for direct I/O.
+//	Runs of blocks that are contiguous on disk are mapped together, up to
+//	'bh_result->b_size' bytes, so they go out as one bio.  Blocks are
+//	never allocated here; ospfs_direct_rw() grows the file first.
+//
+//   Returns: 0 on success (leaving 'bh_result' unmapped for a block past
+//	      the end of the file), -EIO if the file's block map is broken.
+
+static int
+ospfs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
+{
+	struct super_block *sb = inode->i_sb;
+	ospfs_inode_t *oi = ospfs_inode(sb, inode->i_ino);
+	uint32_t off = iblock << OSPFS_BLKSIZE_BITS;
+	uint32_t blockno, n, max;
+
+	if (!oi)
+		return -EIO;
+	if (iblock >= ospfs_size2nblocks(oi->oi_size))
+		return 0;
+	if (!(blockno = ospfs_file_blockno(inode, off)))
+		return -EIO;
+
+	max = bh_result->b_size >> OSPFS_BLKSIZE_BITS;
+	for (n = 1; n < max && iblock + n < ospfs_size2nblocks(oi->oi_size); n++)
+		if (ospfs_file_blockno(inode, off + n * OSPFS_BLKSIZE)
+		    != blockno + n)
+			break;
+
+	map_bh(bh_result, sb, blockno);
+	bh_result->b_size = n << OSPFS_BLKSIZE_BITS;
+	return 0;
+}
+
+
+// ospfs_direct_IO(rw, iocb, iov, offset, nr_segs)
+//	The address_space_operations.direct_IO callback.  Moves data straight
+//	between user memory and the block device, with no copy through the
+//	buffer cache.  Linux checks for this callback when a file is opened
+//	with O_DIRECT; ospfs_read and ospfs_write call it for such files.
+//
+//   Returns: Number of bytes moved, or -(error code); -EINVAL if the
+//	      request is not aligned to the device's sector size.
+
+static ssize_t
+ospfs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov, loff_t offset, unsigned long nr_segs)
+{
+	struct inode *inode = iocb->ki_filp->f_dentry->d_inode;
+
+	if (!inode->i_sb->s_bdev)
+		return -EINVAL;
+	return blockdev_direct_IO_no_locking(rw, iocb, inode,
+					     inode->i_sb->s_bdev, iov, offset,
+					     nr_segs, ospfs_get_block, NULL);
+}
+
+
+// ospfs_direct_rw(rw, iocb, iov, nr_segs, pos)
+//	Performs an O_DIRECT read or write of the 'nr_segs' user buffers in
+//	'iov' on a block device, for ospfs_read, ospfs_write and
+//	ospfs_aio_read.  Blocks in the range that are cached in
+//	pinned buffers are written out (if dirty) and unpinned first, and for
+//	a write the device's page cache is invalidated afterwards, so later
+//	buffered access sees the new data.
+//
+//	A synchronous 'iocb' is waited for.  An asynchronous read may return
+//	-EIOCBQUEUED, and completes when its bios do.  A write past end of
+//	file grows the file first; if the write fails or comes up short, the
+//	file is cut back to end with the last byte written (or to its old
+//	size).  Requests not aligned to the device's sector size fail with
+//	-EINVAL before anything changes.
+//
+//   Returns: Number of bytes moved, -EIOCBQUEUED, or -(error code).
+
+static ssize_t
+ospfs_direct_rw(int rw, struct kiocb *iocb, const struct iovec *iov,
+		unsigned long nr_segs, loff_t pos)
+{
+	struct inode *inode = iocb->ki_filp->f_dentry->d_inode;
+	struct super_block *sb = inode->i_sb;
+	ospfs_inode_t *oi = ospfs_inode(sb, inode->i_ino);
+	size_t count = iov_length(iov, nr_segs);
+	unsigned mask = bdev_hardsect_size(sb->s_bdev) - 1;
+	uint32_t first, last, b, old_size;
+	unsigned long i;
+	ssize_t r;
+
+	if (!oi)
+		return -EIO;
+	// Check alignment as blockdev_direct_IO will, but before a write
+	// can grow the file.
+	if (pos & mask)
+		return -EINVAL;
+	for (i = 0; i < nr_segs; i++)
+		if (((unsigned long) iov[i].iov_base | iov[i].iov_len) & mask)
+			return -EINVAL;
+
+	old_size = oi->oi_size;
+	if (rw == READ) {
+		if (pos >= oi->oi_size)
+			return 0;
+		// The iovec stays as the caller aligned it: the dio code stops
+		// a read at i_size itself.  Only the blocks to unpin stop here.
+		if (count > oi->oi_size - pos)
+			count = oi->oi_size - pos;
+	} else if (pos + count > oi->oi_size) {
+		if (pos + count > OSPFS_MAXFILESIZE)
+			return -EFBIG;
+		if ((r = change_size(inode, pos + count)) < 0)
+			return r;
+	}
+	if (count == 0)
+		return 0;
+
+	first = pos >> OSPFS_BLKSIZE_BITS;
+	last = (pos + count - 1) >> OSPFS_BLKSIZE_BITS;
+	for (b = first; b <= last; b++) {
+		uint32_t blockno = ospfs_file_blockno(inode, b << OSPFS_BLKSIZE_BITS);
+		loff_t start = (loff_t) b << OSPFS_BLKSIZE_BITS;
+		int whole = (rw == WRITE && start >= pos
+			     && start + OSPFS_BLKSIZE <= pos + count);
+		if (blockno)
+			ospfs_block_unpin(sb, blockno, whole);
+	}
+
+	r = ospfs_direct_IO(rw, iocb, iov, pos, nr_segs);
+	if (r == -EIOCBQUEUED && is_sync_kiocb(iocb))
+		r = wait_on_sync_kiocb(iocb);
+
+	if (rw == WRITE) {
+		struct address_space *mapping = sb->s_bdev->bd_inode->i_mapping;
+		for (b = first; b <= last; b++) {
+			uint32_t blockno = ospfs_file_blockno(inode, b << OSPFS_BLKSIZE_BITS);
+			pgoff_t index = blockno >> (PAGE_CACHE_SHIFT - OSPFS_BLKSIZE_BITS);
+			if (blockno)
+				invalidate_inode_pages2_range(mapping, index, index);
+		}
 
-	if (attr->ia_valid & ATTR_SIZE) {
-		// We should not be able to change directory size
-		if (oi->oi_ftype == OSPFS_FTYPE_DIR)
-			return -EPERM;
-		if ((retval = change_size(oi, attr->ia_size)) < 0)
-			goto out;
+		// Do not leave zeroes past the data actually written.
+		if (oi->oi_size > old_size && (r < 0 || (size_t) r < count)) {
+			loff_t end = pos + (r > 0 ? r : 0);
+			change_size(inode, end > old_size ? end : old_size);
+		}
 	}
 
-	if (attr->ia_valid & ATTR_MODE)
-		// Set this inode's mode to the value 'attr->ia_mode'.
-		oi->oi_mode = attr->ia_mode;
+	return r;
+}
 
-	if ((retval = inode_change_ok(inode, attr)) < 0
-	    || (retval = inode_setattr(inode, attr)) < 0)
-		goto out;
 
-    out:
-	return retval;
+// ospfs_direct_sync(rw, filp, buffer, count, f_pos)
+//	Synchronous O_DIRECT read or write, for ospfs_read and ospfs_write.
+//	Updates '*f_pos' by the number of bytes moved.
+
+static ssize_t
+ospfs_direct_sync(int rw, struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
+{
+	struct iovec iov = { .iov_base = buffer, .iov_len = count };
+	struct kiocb kiocb;
+	ssize_t r;
+
+	init_sync_kiocb(&kiocb, filp);
+	kiocb.ki_pos = *f_pos;
+	r = ospfs_direct_rw(rw, &kiocb, &iov, 1, *f_pos);
+	if (r > 0)
+		*f_pos += r;
+	return r;
 }
 
 
@@ -1246,19 +5884,42 @@ ospfs_notify_change(struct dentry *dentry, struct iattr *attr)
 static ssize_t
 ospfs_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
 {
-	ospfs_inode_t *oi = ospfs_inode(filp->f_dentry->d_inode->i_ino);
+	struct super_block *sb = filp->f_dentry->d_inode->i_sb;
+	ospfs_inode_t *oi = ospfs_inode(sb, filp->f_dentry->d_inode->i_ino);
 	int retval = 0;
 	size_t amount = 0;
+	ktime_t start = ktime_get();
+
+	// O_DIRECT on a block device skips the buffer cache.  (An in-memory
+	// image has no cache to skip, so it takes the usual path.)
+	if ((filp->f_flags & O_DIRECT) && sb->s_bdev) {
+		ssize_t r;
+		down_read(&OSPFS_I(filp->f_dentry->d_inode)->oii_rwsem);
+		r = ospfs_direct_sync(READ, filp, buffer, count, f_pos);
+		up_read(&OSPFS_I(filp->f_dentry->d_inode)->oii_rwsem);
+		ospfs_stat_add(sb, OSPFS_STAT_READ, 1);
+		if (r > 0)
+			ospfs_stat_add(sb, OSPFS_STAT_READ_BYTES, r);
+		ospfs_stat_time(sb, OSPFS_LAT_READ, start);
+		ospfs_trace(sb, OSPFS_TR_READ, filp->f_dentry->d_inode->i_ino,
+			    *f_pos - (r > 0 ? r : 0), count, 0, r);
+		return r;
+	}
 
 	// Make sure we don't read past the end of the file!
 	// Change 'count' so we never read past the end of the file.
 	/* EXERCISE: Your code here */
+	if (!oi)
+		return -EIO;
+	down_read(&OSPFS_I(filp->f_dentry->d_inode)->oii_rwsem);
+	if (*f_pos >= oi->oi_size)
+		goto done;
 	if(oi->oi_size < *f_pos + count)
 		count = oi->oi_size - *f_pos;
 
 	// Copy the data to user block by block
 	while (amount < count && retval >= 0) {
-		uint32_t blockno = ospfs_inode_blockno(oi, *f_pos);
+		uint32_t blockno = ospfs_file_blockno(filp->f_dentry->d_inode, *f_pos);
 		uint32_t n;
                 uint32_t blk_off = 0; //Offset within an invidual block?
                 uint32_t blk_bytes_to_read = 0; //How many bytes can we read in a block?
@@ -1273,8 +5934,12 @@ ospfs_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
 			goto done;
 		}
 
-		data = ospfs_block(blockno); //Base address
-                current_data_offset = ospfs_inode_data(oi, *f_pos);
+		data = ospfs_block(sb, blockno); //Base address
+		if (!data) {
+			retval = -EIO;
+			goto done;
+		}
+                current_data_offset = data + *f_pos % OSPFS_BLKSIZE;
                 blk_off = (uint32_t) current_data_offset - (uint32_t) data;
 
 		// Figure out how much data is left in this block to read.
@@ -1318,10 +5983,66 @@ ospfs_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
 	}
 
     done:
+	up_read(&OSPFS_I(filp->f_dentry->d_inode)->oii_rwsem);
+	ospfs_stat_add(sb, OSPFS_STAT_READ, 1);
+	ospfs_stat_add(sb, OSPFS_STAT_READ_BYTES, amount);
+	ospfs_stat_time(sb, OSPFS_LAT_READ, start);
+	ospfs_trace(sb, OSPFS_TR_READ, filp->f_dentry->d_inode->i_ino,
+		    *f_pos - amount, count, 0, retval >= 0 ? (int) amount : retval);
 	return (retval >= 0 ? amount : retval);
 }
 
 
+// ospfs_aio_read
+//	Linux calls this function for asynchronous and vectored reads
+//	(io_submit, readv).  It is the file_operations.aio_read callback.
+//
+//   Inputs:  iocb	-- the I/O control block; 'iocb->ki_filp' is the file
+//            iov       -- user space buffers where data should be copied
+//            nr_segs   -- the number of buffers in 'iov'
+//            pos       -- the file position to read from
+//   Returns: Number of chars read, -EIOCBQUEUED if the read will complete
+//	      later, or -(error code) on error.
+//
+//   A read of an in-memory image never blocks: the data is already
+//   resident, and nothing is allocated.  So rather than queueing the
+//   request, we complete it here and now, at the cost of a copy.  O_DIRECT
+//   reads on a block device are submitted as bios and complete
+//   asynchronously.  Other block-device reads also complete inline; they
+//   wait for any block not yet in the buffer cache.
+
+static ssize_t
+ospfs_aio_read(struct kiocb *iocb, const struct iovec *iov,
+	       unsigned long nr_segs, loff_t pos)
+{
+	struct file *filp = iocb->ki_filp;
+	ssize_t r, total = 0;
+	unsigned long i;
+
+	if ((filp->f_flags & O_DIRECT) && filp->f_dentry->d_inode->i_sb->s_bdev) {
+		down_read(&OSPFS_I(filp->f_dentry->d_inode)->oii_rwsem);
+		r = ospfs_direct_rw(READ, iocb, iov, nr_segs, pos);
+		up_read(&OSPFS_I(filp->f_dentry->d_inode)->oii_rwsem);
+		return r;
+	}
+
+	// Read the segments in turn, stopping at end of file or an error.
+	for (i = 0; i < nr_segs; i++) {
+		r = ospfs_read(filp, iov[i].iov_base, iov[i].iov_len, &pos);
+		if (r < 0) {
+			if (total == 0)
+				return r;
+			break;
+		}
+		total += r;
+		if ((size_t) r < iov[i].iov_len)
+			break;
+	}
+	iocb->ki_pos = pos;
+	return total;
+}
+
+
 // ospfs_write
 //	Linux calls this function to write data to a file.
 //	It is the file_operations.write callback.
@@ -1342,10 +6063,16 @@ ospfs_read(struct file *filp, char __user *buffer, size_t count, loff_t *f_pos)
 static ssize_t
 ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *f_pos)
 {
-	ospfs_inode_t *oi = ospfs_inode(filp->f_dentry->d_inode->i_ino);
+	struct super_block *sb = filp->f_dentry->d_inode->i_sb;
+	ospfs_inode_t *oi = ospfs_inode(sb, filp->f_dentry->d_inode->i_ino);
 	int retval = 0;
 	size_t amount = 0;
         int append = 0; //Is the append operation being used?
+	ktime_t start = ktime_get();
+
+	// Writers to this file take turns; the size check, any growth and
+	// the copy happen as one step, so appends do not overwrite each other.
+	down_write(&OSPFS_I(filp->f_dentry->d_inode)->oii_rwsem);
 
 	// Support files opened with the O_APPEND flag.  To detect O_APPEND,
 	// use struct file's f_flags field and the O_APPEND bit.
@@ -1355,18 +6082,31 @@ ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *
             *f_pos = oi->oi_size; 
         }
 
+	if ((filp->f_flags & O_DIRECT) && sb->s_bdev) {
+		ssize_t r = ospfs_direct_sync(WRITE, filp, (char __user *) buffer,
+					      count, f_pos);
+		up_write(&OSPFS_I(filp->f_dentry->d_inode)->oii_rwsem);
+		ospfs_stat_add(sb, OSPFS_STAT_WRITE, 1);
+		if (r > 0)
+			ospfs_stat_add(sb, OSPFS_STAT_WRITE_BYTES, r);
+		ospfs_stat_time(sb, OSPFS_LAT_WRITE, start);
+		ospfs_trace(sb, OSPFS_TR_WRITE, filp->f_dentry->d_inode->i_ino,
+			    *f_pos - (r > 0 ? r : 0), count, 0, r);
+		return r;
+	}
+
 	// If the user is writing past the end of the file, change the file's
 	// size to accomodate the request.  (Use change_size().)
 	/* EXERCISE: Your code here */
         uint32_t free_space = oi->oi_size - *f_pos; //How many bytes can we write? 
         if( free_space < count ) { //We need to allocate memory
             uint32_t bytes_to_add = count - free_space;
-            change_size(oi, oi->oi_size + bytes_to_add);
+            change_size(filp->f_dentry->d_inode, oi->oi_size + bytes_to_add);
         }
         
 	// Copy data block by block
 	while (amount < count && retval >= 0) {
-		uint32_t blockno = ospfs_inode_blockno(oi, *f_pos);
+		uint32_t blockno = ospfs_file_blockno(filp->f_dentry->d_inode, *f_pos);
 		uint32_t n;
                 uint32_t blk_off = 0; //Offset within an invidual block?
                 uint32_t blk_bytes_to_write = 0; //How many bytes can we read in a block?
@@ -1380,8 +6120,12 @@ ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *
 			goto done;
 		}
 
-		data = ospfs_block(blockno); //Base address
-                current_data_offset = ospfs_inode_data(oi, *f_pos);
+		data = ospfs_block(sb, blockno); //Base address
+		if (!data) {
+			retval = -EIO;
+			goto done;
+		}
+                current_data_offset = data + *f_pos % OSPFS_BLKSIZE;
                 blk_off = (uint32_t) current_data_offset - (uint32_t) data;
 
 		// Figure out how much data is left in this block to write.
@@ -1408,6 +6152,7 @@ ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *
                     else
                         n = blk_bytes_to_write;
                 }
+                ospfs_block_dirty(sb, blockno);
   
 		buffer += n;
 		amount += n;
@@ -1415,96 +6160,103 @@ ospfs_write(struct file *filp, const char __user *buffer, size_t count, loff_t *
 	}
 
     done:
+	up_write(&OSPFS_I(filp->f_dentry->d_inode)->oii_rwsem);
+	ospfs_stat_add(sb, OSPFS_STAT_WRITE, 1);
+	ospfs_stat_add(sb, OSPFS_STAT_WRITE_BYTES, amount);
+	ospfs_stat_time(sb, OSPFS_LAT_WRITE, start);
+	ospfs_trace(sb, OSPFS_TR_WRITE, filp->f_dentry->d_inode->i_ino,
+		    *f_pos - amount, count, 0, retval >= 0 ? (int) amount : retval);
 	return (retval >= 0 ? amount : retval);
 }
 
-// find_direntry(dir_oi, name, namelen)
-//	Looks through the directory to find an entry with name 'name' (length
-//	in characters 'namelen').  Returns a pointer to the directory entry,
-//	if one exists, or NULL if one does not.
-//
-//   Inputs:  dir_oi  -- the OSP inode for the directory
-//	      name    -- name to search for
-//	      namelen -- length of 'name'.  (If -1, then use strlen(name).)
-//
-//	We have written this function for you.
-
-static ospfs_direntry_t *
-find_direntry(ospfs_inode_t *dir_oi, const char *name, int namelen)
-{
-	int off;
-	if (namelen < 0)
-		namelen = strlen(name);
-	for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
-		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
-		if (od->od_ino
-		    && strlen(od->od_name) == namelen
-		    && memcmp(od->od_name, name, namelen) == 0)
-			return od;
-	}
-	return 0;
-}
-
-
-// create_blank_direntry(dir_oi)
-//	'dir_oi' is an OSP inode for a directory.
-//	Return a blank directory entry in that directory.  This might require
-//	adding a new block to the directory.  Returns an error pointer (see
-//	below) on failure.
-//
-// ERROR POINTERS: The Linux kernel uses a special convention for returning
-// error values in the form of pointers.  Here's how it works.
-//	- ERR_PTR(errno): Creates a pointer value corresponding to an error.
-//	- IS_ERR(ptr): Returns true iff 'ptr' is an error value.
-//	- PTR_ERR(ptr): Returns the error value for an error pointer.
-//	For example:
+// create_blank_direntry(dir, name, namelen, entry_off)
+//	'dir' is the Linux inode for a directory.
+//	Find a blank directory entry in that directory, suitable for holding
+//	name 'name' (length 'namelen').  This might require
+//	adding a new block to the directory.  On success, '*entry_off' is set
+//	to the entry's offset within the directory, and the caller fills the
+//	entry in with ospfs_dirent_set().
 //
-//	static ospfs_direntry_t *create_blank_direntry(...) {
-//		return ERR_PTR(-ENOSPC);
-//	}
-//	static int ospfs_create(...) {
-//		...
-//		ospfs_direntry_t *od = create_blank_direntry(...);
-//		if (IS_ERR(od))
-//			return PTR_ERR(od);
-//		...
-//	}
+//	In an indexed directory, the entry is in the leaf for 'name's hash.
+//	A linear directory that is full and already has a block is converted
+//	to an indexed directory rather than grown.  In a packed directory,
+//	the blank entry may be carved out of a live record's spare space.
 //
-//	The create_blank_direntry function should use this convention.
+//   Returns: 0 on success, -(error code) on error.  (The entry is not
+//	      returned as a pointer, since its layout depends on whether the
+//	      directory is packed.)
 //
 // EXERCISE: Write this function.
 
-static ospfs_direntry_t *
-create_blank_direntry(ospfs_inode_t *dir_oi)
+static int
+create_blank_direntry(struct inode *dir, const char *name, int namelen, uint32_t *entry_off)
 {
+	struct super_block *sb = dir->i_sb;
+	ospfs_inode_t *dir_oi = ospfs_inode(sb, dir->i_ino);
+	int packed = ospfs_dir_packed(dir_oi);
+	uint32_t need = ospfs_dirent_size(packed, namelen);
+	uint32_t off;
+	void *blk;
+	int r;
+
+	if (ospfs_dir_indexed(dir_oi)) {
+		r = ospfs_dx_add_slot(dir, name, namelen, entry_off);
+		goto out;
+	}
+
 	// Outline:
 	// 1. Check the existing directory data for an empty entry.  Return one
 	//    if you find it.
 	// 2. If there's no empty entries, add a block to the directory.
-	//    Use ERR_PTR if this fails; otherwise, clear out all the directory
-	//    entries and return one of them.
-
-        //Iterate until you find an empty directory
-        int off;
-        for (off = 0; off < dir_oi->oi_size; off += OSPFS_DIRENTRY_SIZE) {
-		ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off);
-		if (!od->od_ino) //Found an empty directory entry
-                    return od;
+	//    Return an error if this fails; otherwise, clear out all the
+	//    directory entries and return one of them.
+
+        //Look for room in each block in turn, skipping blocks the
+        //occupancy map knows are too full
+        for (off = ospfs_dcache_next_room(dir, need, 0) * OSPFS_BLKSIZE;
+             off < dir_oi->oi_size;
+             off = ospfs_dcache_next_room(dir, need, off / OSPFS_BLKSIZE + 1) * OSPFS_BLKSIZE) {
+		if (!(blk = ospfs_inode_data(sb, dir_oi, off))) {
+                    r = -EIO;
+                    goto out;
+                }
+		r = ospfs_dirblock_room(blk, packed, namelen);
+		if (r >= 0) { //Found room for the entry
+                    *entry_off = off + r;
+                    ospfs_inode_data_dirty(sb, dir_oi, off);
+                    r = 0;
+                    goto out;
+                } else if (r != -ENOSPC)
+                    goto out;
 	}
 
-        //No free directory. Need to allocate memory for one.
-        int success = add_block(dir_oi);
-        if(success < 0) //Could not free anymore blocks
-            return ERR_PTR(-success);
+        //No free directory. Index the directory if it already has a block
+        if (dir_oi->oi_size >= OSPFS_BLKSIZE) {
+            r = ospfs_dx_convert(dir);
+            if (r >= 0)
+                r = ospfs_dx_add_slot(dir, name, namelen, entry_off);
+            goto out;
+        }
 
-        ospfs_direntry_t *od = ospfs_inode_data(dir_oi, off); 
-        
-        //The very first directory entry in the newly allocated block should be empty
-        if(od->od_ino) {
-            eprintk("Newly allocated directory entry not zeroed out properly!!");
-            return ERR_PTR(-EIO);
-        } else 
-            return od;
+        //Otherwise, need to allocate memory for one.
+        off = dir_oi->oi_size;
+        r = add_block(dir);
+        if (r < 0) //Could not free anymore blocks
+            goto out;
+
+        if (!(blk = ospfs_inode_data(sb, dir_oi, off))) {
+            r = -EIO;
+            goto out;
+        }
+        ospfs_dirblock_init(blk, packed);
+        ospfs_inode_data_dirty(sb, dir_oi, off);
+        *entry_off = off;
+        r = 0;
+
+    out:
+	ospfs_trace(sb, OSPFS_TR_BLANK, dir->i_ino, r == 0 ? *entry_off : 0, namelen,
+		    ospfs_size2nblocks(dir_oi->oi_size), r);
+	return r;
 }
 
 // ospfs_link(src_dentry, dir, dst_dentry
@@ -1538,34 +6290,132 @@ create_blank_direntry(ospfs_inode_t *dir_oi)
 
 static int
 ospfs_link(struct dentry *src_dentry, struct inode *dir, struct dentry *dst_dentry) {
+    struct super_block *sb = dir->i_sb;
     uint32_t destination_inode = src_dentry->d_inode->i_ino; //Inode you want to link to
-    ospfs_inode_t *containing_directory = ospfs_inode(dir->i_ino);
+    ospfs_inode_t *containing_directory = ospfs_inode(sb, dir->i_ino);
     ospfs_inode_t *target;
+    uint32_t entry_off;
+    int r;
+
+    if(dst_dentry->d_name.len > OSPFS_MAXNAMELEN)
+        return -ENAMETOOLONG;
 
     //Does directory entry w/ same filename field already exist??
-    if(find_direntry(containing_directory, dst_dentry->d_name.name, dst_dentry->d_name.len))
+    r = find_direntry(dir, dst_dentry->d_name.name, dst_dentry->d_name.len, NULL);
+    if(r < 0)
+        return r;
+    if(r > 0)
         return -EEXIST;
 
+    //Find inode that corresponds to the relevant file
+    target = ospfs_inode(sb, destination_inode);
+    if(!target)
+        return -EIO;
+
     //Add empty directory entry to the containing directory
-    ospfs_direntry_t  *new_dir_entry = create_blank_direntry(containing_directory);
-    if(IS_ERR(new_dir_entry))
-        return PTR_ERR(new_dir_entry);
-       
-    if(dst_dentry->d_name.len > OSPFS_MAXNAMELEN)
-        return -ENAMETOOLONG;
+    r = create_blank_direntry(dir, dst_dentry->d_name.name, dst_dentry->d_name.len, &entry_off);
+    if(r < 0)
+        return r;
 
-    memcpy(new_dir_entry->od_name, dst_dentry->d_name.name, dst_dentry->d_name.len);
-    new_dir_entry->od_name[dst_dentry->d_name.len] = '\0';
-    new_dir_entry->od_ino = destination_inode;
+    r = ospfs_dirent_set(sb, containing_directory, entry_off, dst_dentry->d_name.name,
+                         dst_dentry->d_name.len, destination_inode, target->oi_ftype);
+    if(r < 0)
+        return r;
+    ospfs_dcache_add(dir, dst_dentry->d_name.name, dst_dentry->d_name.len, entry_off);
 
 
-    //Find inode that corresponds to the relevant file to update link count
-    target = ospfs_inode(destination_inode);
+    //Update the link count
     target->oi_nlink++;
+    ospfs_inode_dirty(sb, destination_inode);
+
+    //The new name shares the source's in-core inode, so that the dentry
+    //cache holds an up-to-date positive entry for it
+    inc_nlink(src_dentry->d_inode);
+    atomic_inc(&src_dentry->d_inode->i_count);
+    d_instantiate(dst_dentry, src_dentry->d_inode);
   
     return 0;
 }
 
+// ospfs_create_entry(dir, name, namelen, mode, ino_cursor)
+//	Creates an empty regular file named 'name' in directory 'dir', with
+//	permissions 'mode'.  The free inode is the first at or after
+//	'*ino_cursor', which is advanced past it, so a batch of creates
+//	scans the inode table once.  This is the common part of ospfs_create
+//	and ospfs_create_batch; it makes no in-core inode.
+//
+//   Returns: the new inode number, or -(error code):
+//               -ENAMETOOLONG if 'namelen' is too large;
+//               -EEXIST       if 'dir' already has a file named 'name';
+//               -ENOSPC       if the disk is full & the file can't be created;
+//               -EIO          on I/O error.
+
+static int
+ospfs_create_entry(struct inode *dir, const char *name, int namelen, int mode, uint32_t *ino_cursor)
+{
+	struct super_block *sb = dir->i_sb;
+	ospfs_inode_t *dir_oi = ospfs_inode(sb, dir->i_ino);
+        ospfs_inode_t *entry_oi;
+	uint32_t entry_ino = 0;
+	uint32_t entry_off;
+	int r;
+
+      	// Check if directory entry name is too long.
+	if(namelen > OSPFS_MAXNAMELEN)
+		return -ENAMETOOLONG;
+
+	// Check if directory's inode exists.
+	if(!dir_oi)
+		return -EIO;
+
+	// Here, we call our helper function find_direntry to see if there already exists
+	// a directory entry with the same file name.
+	r = find_direntry(dir, name, namelen, NULL);
+	if(r < 0)
+		return r;
+	if(r > 0)
+            return -EEXIST;
+
+	// Claim an empty inode, before taking a directory entry, so that a
+	// full inode table leaves the directory alone.
+	r = ospfs_alloc_ino(sb, *ino_cursor);
+	if(r < 0)
+		return r;
+	entry_ino = r;
+	entry_oi = ospfs_inode(sb, entry_ino);
+	*ino_cursor = entry_ino + 1;
+
+	// We attempt to find an empty directory entry using the function create_blank_direntry.
+	r = create_blank_direntry(dir, name, namelen, &entry_off);
+	if(r < 0)
+		goto fail;
+
+        //We now have a free inode and a free directory entry. Populate them
+
+        //Populate the directory entry
+
+	// Record the name, 'entry_ino' and the file's type in the entry.
+	r = ospfs_dirent_set(sb, dir_oi, entry_off, name, namelen, entry_ino, OSPFS_FTYPE_REG);
+	if(r < 0)
+		goto fail;
+	ospfs_dcache_add(dir, name, namelen, entry_off);
+	
+	//Populate the inode
+	memset(entry_oi, 0, OSPFS_INODESIZE);
+	entry_oi->oi_ftype = OSPFS_FTYPE_REG;
+	entry_oi->oi_nlink = 1;
+	entry_oi->oi_mode = mode;
+	ospfs_inode_dirty(sb, entry_ino);
+
+	ospfs_stat_add(sb, OSPFS_STAT_CREATE, 1);
+	return entry_ino;
+
+    fail:
+	ospfs_free_ino(sb, entry_ino);
+	return r;
+}
+
+
 // ospfs_create
 //   Linux calls this function to create a regular file.
 //   It is the ospfs_dir_inode_ops.create callback.
@@ -1598,56 +6448,18 @@ ospfs_link(struct dentry *src_dentry, struct inode *dir, struct dentry *dst_dent
 static int
 ospfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidata *nd)
 {
-	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
-        ospfs_inode_t *entry_oi;
-	uint32_t entry_ino = 0;
-
-      	// Check if directory entry name is too long.
-	if(dentry->d_name.len > OSPFS_MAXNAMELEN)
-		return -ENAMETOOLONG;
+	uint32_t ino_cursor = 0;
+	int entry_ino;
 
-	// Check if directory's inode exists or dentry file exists.
-	if(!dir_oi || !dentry)
+	// Check if dentry file exists.
+	if(!dentry)
 		return -EIO;
 
-	// Here, we call our helper function find_direntry to see if there already exists
-	// a directory entry with the same file name.
-	if(find_direntry(dir_oi, dentry->d_name.name, dentry->d_name.len))
-            return -EEXIST;
-
-	// We attempt to find an empty directory entry using the function create_blank_direntry.
-	ospfs_direntry_t *od = create_blank_direntry(dir_oi);	
-	if(IS_ERR(od))
-		return PTR_ERR(od);
-
-	// Find an empty inode. 
-        for(entry_ino = 0 ; entry_ino < ospfs_super->os_ninodes ; entry_ino++ ) {
-        	entry_oi = ospfs_inode(entry_ino);
-                if(!entry_oi->oi_nlink) //Free if no links to the inode
-                    break;
-        }
-
-	// Check if file system is currently full.
-	if(entry_ino == ospfs_super->os_ninodes)
-		return -ENOSPC;
-
-        //We now have a free inode and a free directory entry. Populate them
-
-        //Populate the directory entry
-
-	// Set 'entry_ino' variable to its inode number.
-	od->od_ino = entry_ino;	
-	// Initialize the name of the directory entry.
-	memcpy(od->od_name, dentry->d_name.name, dentry->d_name.len);
-	// Make the dir entry name null-byte terminated.
-	od->od_name[dentry->d_name.len] = '\0';	
-	
-	//Populate the inode
-	ospfs_inode_t *ino = ospfs_inode(od->od_ino);
-	memset(ino, 0, OSPFS_INODESIZE);
-	ino->oi_ftype = OSPFS_FTYPE_REG;
-	ino->oi_nlink++;
-	ino->oi_mode = mode;
+	// The work is done by ospfs_create_entry, which ospfs_create_batch
+	// shares.
+	entry_ino = ospfs_create_entry(dir, dentry->d_name.name, dentry->d_name.len, mode, &ino_cursor);
+	if(entry_ino < 0)
+		return entry_ino;
 
 	/* Execute this code after your function has successfully created the
 	   file.  Set entry_ino to the created file's inode number before
@@ -1662,6 +6474,81 @@ ospfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidat
 }
 
 
+// ospfs_create_batch(filp, arg)
+//	Implements OSPFS_IOC_CREATE on directory 'filp' (see ospfs.h).  The
+//	files are created with ospfs_create_entry, sharing one pass over the
+//	inode table, and with no in-core inodes.  Any negative dentries for
+//	the new names are dropped, so later lookups find the files.
+//
+//   Returns: the number of files created, or the first name's error.
+
+static int
+ospfs_create_batch(struct file *filp, ospfs_createbatch_t __user *arg)
+{
+	struct dentry *parent = filp->f_dentry;
+	struct inode *dir = parent->d_inode;
+	ospfs_createbatch_t cb;
+	ospfs_createent_t __user *uents;
+	ospfs_createent_t ce;
+	uint32_t ino_cursor = 0, i;
+	int r = 0;
+
+	if (copy_from_user(&cb, arg, sizeof(cb)))
+		return -EFAULT;
+	if (cb.cb_reserved)
+		return -EINVAL;
+	uents = (ospfs_createent_t __user *) (unsigned long) cb.cb_ents;
+
+	mutex_lock(&dir->i_mutex);
+	if ((r = ospfs_dir_may_change(dir)) < 0) {
+		mutex_unlock(&dir->i_mutex);
+		return r;
+	}
+	ospfs_dcache_build(dir);
+	for (i = 0; i < cb.cb_count; i++) {
+		struct qstr q;
+		struct dentry *d;
+
+		if (copy_from_user(&ce, &uents[i], sizeof(ce))) {
+			r = -EFAULT;
+			break;
+		}
+		q.name = (const unsigned char *) ce.ce_name;
+		q.len = strnlen(ce.ce_name, OSPFS_MAXNAMELEN + 1);
+		if (q.len == 0 || q.len > OSPFS_MAXNAMELEN
+		    || memchr(q.name, '/', q.len)
+		    || (q.name[0] == '.' && (q.len == 1 || (q.len == 2 && q.name[1] == '.')))) {
+			r = -EINVAL;
+			break;
+		}
+
+		// Each file is its own transaction, so a large batch never
+		// overflows the journal.
+		ospfs_journal_start(dir->i_sb);
+		r = ospfs_create_entry(dir, ce.ce_name, q.len,
+				       (ce.ce_mode & S_IALLUGO & ~current->fs->umask) | S_IFREG,
+				       &ino_cursor);
+		ospfs_journal_stop(dir->i_sb);
+		if (r < 0)
+			break;
+		if (put_user((uint32_t) r, &uents[i].ce_ino)) {
+			r = -EFAULT;
+			i++;		// The file was created all the same
+			break;
+		}
+
+		if ((d = d_hash_and_lookup(parent, &q))) {
+			if (!d->d_inode)
+				d_drop(d);
+			dput(d);
+		}
+	}
+	mutex_unlock(&dir->i_mutex);
+
+	return (r < 0 && i == 0 ? r : i);
+}
+
+
 // ospfs_symlink(dirino, dentry, symname)
 //   Linux calls this function to create a symbolic link.
 //   It is the ospfs_dir_inode_ops.symlink callback.
@@ -1687,9 +6574,11 @@ ospfs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidat
 static int
 ospfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
 {       
-	ospfs_inode_t *dir_oi = ospfs_inode(dir->i_ino);
-        ospfs_inode_t *containing_directory = ospfs_inode(dir->i_ino);
+	struct super_block *sb = dir->i_sb;
+        ospfs_inode_t *containing_directory = ospfs_inode(sb, dir->i_ino);
         ospfs_symlink_inode_t *entry_oi;
+        uint32_t entry_off;
+        int r;
 
 
         //Is the name of the file to create too large? is symname too long?
@@ -1698,38 +6587,45 @@ ospfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
             return -ENAMETOOLONG;
 
         //Does directory entry w/ same filename field already exist??
-        if(find_direntry(containing_directory, dentry->d_name.name, dentry->d_name.len))
+        r = find_direntry(dir, dentry->d_name.name, dentry->d_name.len, NULL);
+        if(r < 0)
+            return r;
+        if(r > 0)
             return -EEXIST;
 
-        //Find a free inode 
-        uint32_t entry_ino;
-        for( entry_ino = 0 ; entry_ino < ospfs_super->os_ninodes ; entry_ino++ ) {
-            entry_oi = ospfs_inode(entry_ino);
-            if(!entry_oi->oi_nlink) //Free if no links to the inode
-                break;
-        }
-
-        if( entry_ino == ospfs_super->os_ninodes ) //No more free inodes
-            return -ENOSPC;
+        //Claim a free inode 
+        r = ospfs_alloc_ino(sb, 0);
+        if(r < 0) //No more free inodes
+            return r;
+        uint32_t entry_ino = r;
+        entry_oi = (ospfs_symlink_inode_t *) ospfs_inode(sb, entry_ino);
 
         //Find a free directory entry 
-        ospfs_direntry_t  *new_dir_entry = create_blank_direntry(containing_directory);
-
-        if(IS_ERR(new_dir_entry))
-            return PTR_ERR(new_dir_entry);
+        r = create_blank_direntry(dir, dentry->d_name.name, dentry->d_name.len, &entry_off);
+        if(r < 0) {
+            ospfs_free_ino(sb, entry_ino);
+            return r;
+        }
 
         //If we have both a free directory entry, and inode, populate the two structures
 
-        //Populate the inode
+        //Populate the directory entry first, so that if it fails the
+        //inode can go back to the free pool
+        r = ospfs_dirent_set(sb, containing_directory, entry_off, dentry->d_name.name,
+                             dentry->d_name.len, entry_ino, OSPFS_FTYPE_SYMLINK);
+        if(r < 0) {
+            ospfs_free_ino(sb, entry_ino);
+            return r;
+        }
+        ospfs_dcache_add(dir, dentry->d_name.name, dentry->d_name.len, entry_off);
+
+        //Now populate the inode
         entry_oi->oi_size = strlen(symname);
         entry_oi->oi_ftype = OSPFS_FTYPE_SYMLINK;
         entry_oi->oi_nlink = 1;
         strcpy(entry_oi->oi_symlink, symname);
-
-        //Now populate the directory entry
-        new_dir_entry->od_ino = entry_ino;
-        memcpy(new_dir_entry->od_name, dentry->d_name.name, dentry->d_name.len);
-        new_dir_entry->od_name[dentry->d_name.len] = '\0';
+        ospfs_inode_dirty(sb, entry_ino);
+        ospfs_stat_add(sb, OSPFS_STAT_CREATE, 1);
     
 
 	/* Execute this code after your function has successfully created the
@@ -1743,6 +6639,128 @@ ospfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
 }
 
 
+// ospfs_dir_is_empty(sb, dir_oi)
+//	Returns 1 if directory 'dir_oi' has no live entries, 0 if it has
+//	some, or -EIO.
+
+static int
+ospfs_dir_is_empty(struct super_block *sb, ospfs_inode_t *dir_oi)
+{
+	int packed = ospfs_dir_packed(dir_oi);
+	ospfs_dx_path_t path;
+	uint32_t off;
+	void *blk;
+	int r;
+
+	if (!ospfs_dir_indexed(dir_oi)) {
+		for (off = 0; off < dir_oi->oi_size; off += OSPFS_BLKSIZE) {
+			if (!(blk = ospfs_inode_data(sb, dir_oi, off)))
+				return -EIO;
+			if ((r = ospfs_dirblock_used(blk, packed, NULL, NULL)) != 0)
+				return (r < 0 ? r : 0);
+		}
+		return 1;
+	}
+
+	if ((r = ospfs_dx_probe(sb, dir_oi, 0, &path)) < 0)
+		return r;
+	do {
+		if (!(blk = ospfs_inode_data(sb, dir_oi, path.leaf * OSPFS_BLKSIZE)))
+			return -EIO;
+		if ((r = ospfs_dirblock_used(blk, packed, NULL, NULL)) != 0)
+			return (r < 0 ? r : 0);
+	} while ((r = ospfs_dx_next_leaf(sb, dir_oi, &path)) > 0);
+	return (r < 0 ? r : 1);
+}
+
+
+// ospfs_rename(old_dir, old_dentry, new_dir, new_dentry)
+//   Linux calls this function to rename a file.
+//   It is the ospfs_dir_inode_ops.rename callback.
+//
+//   Inputs: old_dir    -- the directory holding the file's current name
+//           old_dentry -- the file's current name
+//           new_dir    -- the directory to hold the new name (may be
+//                         'old_dir')
+//           new_dentry -- the new name.  If it is positive, the file it
+//                         names is replaced.
+//
+//   Only directory entries move; the file's inode and data are untouched.
+//   (Directories have no ".." entry on disk, so moving a directory to a
+//   new parent needs nothing more.)  If 'new_dentry' names a file, its
+//   entry is pointed at the renamed file in place, so the new name never
+//   disappears, and the replaced file loses a link.  The new name is in
+//   place before the old one is removed, and an error before that point
+//   leaves both directories unchanged.
+//
+//   Returns: 0 on success, -(error code) on error.  In particular:
+//               -ENAMETOOLONG if new_dentry->d_name.len is too large;
+//               -ENOTEMPTY    if 'new_dentry' names a non-empty directory;
+//               -ENOSPC       if 'new_dir' is full and cannot grow;
+//               -EIO          on I/O error.
+
+static int
+ospfs_rename(struct inode *old_dir, struct dentry *old_dentry,
+	     struct inode *new_dir, struct dentry *new_dentry)
+{
+	struct super_block *sb = old_dir->i_sb;
+	struct inode *inode = old_dentry->d_inode;
+	struct inode *victim = new_dentry->d_inode;
+	ospfs_inode_t *old_dir_oi = ospfs_inode(sb, old_dir->i_ino);
+	ospfs_inode_t *new_dir_oi = ospfs_inode(sb, new_dir->i_ino);
+	ospfs_inode_t *oi = ospfs_inode(sb, inode->i_ino);
+	ospfs_dirent_t dn;
+	uint32_t entry_off;
+	int r;
+
+	if (new_dentry->d_name.len > OSPFS_MAXNAMELEN)
+		return -ENAMETOOLONG;
+	if (!old_dir_oi || !new_dir_oi || !oi)
+		return -EIO;
+	if (victim && victim->i_ino == inode->i_ino)
+		return 0;		// Two names for the same file
+	if (victim && S_ISDIR(victim->i_mode)) {
+		ospfs_inode_t *victim_oi = ospfs_inode(sb, victim->i_ino);
+		if (!victim_oi)
+			return -EIO;
+		if ((r = ospfs_dir_is_empty(sb, victim_oi)) <= 0)
+			return (r < 0 ? r : -ENOTEMPTY);
+	}
+
+	// Point the new name at the file.
+	if (victim) {
+		r = find_direntry(new_dir, new_dentry->d_name.name, new_dentry->d_name.len, &dn);
+		if (r <= 0)
+			return (r < 0 ? r : -ENOENT);
+		entry_off = dn.dn_off;
+	} else {
+		r = create_blank_direntry(new_dir, new_dentry->d_name.name, new_dentry->d_name.len, &entry_off);
+		if (r < 0)
+			return r;
+	}
+	r = ospfs_dirent_set(sb, new_dir_oi, entry_off, new_dentry->d_name.name,
+			     new_dentry->d_name.len, inode->i_ino, oi->oi_ftype);
+	if (r < 0)
+		return r;
+	if (!victim)
+		ospfs_dcache_add(new_dir, new_dentry->d_name.name, new_dentry->d_name.len, entry_off);
+
+	// Remove the old name.  Look for it only now: adding the new name
+	// may have moved it, if the directories are the same.
+	r = find_direntry(old_dir, old_dentry->d_name.name, old_dentry->d_name.len, &dn);
+	if (r <= 0)
+		return (r < 0 ? r : -ENOENT);
+	if ((r = ospfs_dirent_clear(sb, old_dir_oi, dn.dn_off)) < 0)
+		return r;
+	ospfs_dcache_remove(old_dir, old_dentry->d_name.name, old_dentry->d_name.len, dn.dn_off);
+	ospfs_dir_shrink(old_dir, dn.dn_hash, dn.dn_off);
+
+	if (victim)
+		return ospfs_drop_link(victim);
+	return 0;
+}
+
+
 // ospfs_follow_link(dentry, nd)
 //   Linux calls this function to follow a symbolic link.
 //   It is the ospfs_symlink_inode_ops.follow_link callback.
@@ -1760,7 +6778,7 @@ static void *
 ospfs_follow_link(struct dentry *dentry, struct nameidata *nd)
 {
 	ospfs_symlink_inode_t *oi =
-		(ospfs_symlink_inode_t *) ospfs_inode(dentry->d_inode->i_ino);
+		(ospfs_symlink_inode_t *) ospfs_inode(dentry->d_inode->i_sb, dentry->d_inode->i_ino);
 	// Exercise: Your code here.
 
         if(strncmp(oi->oi_symlink,"root?",5) == 0) { //This is a conditional link!
@@ -1790,36 +6808,133 @@ ospfs_follow_link(struct dentry *dentry, struct nameidata *nd)
 }
 
 
+// ospfs_journaled_write, ospfs_journaled_setattr, ospfs_journaled_link,
+// ospfs_journaled_unlink, ospfs_journaled_create, ospfs_journaled_symlink,
+// ospfs_journaled_rename
+//	The operations that change metadata, each run in a journal handle
+//	(see ospfs_journal_start) so that its changes commit together.
+//	A write then waits for writeback if too much is dirty (see
+//	ospfs_writeback_throttle).
+
+static ssize_t
+ospfs_journaled_write(struct file *filp, const char __user *buffer, size_t count, loff_t *f_pos)
+{
+	struct super_block *sb = filp->f_dentry->d_inode->i_sb;
+	ssize_t r;
+
+	ospfs_journal_start(sb);
+	r = ospfs_write(filp, buffer, count, f_pos);
+	ospfs_journal_stop(sb);
+	ospfs_writeback_throttle(sb);
+	return r;
+}
+
+static int
+ospfs_journaled_setattr(struct dentry *dentry, struct iattr *attr)
+{
+	struct super_block *sb = dentry->d_inode->i_sb;
+	int r;
+
+	ospfs_journal_start(sb);
+	r = ospfs_notify_change(dentry, attr);
+	ospfs_journal_stop(sb);
+	return r;
+}
+
+static int
+ospfs_journaled_link(struct dentry *src_dentry, struct inode *dir, struct dentry *dst_dentry)
+{
+	int r;
+
+	ospfs_journal_start(dir->i_sb);
+	r = ospfs_link(src_dentry, dir, dst_dentry);
+	ospfs_journal_stop(dir->i_sb);
+	return r;
+}
+
+static int
+ospfs_journaled_unlink(struct inode *dir, struct dentry *dentry)
+{
+	int r;
+
+	ospfs_journal_start(dir->i_sb);
+	r = ospfs_unlink(dir, dentry);
+	ospfs_journal_stop(dir->i_sb);
+	return r;
+}
+
+static int
+ospfs_journaled_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidata *nd)
+{
+	int r;
+
+	ospfs_journal_start(dir->i_sb);
+	r = ospfs_create(dir, dentry, mode, nd);
+	ospfs_journal_stop(dir->i_sb);
+	return r;
+}
+
+static int
+ospfs_journaled_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
+{
+	int r;
+
+	ospfs_journal_start(dir->i_sb);
+	r = ospfs_symlink(dir, dentry, symname);
+	ospfs_journal_stop(dir->i_sb);
+	return r;
+}
+
+static int
+ospfs_journaled_rename(struct inode *old_dir, struct dentry *old_dentry,
+		       struct inode *new_dir, struct dentry *new_dentry)
+{
+	int r;
+
+	ospfs_journal_start(old_dir->i_sb);
+	r = ospfs_rename(old_dir, old_dentry, new_dir, new_dentry);
+	ospfs_journal_stop(old_dir->i_sb);
+	return r;
+}
+
+
 // Define the file system operations structures mentioned above.
 
 static struct file_system_type ospfs_fs_type = {
 	.owner		= THIS_MODULE,
 	.name		= "ospfs",
 	.get_sb		= ospfs_get_sb,
-	.kill_sb	= kill_anon_super
+	.kill_sb	= ospfs_kill_sb
 };
 
 static struct inode_operations ospfs_reg_inode_ops = {
-	.setattr	= ospfs_notify_change
+	.setattr	= ospfs_journaled_setattr
 };
 
 static struct file_operations ospfs_reg_file_ops = {
 	.llseek		= generic_file_llseek,
 	.read		= ospfs_read,
-	.write		= ospfs_write
+	.aio_read	= ospfs_aio_read,
+	.write		= ospfs_journaled_write
+};
+
+static struct address_space_operations ospfs_aops = {
+	.direct_IO	= ospfs_direct_IO
 };
 
 static struct inode_operations ospfs_dir_inode_ops = {
 	.lookup		= ospfs_dir_lookup,
-	.link		= ospfs_link,
-	.unlink		= ospfs_unlink,
-	.create		= ospfs_create,
-	.symlink	= ospfs_symlink
+	.link		= ospfs_journaled_link,
+	.unlink		= ospfs_journaled_unlink,
+	.create		= ospfs_journaled_create,
+	.symlink	= ospfs_journaled_symlink,
+	.rename		= ospfs_journaled_rename
 };
 
 static struct file_operations ospfs_dir_file_ops = {
 	.read		= generic_read_dir,
-	.readdir	= ospfs_dir_readdir
+	.readdir	= ospfs_dir_readdir,
+	.unlocked_ioctl	= ospfs_dir_ioctl
 };
 
 static struct inode_operations ospfs_symlink_inode_ops = {
@@ -1827,11 +6942,15 @@ static struct inode_operations ospfs_symlink_inode_ops = {
 	.follow_link	= ospfs_follow_link
 };
 
-static struct dentry_operations ospfs_dentry_ops = {
-	.d_delete	= ospfs_delete_dentry
-};
 
 static struct super_operations ospfs_superblock_ops = {
+	.alloc_inode	= ospfs_alloc_inode,
+	.destroy_inode	= ospfs_destroy_inode,
+	.delete_inode	= ospfs_delete_inode,
+	.put_super	= ospfs_put_super,
+	.remount_fs	= ospfs_remount_fs,
+	.show_options	= ospfs_show_options,
+	.sync_fs	= ospfs_sync_fs
 };
 
 
@@ -1839,13 +6958,41 @@ static struct super_operations ospfs_superblock_ops = {
 
 static int __init init_ospfs_fs(void)
 {
+	int r;
+
 	eprintk("Loading ospfs module...\n");
-	return register_filesystem(&ospfs_fs_type);
+	ospfs_inode_cachep = kmem_cache_create("ospfs_inode_cache",
+					       sizeof(ospfs_inode_info_t), 0,
+					       SLAB_RECLAIM_ACCOUNT,
+					       ospfs_inode_init_once, NULL);
+	if (!ospfs_inode_cachep)
+		return -ENOMEM;
+	ospfs_dcache_shrinker = set_shrinker(DEFAULT_SEEKS, ospfs_dcache_shrink);
+	if (!ospfs_dcache_shrinker) {
+		kmem_cache_destroy(ospfs_inode_cachep);
+		return -ENOMEM;
+	}
+	if ((r = ospfs_proc_init()) < 0)
+		goto fail_proc;
+	if ((r = register_filesystem(&ospfs_fs_type)) < 0)
+		goto fail_register;
+	return 0;
+
+    fail_register:
+	ospfs_proc_exit();
+    fail_proc:
+	remove_shrinker(ospfs_dcache_shrinker);
+	kmem_cache_destroy(ospfs_inode_cachep);
+	return r;
 }
 
 static void __exit exit_ospfs_fs(void)
 {
 	unregister_filesystem(&ospfs_fs_type);
+	ospfs_proc_exit();
+	remove_shrinker(ospfs_dcache_shrinker);
+	rcu_barrier();		// wait for name cache frees to finish
+	kmem_cache_destroy(ospfs_inode_cachep);
 	eprintk("Unloading ospfs module\n");
 }
 